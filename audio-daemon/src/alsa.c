@@ -40,9 +40,13 @@
 #include <sched.h>
 #include <stdint.h>
 #include <time.h>
+#include <pthread.h>
 #include <speex/speex_echo.h>
 #include <speex/speex_preprocess.h>
 
+#include "stats.h"
+#include "dsp.h"
+#include "resample.h"
 #include "audio-daemon.h"
 #include "mb.h"
 
@@ -54,10 +58,15 @@ static char *device = "asym0";
 static int do_playback_work(struct alsa_stream *as);
 static int do_capture_work(struct alsa_stream *as);
 
-int playback_is_running = 0;
-int capture_is_running = 0;
-SpeexEchoState *echo_state;
-SpeexPreprocessState *preprocess_state;
+/* Longest a period interrupt is held back to merge with others */
+static uint64_t irq_moderation_ns = IRQ_MODERATION_US * 1000ULL;
+static pthread_mutex_t irq_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The host sound card, shared by every guest */
+static struct alsa_mixer mixer = {
+    .lock = PTHREAD_RWLOCK_INITIALIZER,
+    .period_frames = PERIOD_FRAMES,
+};
 
 void refresh_be_info(struct alsa_stream *as, int hw_ptr, int delay,
 		     uint64_t s_time, int status)
@@ -72,7 +81,7 @@ void refresh_be_info(struct alsa_stream *as, int hw_ptr, int delay,
     wmb();
 }
 
-void alsa_refresh_be_playback_info(struct alsa_stream *as, int periods)
+void alsa_refresh_be_playback_info(struct alsa_stream *as, int frames)
 {
     uint64_t time_nsec;
     snd_pcm_sframes_t delay;
@@ -81,7 +90,7 @@ void alsa_refresh_be_playback_info(struct alsa_stream *as, int periods)
     time_nsec = get_nsec_now();
 
     pointer = as->hw_ptr/4;
-    pointer -= (1024 * periods);
+    pointer -= frames;
     if (pointer < 0)
 	pointer += (N_AUD_BUFFER_PAGES * 1024);
     pointer %= (N_AUD_BUFFER_PAGES * 1024);
@@ -98,63 +107,225 @@ void alsa_refresh_be_capture_info(struct alsa_stream *as)
     refresh_be_info(as, as->hw_ptr/4, 0, time_nsec, STREAM_STARTED);
 }
 
-static void get_data_from_sg(int16_t *dst, int size, struct alsa_stream *as)
+/*
+ * The guest DMA buffer is N_AUD_BUFFER_PAGES pages that are not contiguous
+ * in our address space. Rather than locating the page for every sample we
+ * walk it in spans: each span is the longest run starting at hw_ptr that
+ * does not cross a page boundary.
+ */
+#define SG_BUFFER_BYTES (XENVSND_PAGE_SIZE * N_AUD_BUFFER_PAGES)
+#define SG_VOLUME_UNITY 100
+
+static inline int16_t *sg_span(struct alsa_stream *as, int *len)
 {
-    int16_t *src;
-    int val, vol;
+    int off = as->hw_ptr & (XENVSND_PAGE_SIZE - 1);
+
+    if (*len > XENVSND_PAGE_SIZE - off)
+	*len = XENVSND_PAGE_SIZE - off;
+    return (int16_t *)((char *)as->dma_buffer[as->hw_ptr / XENVSND_PAGE_SIZE] + off);
+}
+
+static inline void sg_advance(struct alsa_stream *as, int len)
+{
+    as->processed += len;
+    as->hw_ptr += len;
+    if (as->hw_ptr == SG_BUFFER_BYTES)
+	as->hw_ptr = 0;
+}
+
+static inline int sg_volume(struct alsa_stream *as)
+{
+    int val = SG_VOLUME_UNITY; //as->vol_l;
 
-    val = 100; //as->vol_l;
     if (val < 1)
 	val = 1;
+    return val;
+}
 
-    size = size / 2;
-   
-    while (size--) {
-	src = as->dma_buffer[as->hw_ptr / XENVSND_PAGE_SIZE] + as->hw_ptr % XENVSND_PAGE_SIZE;
-	*dst++ = (*src) * val / 100;
+static void copy_scaled(int16_t *dst, const int16_t *src, int samples, int val)
+{
+    if (val == SG_VOLUME_UNITY) {
+	memcpy(dst, src, samples * sizeof(int16_t));
+	return;
+    }
+    while (samples--)
+	*dst++ = (*src++) * val / SG_VOLUME_UNITY;
+}
 
-	as->processed += 2;
-	as->hw_ptr += 2;
-	if (as->hw_ptr == XENVSND_PAGE_SIZE * N_AUD_BUFFER_PAGES) {
-	    as->hw_ptr = 0;
-	}
+static void get_data_from_sg(int16_t *dst, int size, struct alsa_stream *as)
+{
+    int val = sg_volume(as);
+
+    while (size > 0) {
+	int len = size;
+	int16_t *src = sg_span(as, &len);
+
+	copy_scaled(dst, src, len / 2, val);
+	dst += len / 2;
+	size -= len;
+	sg_advance(as, len);
     }
-    return;   
 }
 
-static void put_data_to_sg(int16_t *dst, int size, struct alsa_stream *as)
+static void put_data_to_sg(int16_t *src, int size, struct alsa_stream *as)
 {
-    int16_t *src;
-    int val, vol;
+    int val = sg_volume(as);
 
-    val = 100; //as->vol_l;
-    if (val < 1)
-	val = 1;
+    while (size > 0) {
+	int len = size;
+	int16_t *dst = sg_span(as, &len);
+
+	copy_scaled(dst, src, len / 2, val);
+	src += len / 2;
+	size -= len;
+	sg_advance(as, len);
+    }
+}
+
+/*
+ * Write frames to the playback PCM, whichever access mode it ended up
+ * with.
+ */
+static snd_pcm_sframes_t alsa_writei(struct alsa_pcm *pcm, const void *buf,
+				     snd_pcm_uframes_t frames)
+{
+    if (pcm->mmap)
+	return snd_pcm_mmap_writei(pcm->handle, buf, frames);
+    return snd_pcm_writei(pcm->handle, buf, frames);
+}
+
+/*
+ * Fetch frames of a guest's playback at the card rate, consuming need
+ * frames of the guest's own rate.
+ */
+static void guest_pull(struct alsa_stream *as, int16_t *dst, int frames, int need)
+{
+    int16_t in[(RESAMPLE_MAX_FRAMES + RESAMPLE_TAPS) * 2];
+
+    if (!resampler_active(&as->rs)) {
+	get_data_from_sg(dst, frames * 4, as);
+	return;
+    }
+    get_data_from_sg(in, need * 4, as);
+    resampler_run(&as->rs, in, need, dst, frames);
+}
 
-    size = size / 2;
+/*
+ * Sum the next frames of every active guest into dst. The first guest is
+ * copied straight in, so with a single guest this is a plain copy. need[]
+ * holds the guest frames each one consumes, NULL when none is resampled.
+ */
+static void mix_guests(int16_t *dst, snd_pcm_uframes_t frames,
+		       struct alsa_stream **src, const int *need, int n)
+{
+    int16_t scratch[MAX_PERIOD_FRAMES * 2];
+    int i;
 
-    while (size--) {
-	src = as->dma_buffer[as->hw_ptr / XENVSND_PAGE_SIZE] + as->hw_ptr % XENVSND_PAGE_SIZE;
-	*src = (*dst++) * val / 100;
+    if (n == 0) {
+	memset(dst, 0, frames * 4);
+	return;
+    }
+    guest_pull(src[0], dst, frames, need ? need[0] : frames);
+    for (i = 1; i < n; i++) {
+	guest_pull(src[i], scratch, frames, need ? need[i] : frames);
+	dsp_add_sat(dst, scratch, frames * 2);
+    }
+}
+
+/*
+ * Whether the mmap ring of a prepared PCM is laid out the way the
+ * zero-copy path writes it: one interleaved area of S16 stereo frames,
+ * each 32 bits from the last. Anything else (more channels, padding)
+ * goes through snd_pcm_mmap_writei, which knows the layout.
+ */
+static int alsa_mmap_packed_s16(struct alsa_pcm *pcm)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, len = 0;
+    int packed;
 
-	as->processed += 2;
-	as->hw_ptr += 2;
-	if (as->hw_ptr == XENVSND_PAGE_SIZE * N_AUD_BUFFER_PAGES) {
-	    as->hw_ptr = 0;
+    if (pcm->format != DSP_FORMAT_S16 ||
+	snd_pcm_mmap_begin(pcm->handle, &areas, &offset, &len) < 0)
+	return 0;
+    packed = areas[0].step == 32 && areas[0].first % 8 == 0 &&
+	     areas[1].addr == areas[0].addr && areas[1].first == areas[0].first + 16;
+    snd_pcm_mmap_commit(pcm->handle, offset, 0);
+    return packed;
+}
+
+/*
+ * Zero-copy playback: mix one period straight from the guest pages into
+ * the ALSA ring. Only used when the ring is packed S16 stereo (see
+ * alsa_mmap_packed_s16) and no active guest is resampled, so each chunk consumes exactly its length. The echo
+ * reference is downmixed from the area we just filled, before it is
+ * committed. Returns the number of frames written or
+ * a negative ALSA error.
+ */
+static snd_pcm_sframes_t alsa_mmap_write_mix(struct alsa_pcm *pcm,
+					     snd_pcm_uframes_t frames,
+					     struct alsa_stream **src, int n,
+					     int16_t *echo_ref)
+{
+    const snd_pcm_channel_area_t *areas;
+    snd_pcm_uframes_t offset, todo = frames;
+    snd_pcm_sframes_t committed;
+    int16_t *area;
+    int err;
+
+    while (todo > 0) {
+	snd_pcm_uframes_t len = todo;
+
+	err = snd_pcm_mmap_begin(pcm->handle, &areas, &offset, &len);
+	if (err < 0)
+	    return err;
+
+	area = (int16_t *)((char *)areas[0].addr + (areas[0].first / 8) +
+			   offset * areas[0].step / 8);
+	mix_guests(area, len, src, NULL, n);
+	if (echo_ref) {
+	    dsp_downmix(area, echo_ref, len);
+	    echo_ref += len;
 	}
+
+	committed = snd_pcm_mmap_commit(pcm->handle, offset, len);
+	if (committed < 0)
+	    return committed;
+	if ((snd_pcm_uframes_t)committed != len)
+	    return -EPIPE;
+	todo -= len;
     }
-    return;    
+
+    return frames;
 }
 
+/* Card formats in order of preference, S16 needing no conversion */
+static const struct {
+    snd_pcm_format_t alsa;
+    enum dsp_format dsp;
+} host_formats[] = {
+    { SND_PCM_FORMAT_S16, DSP_FORMAT_S16 },
+    { SND_PCM_FORMAT_S32, DSP_FORMAT_S32 },
+    { SND_PCM_FORMAT_S24, DSP_FORMAT_S24 },
+    { SND_PCM_FORMAT_FLOAT, DSP_FORMAT_FLOAT },
+};
+
+/*
+ * Pick the sample format and rate the card supports natively, so ALSA
+ * never converts behind our back. *rate is the preferred rate on entry
+ * and the one the card accepted on return.
+ */
 static int set_hwparams(snd_pcm_t *handle,
 			snd_pcm_hw_params_t *params,
 			snd_pcm_access_t access,
 			int period_frames,
-			int buffer_frames)
+			int buffer_frames,
+			unsigned int *rate,
+			enum dsp_format *format)
 {
+    static const unsigned int fallback_rates[] = { SAMPLE_RATE, 48000 };
     unsigned int rrate;
     snd_pcm_uframes_t size;
-    int err, dir;
+    int err, dir, i;
 
     /* choose all parameters */
     err = snd_pcm_hw_params_any(handle, params);
@@ -174,32 +345,49 @@ static int set_hwparams(snd_pcm_t *handle,
 	printf("Access type not available for playback: %s\n", snd_strerror(err));
 	return err;
     }
-    /* set the sample format */
-    err = snd_pcm_hw_params_set_format(handle, params, SND_PCM_FORMAT_S16);
+    /* set the sample format; zero-copy mixing needs S16 in the mmap area */
+    err = -EINVAL;
+    for (i = 0; i < sizeof(host_formats) / sizeof(host_formats[0]); i++) {
+	if (access == SND_PCM_ACCESS_MMAP_INTERLEAVED && host_formats[i].dsp != DSP_FORMAT_S16)
+	    break;
+	if (snd_pcm_hw_params_test_format(handle, params, host_formats[i].alsa) == 0) {
+	    err = snd_pcm_hw_params_set_format(handle, params, host_formats[i].alsa);
+	    break;
+	}
+    }
     if (err < 0) {
 	printf("Sample format not available for playback: %s\n", snd_strerror(err));
 	return err;
     }
+    *format = host_formats[i].dsp;
     /* set the count of channels */
     err = snd_pcm_hw_params_set_channels(handle, params, 2);
     if (err < 0) {
 	printf("Channels count (%i) not available for playbacks: %s\n", 2, snd_strerror(err));
 	return err;
     }
-    /* set the stream rate */
-    rrate = SAMPLE_RATE;
+    /* set the stream rate: the preferred one, a common one, or the nearest */
+    rrate = *rate ? *rate : SAMPLE_RATE;
+    if (snd_pcm_hw_params_test_rate(handle, params, rrate, 0) < 0) {
+	for (i = 0; i < sizeof(fallback_rates) / sizeof(fallback_rates[0]); i++) {
+	    rrate = fallback_rates[i];
+	    if (snd_pcm_hw_params_test_rate(handle, params, rrate, 0) == 0)
+		break;
+	}
+    }
     err = snd_pcm_hw_params_set_rate_near(handle, params, &rrate, 0);
     if (err < 0) {
-	printf("Rate %iHz not available for playback: %s\n", SAMPLE_RATE, snd_strerror(err));
+	printf("Rate %iHz not available for playback: %s\n", rrate, snd_strerror(err));
 	return err;
     }
-    if (rrate != SAMPLE_RATE) {
-	printf("Rate doesn't match (requested %iHz, get %iHz)\n", SAMPLE_RATE, err);
+    if (rrate * MAX_RATE_RATIO < SAMPLE_RATE || rrate > SAMPLE_RATE * MAX_RATE_RATIO) {
+	printf("Rate %iHz too far from %iHz\n", rrate, SAMPLE_RATE);
 	return -EINVAL;
     }
+    *rate = rrate;
     err = snd_pcm_hw_params_set_buffer_size(handle, params, buffer_frames);
     if (err < 0) {
-	printf("Unable to set buffer time %i for playback: %s\n", 2048, snd_strerror(err));
+	printf("Unable to set buffer time %i for playback: %s\n", buffer_frames, snd_strerror(err));
 	return err;
     }
     err = snd_pcm_hw_params_get_buffer_size(params, &size);
@@ -286,8 +474,8 @@ static int xrun_recovery(snd_pcm_t *handle, int err)
 static int alsa_prepare(struct alsa_stream *as)
 {
     pthread_mutex_lock(&as->mutex);   
-    snd_pcm_prepare(as->handle);
     as->hw_ptr = as->processed = as->processed_periods = 0;
+    as->is_running = 0;
     pthread_mutex_unlock(&as->mutex);   
     return 0;
 }
@@ -306,235 +494,711 @@ int alsa_get_live_frames(struct alsa_stream *as)
     return pv_avail;
 }
 
-char null_buffer[4096] = {0};
-char prev_buf_1[4096] = {0};
-char prev_buf_2[4096] = {0};
-char mono_input[4096] = {0};
+/* a period of silence in any host format */
+char null_buffer[MAX_PERIOD_FRAMES * 2 * sizeof(int32_t)] = {0};
 
-static void fill_averege(int16_t *src, int16_t *dst)
+/*
+ * Echo reference handoff: the playback thread pushes the downmixed period
+ * it just queued, the capture thread pops it to feed speex. One producer,
+ * one consumer, so a pair of indexes is all the synchronisation needed.
+ */
+static int16_t *echo_ref_push_slot(struct echo_ref *er)
 {
-    int i;
-    for (i=0; i<2048; i+=2) {
-	dst[i/2] = (src[i] + src[i+1])/2;
-    }
+    uint32_t prod = er->prod;
+
+    if (prod - ring_load_acquire(&er->cons) == ECHO_REF_SLOTS)
+	return NULL;
+    return er->frames[prod % ECHO_REF_SLOTS];
 }
 
-static void double_mono(int16_t *src, int16_t *dst)
+static void echo_ref_push_commit(struct echo_ref *er)
 {
-    int i;
-    for (i=0; i<2048; i+=2) {
-	dst[i] = dst[i+1] = src[i/2];
+    ring_store_release(&er->prod, er->prod + 1);
+}
+
+static void echo_ref_pop(struct echo_ref *er, int16_t *dst, int frames)
+{
+    uint32_t cons = er->cons;
+    uint32_t prod = ring_load_acquire(&er->prod);
+
+    if (prod == cons) {
+	/* playback is idle or late, nothing to cancel */
+	memset(dst, 0, frames * sizeof(int16_t));
+	return;
     }
+    /* keep the reference at most ECHO_REF_LAG periods behind */
+    if (prod - cons > ECHO_REF_LAG)
+	cons = prod - ECHO_REF_LAG;
+    memcpy(dst, er->frames[cons % ECHO_REF_SLOTS], frames * sizeof(int16_t));
+    ring_store_release(&er->cons, cons + 1);
 }
 
-int number = 0;
-static void alsa_repare(struct xen_vsnd_backend *xvb)
+static void alsa_set_realtime(struct alsa_pcm *pcm)
 {
-    snd_pcm_drop(xvb->p.handle);
-    snd_pcm_drop(xvb->c.handle);
-    snd_pcm_resume(xvb->p.handle);
-    snd_pcm_resume(xvb->c.handle);
-    snd_pcm_prepare(xvb->p.handle);
-    snd_pcm_prepare(xvb->c.handle);
-    number = 0;
-    snd_pcm_start(xvb->c.handle);
+    struct sched_param param;
+    int err;
+
+    param.sched_priority = AUDIO_RT_PRIORITY;
+    err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err)
+	printf("%s worker: no SCHED_FIFO (%s), running with normal priority\n",
+	       pcm->stream_type == XC_STREAM_PLAYBACK ? "playback" : "capture",
+	       strerror(err));
 }
 
-static void capture_callback(snd_async_handler_t *ahandler)
+static int alsa_pcm_running(struct alsa_pcm *pcm)
 {
-    struct xen_vsnd_backend *xvb = snd_async_handler_get_callback_private(ahandler);
-    char orig_input[4096];
-    char clean_input[4096];
-    char output_frame[4096];
-    int generate_period = 0;
-    struct alsa_stream *as;
-    int read, written;
-    int avail;
+    return __atomic_load_n(&pcm->running, __ATOMIC_ACQUIRE);
+}
+
+/* Recover one PCM after an error, without touching the other one. */
+static int alsa_pcm_recover(struct alsa_pcm *pcm, int err)
+{
+    uint64_t start = stats_now_ns();
 
-    if (number == 0) {
-    	written = snd_pcm_writei(xvb->p.handle, null_buffer, 1024);
-    	written = snd_pcm_writei(xvb->p.handle, null_buffer, 1024);
-    	written = snd_pcm_writei(xvb->p.handle, null_buffer, 1024);
-    	number = 1;
+    printf("%s recovery for %s\n",
+	   pcm->stream_type == XC_STREAM_PLAYBACK ? "playback" : "capture",
+	   snd_strerror(err));
+    pcm->stats->xruns++;
+    err = xrun_recovery(pcm->handle, err);
+    if (err < 0) {
+	snd_pcm_drop(pcm->handle);
+	err = snd_pcm_prepare(pcm->handle);
     }
+    stats_hist_add(&pcm->stats->recovery, stats_now_ns() - start);
+    return err;
+}
 
-    as = &xvb->c;
-    avail = snd_pcm_avail(as->handle);
-    if (avail < 0) {
-	printf("restarting for avail=%d\n", avail);
-	alsa_repare(xvb);
-	return;
+/*
+ * Wait for the next period, recording how long we were away. A pending
+ * interrupt deadline cuts the wait short so it is delivered on time.
+ */
+static uint64_t alsa_pcm_wait(struct alsa_pcm *pcm, uint64_t *last_wakeup,
+			      uint64_t irq_deadline)
+{
+    int timeout = WORKER_WAIT_MS;
+    uint64_t now;
+
+    if (irq_deadline) {
+	now = stats_now_ns();
+	if (irq_deadline <= now)
+	    timeout = 1;
+	else if ((irq_deadline - now + 999999) / 1000000 < timeout)
+	    timeout = (irq_deadline - now + 999999) / 1000000;
     }
+    snd_pcm_wait(pcm->handle, timeout);
+    now = stats_now_ns();
+    if (*last_wakeup)
+	stats_hist_add(&pcm->stats->wakeup, now - *last_wakeup);
+    *last_wakeup = now;
+    return now;
+}
 
-    if (avail < 1024)
-	return;
+static void playback_prefill(struct alsa_pcm *pcm)
+{
+    int i;
 
-    read = snd_pcm_readi(as->handle, orig_input, PERIOD_FRAMES);
-    if (read < 0) {
-	printf("restarting for read=%d\n", read);
-	alsa_repare(xvb);
-	return;
-    }
-    pthread_mutex_lock(&as->mutex);
-    if (capture_is_running > 1) {
+    for (i = 0; i < PREFILL_PERIODS; i++)
+	alsa_writei(pcm, null_buffer, mixer.period_frames);
+}
 
-	fill_averege(orig_input, mono_input);
+/*
+ * Account for frames moved on a guest stream. Returns 1 once the periods
+ * the guest wants per interrupt have gone by.
+ */
+static int guest_period_elapsed(struct alsa_stream *as, int frames)
+{
+    int irq_frames = as->period_frames * as->irq_periods;
 
-	speex_echo_playback(echo_state, prev_buf_2); 
-	speex_echo_capture(echo_state, mono_input, clean_input); 
-	speex_preprocess_run(preprocess_state, clean_input); 
+    as->irq_frames += frames;
+    if (as->irq_frames < irq_frames)
+	return 0;
+    as->irq_frames -= irq_frames;
+    return 1;
+}
 
-	double_mono(clean_input, orig_input);
+static void guest_kick(struct xen_vsnd_backend *xvb)
+{
+    xvb->stats->kicks++;
+    generate_period_interrupt(xvb);
+}
 
-	put_data_to_sg((uint16_t *)orig_input, read * 4, as);
-	alsa_refresh_be_capture_info(as);
-	generate_period = 1;
-    } else if (capture_is_running == 1){
-	capture_is_running = 2;
-	/* nothing else to do */
+/*
+ * Interrupt moderation. Period interrupts of a guest, from either
+ * direction, open a window of irq_moderation_ns; everything else that
+ * elapses for that guest before it closes rides on the same event
+ * channel kick. Both workers close expired windows and sleep no longer
+ * than the next one. Returns the earliest deadline still pending, 0 if
+ * none. Called with mixer.lock held for reading.
+ */
+static uint64_t guest_interrupts(const int *notify, uint64_t now)
+{
+    uint64_t next = 0;
+    int i;
+
+    pthread_mutex_lock(&irq_lock);
+    for (i = 0; i < mixer.n_guests; i++) {
+	struct xen_vsnd_backend *xvb = mixer.guests[i];
+
+	if (notify[i]) {
+	    if (!irq_moderation_ns) {
+		guest_kick(xvb);
+		continue;
+	    }
+	    if (!xvb->irq_deadline)
+		xvb->irq_deadline = now + irq_moderation_ns;
+	}
+	if (!xvb->irq_deadline)
+	    continue;
+	if (xvb->irq_deadline <= now) {
+	    xvb->irq_deadline = 0;
+	    guest_kick(xvb);
+	} else if (!next || xvb->irq_deadline < next) {
+	    next = xvb->irq_deadline;
+	}
     }
-    pthread_mutex_unlock(&as->mutex);
+    pthread_mutex_unlock(&irq_lock);
 
-    as = &xvb->p;
-    avail = snd_pcm_avail(as->handle);
-    if (avail < 0) {
-	printf("restarting for avail=%d\n", avail);
-	alsa_repare(xvb);
-	return;
+    return next;
+}
+
+void alsa_set_irq_moderation(int usec)
+{
+    irq_moderation_ns = usec > 0 ? usec * 1000ULL : 0;
+}
+
+/*
+ * Mix and queue one host period from every guest that has one ready.
+ * Called with mixer.lock held for reading. Guests whose own period
+ * elapsed are flagged in notify[]. Returns frames written or a negative
+ * ALSA error.
+ */
+static snd_pcm_sframes_t playback_period(int *notify)
+{
+    struct alsa_pcm *pcm = &mixer.p;
+    int frames = mixer.period_frames;
+    struct alsa_stream *active[MAX_GUESTS];
+    int guest[MAX_GUESTS];
+    int need[MAX_GUESTS];
+    int16_t output_frame[MAX_PERIOD_FRAMES * 2];
+    int32_t host_frame[MAX_PERIOD_FRAMES * 2];
+    int16_t *echo;
+    snd_pcm_sframes_t written;
+    int i, n = 0, resampling = 0, direct;
+
+    echo = echo_ref_push_slot(&mixer.echo);
+
+    /* active guests stay locked until their period has been consumed */
+    for (i = 0; i < mixer.n_guests; i++) {
+	struct alsa_stream *as = &mixer.guests[i]->p;
+
+	pthread_mutex_lock(&as->mutex);
+	if (as->is_running) {
+	    int live = alsa_get_live_frames(as);
+
+	    stats_stream_fill(as->stats, live);
+	    need[n] = resampler_needed(&as->rs, frames);
+	    if (live >= need[n]) {
+		resampling |= resampler_active(&as->rs);
+		guest[n] = i;
+		active[n++] = as;
+		continue;
+	    }
+	}
+	pthread_mutex_unlock(&as->mutex);
     }
-    pthread_mutex_lock(&as->mutex);
-    if ((playback_is_running == 0) || (alsa_get_live_frames(as) < 1024) ) {
-	memcpy(output_frame, null_buffer, 4096);
+
+    direct = pcm->mmap_direct && !resampling;
+    if (direct) {
+	written = alsa_mmap_write_mix(pcm, frames, active, n, echo);
     } else {
-	get_data_from_sg((uint16_t *)output_frame, PERIOD_FRAMES * 4, as);
- 
-	if(playback_is_running < 2) {
-	    playback_is_running++;
-	} else {
-	    alsa_refresh_be_playback_info(as, 1);
-	    generate_period = 1;
+	mix_guests(output_frame, frames, active, need, n);
+	if (echo)
+	    dsp_downmix(output_frame, echo, frames);
+	written = 0;
+    }
+
+    for (i = 0; i < n; i++) {
+	struct alsa_stream *as = active[i];
+
+	as->stats->periods++;
+	if (as->is_running < 2) {
+	    as->is_running++;
+	} else if (guest_period_elapsed(as, need[i])) {
+	    alsa_refresh_be_playback_info(as, need[i]);
+	    as->stats->interrupts++;
+	    notify[guest[i]] = 1;
 	}
+	pthread_mutex_unlock(&as->mutex);
     }
-    pthread_mutex_unlock(&as->mutex);
 
-    written = snd_pcm_writei(as->handle, output_frame, PERIOD_FRAMES);
-    if (written < 0) {
-	printf("restarting for snd_pcm_writei: written=%d\n", written);
-	alsa_repare(xvb);
-	return;
+    if (!direct && pcm->format == DSP_FORMAT_S16)
+	written = alsa_writei(pcm, output_frame, frames);
+    else if (!direct) {
+	dsp_from_s16(host_frame, output_frame, frames * 2, pcm->format);
+	written = alsa_writei(pcm, host_frame, frames);
     }
-    memcpy(prev_buf_2, prev_buf_1, 2048);
-    fill_averege(output_frame, prev_buf_1);
+    if (echo && written >= 0)
+	echo_ref_push_commit(&mixer.echo);
+
+    return written;
+}
+
+void *playback_worker_thread(void *arg)
+{
+    struct alsa_pcm *pcm = arg;
+    snd_pcm_sframes_t avail, written, delay;
+    uint64_t last_wakeup = 0, woken, irq_deadline = 0;
+    int notify[MAX_GUESTS];
+
+    alsa_set_realtime(pcm);
+    playback_prefill(pcm);
+
+    while (alsa_pcm_running(pcm)) {
+	woken = alsa_pcm_wait(pcm, &last_wakeup, irq_deadline);
+
+	avail = snd_pcm_avail_update(pcm->handle);
+	if (avail < 0) {
+	    if (alsa_pcm_recover(pcm, avail) == 0)
+		playback_prefill(pcm);
+	    continue;
+	}
+
+	pthread_rwlock_rdlock(&mixer.lock);
+	memset(notify, 0, sizeof(notify));
+	while (avail >= mixer.period_frames) {
+	    written = playback_period(notify);
+	    if (written < 0) {
+		if (alsa_pcm_recover(pcm, written) == 0)
+		    playback_prefill(pcm);
+		break;
+	    }
+	    avail -= mixer.period_frames;
+	    pcm->stats->periods++;
+	}
+	irq_deadline = guest_interrupts(notify, stats_now_ns());
+	pthread_rwlock_unlock(&mixer.lock);
 
-    if (generate_period)
-	generate_period_interrupt();
+	if (snd_pcm_delay(pcm->handle, &delay) == 0) {
+	    pcm->stats->delay_frames = delay;
+	    if (delay > pcm->stats->delay_frames_max)
+		pcm->stats->delay_frames_max = delay;
+	}
+	stats_hist_add(&pcm->stats->work, stats_now_ns() - woken);
+    }
 
+    return NULL;
 }
 
+/*
+ * Hand one captured period to every guest that is recording, each through
+ * its own echo canceller. Speex works on ECHO_FRAME_FRAMES at a time so
+ * its state doesn't depend on the period size. Called with mixer.lock
+ * held for reading.
+ */
+static void capture_period(int16_t *mono_input, int16_t *echo, int frames,
+			   int *notify)
+{
+    int16_t clean_input[MAX_PERIOD_FRAMES];
+    int16_t output[MAX_PERIOD_FRAMES * 2];
+    int16_t resampled[(RESAMPLE_MAX_FRAMES + RESAMPLE_TAPS) * 2];
+    uint64_t start;
+    int i, off, n;
+
+    for (i = 0; i < mixer.n_guests; i++) {
+	struct xen_vsnd_backend *xvb = mixer.guests[i];
+	struct alsa_stream *as = &xvb->c;
+
+	pthread_mutex_lock(&as->mutex);
+	if (as->is_running > 1) {
+	    pthread_mutex_unlock(&as->mutex);
+
+	    start = stats_now_ns();
+	    for (off = 0; off < frames; off += ECHO_FRAME_FRAMES) {
+		speex_echo_playback(xvb->echo_state, echo + off);
+		speex_echo_capture(xvb->echo_state, mono_input + off, clean_input + off);
+		speex_preprocess_run(xvb->preprocess_state, clean_input + off);
+	    }
+	    as->stats->echo_cancel_ns += stats_now_ns() - start;
+	    dsp_upmix(clean_input, output, frames);
+
+	    pthread_mutex_lock(&as->mutex);
+	    /* The guest may have stopped the stream, or stopped and
+	     * restarted it, while the lock was dropped. */
+	    if (as->is_running <= 1) {
+		pthread_mutex_unlock(&as->mutex);
+		continue;
+	    }
+	    if (resampler_active(&as->rs)) {
+		n = resampler_run(&as->rs, output, frames, resampled,
+				  resampler_max_out(&as->rs, frames));
+		put_data_to_sg(resampled, n * 4, as);
+	    } else {
+		n = frames;
+		put_data_to_sg(output, frames * 4, as);
+	    }
+	    as->stats->periods++;
+	    stats_stream_fill(as->stats, alsa_get_live_frames(as));
+	    if (guest_period_elapsed(as, n)) {
+		alsa_refresh_be_capture_info(as);
+		as->stats->interrupts++;
+		notify[i] = 1;
+	    }
+	} else if (as->is_running == 1) {
+	    as->is_running = 2;
+	    /* nothing else to do */
+	}
+	pthread_mutex_unlock(&as->mutex);
+    }
+}
 
-int alsa_open(struct alsa_stream *as, struct xen_vsnd_backend *xvb)
+void *capture_worker_thread(void *arg)
+{
+    struct alsa_pcm *pcm = arg;
+    int frames = mixer.period_frames;
+    int16_t input[MAX_PERIOD_FRAMES * 2];
+    int32_t host_frame[MAX_PERIOD_FRAMES * 2];
+    void *buf = pcm->format == DSP_FORMAT_S16 ? (void *)input : (void *)host_frame;
+    int16_t mono_input[MAX_PERIOD_FRAMES];
+    int16_t echo[MAX_PERIOD_FRAMES];
+    snd_pcm_sframes_t avail, read;
+    uint64_t last_wakeup = 0, woken, irq_deadline = 0;
+    int notify[MAX_GUESTS];
+
+    alsa_set_realtime(pcm);
+    snd_pcm_start(pcm->handle);
+
+    while (alsa_pcm_running(pcm)) {
+	woken = alsa_pcm_wait(pcm, &last_wakeup, irq_deadline);
+
+	avail = snd_pcm_avail_update(pcm->handle);
+	if (avail < 0) {
+	    if (alsa_pcm_recover(pcm, avail) == 0)
+		snd_pcm_start(pcm->handle);
+	    continue;
+	}
+
+	pthread_rwlock_rdlock(&mixer.lock);
+	memset(notify, 0, sizeof(notify));
+	while (avail >= frames) {
+	    read = snd_pcm_readi(pcm->handle, buf, frames);
+	    if (read < 0) {
+		if (alsa_pcm_recover(pcm, read) == 0)
+		    snd_pcm_start(pcm->handle);
+		break;
+	    }
+	    avail -= read;
+	    if (read < frames)
+		break;
+	    if (buf != input)
+		dsp_to_s16(input, host_frame, frames * 2, pcm->format);
+
+	    /* consume the reference even while nobody is capturing, so it
+	     * doesn't go stale */
+	    echo_ref_pop(&mixer.echo, echo, frames);
+	    if (pcm->rate != mixer.p.rate)
+		memset(echo, 0, sizeof(echo));
+	    dsp_downmix(input, mono_input, frames);
+	    capture_period(mono_input, echo, frames, notify);
+	    pcm->stats->periods++;
+	}
+	irq_deadline = guest_interrupts(notify, stats_now_ns());
+	pthread_rwlock_unlock(&mixer.lock);
+
+	stats_hist_add(&pcm->stats->work, stats_now_ns() - woken);
+    }
+
+    return NULL;
+}
+
+static void alsa_start_worker(struct alsa_pcm *pcm, void *(*fn)(void *))
 {
     int err;
+
+    __atomic_store_n(&pcm->running, 1, __ATOMIC_RELEASE);
+    err = pthread_create(&pcm->worker_thread, NULL, fn, pcm);
+    if (err) {
+	printf("Unable to start worker thread: %s\n", strerror(err));
+	exit(EXIT_FAILURE);
+    }
+}
+
+static void alsa_stop_worker(struct alsa_pcm *pcm)
+{
+    if (!alsa_pcm_running(pcm))
+	return;
+    __atomic_store_n(&pcm->running, 0, __ATOMIC_RELEASE);
+    pthread_join(pcm->worker_thread, NULL);
+}
+
+static int alsa_pcm_open(struct alsa_pcm *pcm)
+{
+    snd_pcm_hw_params_t *hwparams;
+    snd_pcm_sw_params_t *swparams;
+    int err;
     int period_frames;
     int buffer_frames;
 
-    pthread_mutex_lock(&as->mutex);
-
-    snd_pcm_hw_params_alloca(&as->hwparams);
-    snd_pcm_sw_params_alloca(&as->swparams);
+    snd_pcm_hw_params_alloca(&hwparams);
+    snd_pcm_sw_params_alloca(&swparams);
 
-    err = snd_output_stdio_attach(&output, stdout, 0);
-    if (err < 0) {
-	printf("Output failed: %s\n", snd_strerror(err));
-	return 0;
+    if (!output) {
+	err = snd_output_stdio_attach(&output, stdout, 0);
+	if (err < 0) {
+	    printf("Output failed: %s\n", snd_strerror(err));
+	    return err;
+	}
     }
 
-    if (as->stream_type == XC_STREAM_PLAYBACK) {
-	period_frames = P_PERIOD_FRAMES;
-	buffer_frames = P_BUFFER_FRAMES;
-	if ((err = snd_pcm_open(&as->handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+    period_frames = mixer.period_frames;
+    buffer_frames = mixer.period_frames * HOST_BUFFER_PERIODS;
+
+    if (pcm->stream_type == XC_STREAM_PLAYBACK) {
+	if ((err = snd_pcm_open(&pcm->handle, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
 	    printf("Playback open error: %s\n", snd_strerror(err));
-	    return 0;
+	    return err;
 	}
     } else {
-	period_frames = C_PERIOD_FRAMES;
-	buffer_frames = C_BUFFER_FRAMES;
-	if ((err = snd_pcm_open(&as->handle, device, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
+	if ((err = snd_pcm_open(&pcm->handle, device, SND_PCM_STREAM_CAPTURE, 0)) < 0) {
 	    printf("Capture open error: %s\n", snd_strerror(err));
-	    return 0;
+	    return err;
 	}
     }
 
-    if ((err = set_hwparams(as->handle, as->hwparams, SND_PCM_ACCESS_RW_INTERLEAVED,
-			    period_frames, buffer_frames)) < 0) {
+    /* Capture asks for the playback rate so the echo reference lines up */
+    pcm->rate = pcm->stream_type == XC_STREAM_CAPTURE ? mixer.p.rate : SAMPLE_RATE;
+
+    /* Playback prefers mmap access so periods can go straight from the
+     * guest pages to the device */
+    pcm->mmap = 0;
+    if (pcm->stream_type == XC_STREAM_PLAYBACK &&
+	set_hwparams(pcm->handle, hwparams, SND_PCM_ACCESS_MMAP_INTERLEAVED,
+		     period_frames, buffer_frames, &pcm->rate, &pcm->format) == 0)
+	pcm->mmap = 1;
+    else if ((err = set_hwparams(pcm->handle, hwparams, SND_PCM_ACCESS_RW_INTERLEAVED,
+				 period_frames, buffer_frames, &pcm->rate, &pcm->format)) < 0) {
 	printf("Setting of p_hwparams failed: %s\n", snd_strerror(err));
-	exit(EXIT_FAILURE);
+	snd_pcm_close(pcm->handle);
+	return err;
     }
-    if ((err = set_swparams(as->handle, as->swparams)) < 0) {
+    printf("%s: %u Hz, %d bytes per sample%s\n",
+	   pcm->stream_type == XC_STREAM_PLAYBACK ? "playback" : "capture",
+	   pcm->rate, dsp_format_bytes(pcm->format),
+	   pcm->format == DSP_FORMAT_FLOAT ? " (float)" : "");
+    if (pcm->stream_type == XC_STREAM_CAPTURE && pcm->rate != mixer.p.rate)
+	printf("capture at %u Hz, playback at %u Hz: echo cancellation disabled\n",
+	       pcm->rate, mixer.p.rate);
+    if ((err = set_swparams(pcm->handle, swparams)) < 0) {
 	printf("Setting of p_swparams failed: %s\n", snd_strerror(err));
-	exit(EXIT_FAILURE);
+	snd_pcm_close(pcm->handle);
+	return err;
     }
 
-    if (as->stream_type == XC_STREAM_PLAYBACK) {
-    	/* nothing to do, we only rely on the capture callback */
-    } else {
-    	err = snd_async_add_pcm_handler(&as->ahandler, as->handle, capture_callback, xvb);
-    	if (err < 0) {
-    	    printf("Unable to register async handler\n");
-    	    exit(EXIT_FAILURE);
-    	}
+    //snd_pcm_dump(pcm->handle, output);
+    if ((err = snd_pcm_prepare(pcm->handle)) < 0) {
+	snd_pcm_close(pcm->handle);
+	return err;
     }
 
-    //snd_pcm_dump(as->handle, output);
-    pthread_mutex_unlock(&as->mutex);
+    pcm->mmap_direct = pcm->mmap && alsa_mmap_packed_s16(pcm);
+    return 0;
 }
 
-void init_alsa(struct xen_vsnd_backend *xvb)
+/*
+ * Open the card for the first guest; later guests are mixed into the
+ * same PCMs.
+ */
+static int alsa_mixer_start(void)
 {
-    struct alsa_stream *as;
-    int written;
+    printf("opening %s, period %d frames\n", device, mixer.period_frames);
+
+    stats->period_frames = mixer.period_frames;
+
+    mixer.p.stream_type = XC_STREAM_PLAYBACK;
+    mixer.p.stats = &stats->p;
+    if (alsa_pcm_open(&mixer.p) < 0)
+	return -1;
+    mixer.c.stream_type = XC_STREAM_CAPTURE;
+    mixer.c.stats = &stats->c;
+    if (alsa_pcm_open(&mixer.c) < 0) {
+	snd_pcm_close(mixer.p.handle);
+	return -1;
+    }
 
-    printf("init_alsa\n");
+    memset(&mixer.echo, 0, sizeof(mixer.echo));
 
-    as = &xvb->p;
-    as->stream_type = XC_STREAM_PLAYBACK;
-    alsa_open(as, xvb);
-    alsa_prepare(as);
+    /* Each direction gets its own thread so a slow capture path (speex)
+     * can't starve playback */
+    alsa_start_worker(&mixer.p, playback_worker_thread);
+    alsa_start_worker(&mixer.c, capture_worker_thread);
+    mixer.open = 1;
+    return 0;
+}
+
+static void alsa_mixer_stop(void)
+{
+    if (!mixer.open)
+	return;
+    mixer.open = 0;
+    printf("closing %s\n", device);
 
-    as = &xvb->c;
-    as->stream_type = XC_STREAM_CAPTURE;
-    alsa_open(as, xvb);
-    alsa_prepare(as);
+    alsa_stop_worker(&mixer.p);
+    alsa_stop_worker(&mixer.c);
+    snd_pcm_close(mixer.p.handle);
+    snd_pcm_close(mixer.c.handle);
+}
 
-    //snd_pcm_link(xvb->c.handle, xvb->p.handle);
+/* Period a stream gets for the parameters its frontend sent at open */
+static int negotiate_period(const struct fe_cmd *fe_cmd)
+{
+    const struct fe_open_params *params = (const void *)fe_cmd->data;
+    int frames = params->period_frames;
+
+    if (frames == 0) {
+	switch (params->latency_mode) {
+	case XC_LATENCY_LOW:
+	    frames = LOW_LATENCY_PERIOD_FRAMES;
+	    break;
+	case XC_LATENCY_POWERSAVE:
+	    frames = POWERSAVE_PERIOD_FRAMES;
+	    break;
+	default:
+	    frames = PERIOD_FRAMES;
+	    break;
+	}
+    }
 
-    snd_pcm_start(xvb->c.handle);
+    /* round up to a whole number of speex frames */
+    frames = (frames + ECHO_FRAME_FRAMES - 1) & ~(ECHO_FRAME_FRAMES - 1);
+    if (frames < MIN_PERIOD_FRAMES)
+	frames = MIN_PERIOD_FRAMES;
+    if (frames > MAX_PERIOD_FRAMES)
+	frames = MAX_PERIOD_FRAMES;
+    return frames;
 }
 
-void cleanup_alsa(struct xen_vsnd_backend *xvb)
+/*
+ * Periods per interrupt a stream gets: what the frontend asked for, as
+ * long as the guest is still interrupted twice per DMA buffer.
+ */
+static int negotiate_irq_periods(const struct fe_cmd *fe_cmd, int period_frames)
 {
-    struct alsa_stream *as;
+    const struct fe_open_params *params = (const void *)fe_cmd->data;
+    int n = params->irq_periods ? params->irq_periods : 1;
 
-    printf("cleanup_alsa\n");
+    while (n > 1 && period_frames * n > N_AUD_BUFFER_PAGES * XENVSND_PAGE_SIZE / 4 / 2)
+	n--;
+    return n;
+}
+
+/*
+ * Rate a stream gets for the parameters its frontend sent at open: one of
+ * GUEST_RATES within MAX_RATE_RATIO of the card, SAMPLE_RATE otherwise.
+ */
+static int negotiate_rate(const struct fe_cmd *fe_cmd, unsigned int host_rate)
+{
+    static const int rates[] = GUEST_RATES;
+    const struct fe_open_params *params = (const void *)fe_cmd->data;
+    int i, rate = params->rate;
+
+    if (rate == 0)
+	return SAMPLE_RATE;
+    for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+	if (rates[i] == rate &&
+	    rate * MAX_RATE_RATIO >= host_rate && rate <= host_rate * MAX_RATE_RATIO)
+	    return rate;
+    printf("unsupported rate %dHz, using %dHz\n", rate, SAMPLE_RATE);
+    return SAMPLE_RATE;
+}
+
+/*
+ * (Re)build the converter between a guest stream and the card, which
+ * also flushes its history. Returns -1 if there is no memory for it, and
+ * the stream is left without one. Called with as->mutex held.
+ */
+static int alsa_stream_set_rate(struct alsa_stream *as, int rate)
+{
+    int err;
+
+    resampler_free(&as->rs);
+    as->rate = rate;
+    if (!rate)
+	return 0;
+    if (as->stream_type == XC_STREAM_PLAYBACK)
+	err = resampler_init(&as->rs, rate, mixer.p.rate);
+    else
+	err = resampler_init(&as->rs, mixer.c.rate, rate);
+    if (err) {
+	printf("no memory for a %dHz resampler\n", rate);
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * Leave a stream out of the mix and out of the card's period, for when
+ * neither the card nor the resampler can serve it. START then reports it
+ * stopped, until the frontend opens it again. Called with as->mutex held.
+ */
+static void alsa_stream_refuse(struct alsa_stream *as)
+{
+    as->period_frames = 0;
+    as->refused = 1;
+    alsa_stream_set_rate(as, 0);
+}
+
+/*
+ * The card runs at the smallest period any open guest stream asked for;
+ * guests with longer periods are interrupted every few host periods.
+ * Reopening the card is only done when that minimum actually changes, or
+ * when an earlier reopen left it closed. If the card won't take the new
+ * period it goes back to the old one, and -1 is returned so the stream
+ * that asked for it can be refused.
+ */
+static int alsa_mixer_update_period(void)
+{
+    int i, frames = 0, old = mixer.period_frames;
 
-    as = &xvb->p;
-    as->stream_type = XC_STREAM_PLAYBACK;
-    snd_pcm_close(as->handle);
+    for (i = 0; i < mixer.n_guests; i++) {
+	struct xen_vsnd_backend *xvb = mixer.guests[i];
 
-    as = &xvb->c;
-    as->stream_type = XC_STREAM_CAPTURE;
-    snd_pcm_close(as->handle);
+	if (xvb->p.period_frames && (!frames || xvb->p.period_frames < frames))
+	    frames = xvb->p.period_frames;
+	if (xvb->c.period_frames && (!frames || xvb->c.period_frames < frames))
+	    frames = xvb->c.period_frames;
+    }
+    if (!frames)
+	frames = PERIOD_FRAMES;
+    if (frames == mixer.period_frames && (mixer.open || !mixer.n_guests))
+	return 0;
+
+    alsa_mixer_stop();
+    mixer.period_frames = frames;
+    if (!mixer.n_guests || alsa_mixer_start() == 0)
+	return 0;
+
+    printf("can't reopen %s with a %d frames period\n", device, frames);
+    mixer.period_frames = old;
+    if (frames != old && alsa_mixer_start())
+	printf("can't reopen %s with a %d frames period either\n", device, old);
+    return -1;
 }
 
-void init_speex()
+/*
+ * (Re)build a guest's preprocessor for the given rate, linked to its echo
+ * canceller. Speex only takes the preprocessor's rate at creation, so a
+ * new rate means a new state.
+ */
+static void speex_set_rate(struct xen_vsnd_backend *xvb, int rate)
 {
-    int rate=44100;
     spx_int32_t tmp;
+    SpeexPreprocessState *preprocess_state;
 
-    echo_state = speex_echo_state_init(1024, 8192);
-    speex_echo_ctl(echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
+    speex_echo_ctl(xvb->echo_state, SPEEX_ECHO_SET_SAMPLING_RATE, &rate);
 
-    preprocess_state = speex_preprocess_state_init(1024, 44100);
+    if (xvb->preprocess_state)
+	speex_preprocess_state_destroy(xvb->preprocess_state);
+    preprocess_state = speex_preprocess_state_init(ECHO_FRAME_FRAMES, rate);
 
     tmp = 1;
     speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_AGC, &tmp);
@@ -548,67 +1212,271 @@ void init_speex()
     tmp = -60;
     speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_SUPPRESS_ACTIVE, &tmp);
 
-    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_STATE, echo_state);  
-  
+    speex_preprocess_ctl(preprocess_state, SPEEX_PREPROCESS_SET_ECHO_STATE, xvb->echo_state);  
+
+    xvb->preprocess_state = preprocess_state;
 }
 
-void process_playback_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
+int init_alsa(struct xen_vsnd_backend *xvb)
 {
+    int rc = 0;
+
+    printf("init_alsa\n");
+
+    xvb->p.stream_type = XC_STREAM_PLAYBACK;
+    xvb->p.period_frames = 0;
+    alsa_prepare(&xvb->p);
+    xvb->c.stream_type = XC_STREAM_CAPTURE;
+    xvb->c.period_frames = 0;
+    alsa_prepare(&xvb->c);
+
+    if (mixer.n_guests == MAX_GUESTS) {
+	printf("too many guests, max is %d\n", MAX_GUESTS);
+	return -1;
+    }
+
+    if (!mixer.open)
+	rc = alsa_mixer_start();
+    if (rc)
+	return rc;
+
+    /* speex runs on the card's capture rate */
+    speex_set_rate(xvb, mixer.c.rate);
+
+    pthread_rwlock_wrlock(&mixer.lock);
+    mixer.guests[mixer.n_guests++] = xvb;
+    pthread_rwlock_unlock(&mixer.lock);
+
+    return 0;
+}
+
+void cleanup_alsa(struct xen_vsnd_backend *xvb)
+{
+    int i, found = 0;
+
+    printf("cleanup_alsa\n");
+
+    pthread_rwlock_wrlock(&mixer.lock);
+    for (i = 0; i < mixer.n_guests; i++) {
+	if (mixer.guests[i] == xvb) {
+	    mixer.guests[i] = mixer.guests[--mixer.n_guests];
+	    found = 1;
+	    break;
+	}
+    }
+    pthread_rwlock_unlock(&mixer.lock);
+
+    /* the workers take the lock, stop them once it's released */
+    if (found && mixer.n_guests == 0)
+	alsa_mixer_stop();
+    else if (found)
+	alsa_mixer_update_period();
+
+    resampler_free(&xvb->p.rs);
+    resampler_free(&xvb->c.rs);
+}
+
+/*
+ * Offline entry points for audio-daemon-bench: the same per-period
+ * pipeline the worker threads run, driven synchronously by the caller on
+ * an arbitrary playback device (typically "null") and without a capture
+ * PCM, the caller supplying the captured samples and the clock used for
+ * interrupt moderation.
+ */
+int alsa_offline_attach(struct xen_vsnd_backend *xvb, const char *dev,
+			int period_frames)
+{
+    device = (char *)dev;
+    mixer.period_frames = period_frames;
+    stats->period_frames = period_frames;
+
+    xvb->p.stream_type = XC_STREAM_PLAYBACK;
+    alsa_prepare(&xvb->p);
+    xvb->c.stream_type = XC_STREAM_CAPTURE;
+    alsa_prepare(&xvb->c);
+
+    mixer.p.stream_type = XC_STREAM_PLAYBACK;
+    mixer.p.stats = &stats->p;
+    if (alsa_pcm_open(&mixer.p) < 0)
+	return -1;
+    mixer.open = 1;
+    mixer.c.stats = &stats->c;
+    /* the caller hands in S16 capture at the playback rate */
+    mixer.c.rate = mixer.p.rate;
+    mixer.c.format = DSP_FORMAT_S16;
+    speex_set_rate(xvb, mixer.c.rate);
+
+    mixer.guests[mixer.n_guests++] = xvb;
+    return 0;
+}
+
+unsigned int alsa_offline_rate(void)
+{
+    return mixer.p.rate;
+}
+
+snd_pcm_sframes_t alsa_offline_playback(uint64_t now)
+{
+    int notify[MAX_GUESTS] = { 0 };
+    snd_pcm_sframes_t written;
+
+    pthread_rwlock_rdlock(&mixer.lock);
+    written = playback_period(notify);
+    guest_interrupts(notify, now);
+    pthread_rwlock_unlock(&mixer.lock);
+    if (written < 0 && alsa_pcm_recover(&mixer.p, written) == 0)
+	written = 0;
+    return written;
+}
+
+void alsa_offline_capture(int16_t *input, uint64_t now)
+{
+    int notify[MAX_GUESTS] = { 0 };
+    int16_t mono_input[MAX_PERIOD_FRAMES];
+    int16_t echo[MAX_PERIOD_FRAMES];
+
+    pthread_rwlock_rdlock(&mixer.lock);
+    echo_ref_pop(&mixer.echo, echo, mixer.period_frames);
+    dsp_downmix(input, mono_input, mixer.period_frames);
+    capture_period(mono_input, echo, mixer.period_frames, notify);
+    guest_interrupts(notify, now);
+    pthread_rwlock_unlock(&mixer.lock);
+}
+
+/* Set up at SAMPLE_RATE; the guest's speex is moved to the card's capture
+ * rate once it joins the mixer. */
+void init_speex(struct xen_vsnd_backend *xvb)
+{
+    xvb->echo_state = speex_echo_state_init(ECHO_FRAME_FRAMES, 8192);
+    xvb->preprocess_state = NULL;
+    speex_set_rate(xvb, SAMPLE_RATE);
+}
+
+void cleanup_speex(struct xen_vsnd_backend *xvb)
+{
+    speex_preprocess_state_destroy(xvb->preprocess_state);
+    speex_echo_state_destroy(xvb->echo_state);
+    xvb->preprocess_state = NULL;
+    xvb->echo_state = NULL;
+}
+
+/*
+ * Reopen the card for a stream that was just opened or closed. An OPEN the
+ * card can't take is undone; the frontend gets no reply to OPEN, so it
+ * finds out at START, which reports the stream stopped.
+ */
+static void alsa_stream_update_period(struct alsa_stream *as, int cmd)
+{
+    if (alsa_mixer_update_period() == 0 || cmd != XC_PCM_OPEN)
+	return;
+
+    pthread_mutex_lock(&as->mutex);
+    alsa_stream_refuse(as);
+    pthread_mutex_unlock(&as->mutex);
+}
+
+void process_playback_cmd(struct fe_cmd *fe_cmd, struct xen_vsnd_backend *xvb)
+{
+    struct alsa_stream *as = &xvb->p;
     int ret;
 
     pthread_mutex_lock(&as->mutex);   
     switch (fe_cmd->cmd) {
     case XC_PCM_OPEN:
-	playback_is_running = 0;
+	as->is_running = 0;
+	as->refused = 0;
+	as->period_frames = negotiate_period(fe_cmd);
+	as->irq_periods = negotiate_irq_periods(fe_cmd, as->period_frames);
+	if (alsa_stream_set_rate(as, negotiate_rate(fe_cmd, mixer.p.rate)))
+	    alsa_stream_refuse(as);
+	xvb->stats->period_frames = as->period_frames;
+	printf("playback period: %d frames at %dHz, %d per interrupt\n",
+	       as->period_frames, as->rate, as->irq_periods);
 	break;
     case XC_PCM_CLOSE:
-	playback_is_running = 0;
+	as->is_running = 0;
+	as->refused = 0;
+	as->period_frames = 0;
+	alsa_stream_set_rate(as, 0);
 	break;
     case XC_PCM_PREPARE:
-	playback_is_running = 0;
+	as->is_running = 0;
 	as->hw_ptr = as->processed = as->processed_periods = 0;
+	as->irq_frames = 0;
+	if (alsa_stream_set_rate(as, as->rate))
+	    alsa_stream_refuse(as);
 	break;
     case XC_TRIGGER_START:
+	if (as->refused) {
+	    refresh_be_info(as, 0, 0, 0, STREAM_STOPPED);
+	    generate_period_interrupt(xvb);
+	    break;
+	}
 	refresh_be_info(as, 0, 0, 0, STREAM_STARTING);
-	generate_period_interrupt();
-	playback_is_running = 1;
+	generate_period_interrupt(xvb);
+	as->is_running = 1;
 	break;
     case XC_TRIGGER_STOP:
 	refresh_be_info(as, 0, 0, 0, STREAM_STOPPED);
-	generate_period_interrupt();
-	playback_is_running = 0;
+	generate_period_interrupt(xvb);
+	as->is_running = 0;
 	break;
     }
     pthread_mutex_unlock(&as->mutex);   
+
+    if (fe_cmd->cmd == XC_PCM_OPEN || fe_cmd->cmd == XC_PCM_CLOSE)
+	alsa_stream_update_period(as, fe_cmd->cmd);
 }
 
-void process_capture_cmd(struct fe_cmd *fe_cmd, struct alsa_stream *as)
+void process_capture_cmd(struct fe_cmd *fe_cmd, struct xen_vsnd_backend *xvb)
 {
+    struct alsa_stream *as = &xvb->c;
     int ret;
 
     pthread_mutex_lock(&as->mutex);   
     switch (fe_cmd->cmd) {
     case XC_PCM_OPEN:
-	capture_is_running = 0;
+	as->is_running = 0;
+	as->refused = 0;
+	as->period_frames = negotiate_period(fe_cmd);
+	as->irq_periods = negotiate_irq_periods(fe_cmd, as->period_frames);
+	if (alsa_stream_set_rate(as, negotiate_rate(fe_cmd, mixer.c.rate)))
+	    alsa_stream_refuse(as);
+	xvb->stats->period_frames = as->period_frames;
+	printf("capture period: %d frames at %dHz, %d per interrupt\n",
+	       as->period_frames, as->rate, as->irq_periods);
 	break;
     case XC_PCM_CLOSE:
-	capture_is_running = 0;
+	as->is_running = 0;
+	as->refused = 0;
+	as->period_frames = 0;
+	alsa_stream_set_rate(as, 0);
 	break;
     case XC_PCM_PREPARE:
-	capture_is_running = 0;
+	as->is_running = 0;
 	as->hw_ptr = as->processed = as->processed_periods = 0;
+	as->irq_frames = 0;
+	if (alsa_stream_set_rate(as, as->rate))
+	    alsa_stream_refuse(as);
 	break;
     case XC_TRIGGER_START:
+	if (as->refused) {
+	    refresh_be_info(as, 0, 0, 0, STREAM_STOPPED);
+	    generate_period_interrupt(xvb);
+	    break;
+	}
 	refresh_be_info(as, 0, 0, 0, STREAM_STARTING);
-	generate_period_interrupt();
-	capture_is_running = 1;
+	generate_period_interrupt(xvb);
+	as->is_running = 1;
 	break;
     case XC_TRIGGER_STOP:
 	refresh_be_info(as, 0, 0, 0, STREAM_STOPPED);
-	generate_period_interrupt();
-	capture_is_running = 0;
+	generate_period_interrupt(xvb);
+	as->is_running = 0;
 	break;
     }
     pthread_mutex_unlock(&as->mutex);   
-}
 
+    if (fe_cmd->cmd == XC_PCM_OPEN || fe_cmd->cmd == XC_PCM_CLOSE)
+	alsa_stream_update_period(as, fe_cmd->cmd);
+}
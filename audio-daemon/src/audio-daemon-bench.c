@@ -0,0 +1,282 @@
+/*
+ * audio-daemon-bench.c:
+ *
+ * Replays PCM through the audio-daemon period pipeline without Xen: the
+ * guest DMA pages and be_info live in ordinary memory, playback goes to
+ * an ALSA device of our choice (the null plugin by default) and the
+ * capture side is fed from the same samples.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include "project.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+#include <alsa/asoundlib.h>
+#include <event.h>
+#include <speex/speex_echo.h>
+#include <speex/speex_preprocess.h>
+
+#include "ring.h"
+#include "mb.h"
+#include "stats.h"
+#include "dsp.h"
+#include "resample.h"
+#include "audio-daemon.h"
+
+#define GUEST_FRAMES (N_AUD_BUFFER_PAGES * XENVSND_PAGE_SIZE / 4)
+
+static uint64_t interrupts;
+
+/* Provided by audio-daemon.c in the real daemon */
+uint64_t get_nsec_now(void)
+{
+    return stats_now_ns();
+}
+
+void generate_period_interrupt(struct xen_vsnd_backend *xvb)
+{
+    interrupts++;
+}
+
+static uint64_t thread_cpu_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+/* Interleaved S16 stereo source: a raw file if given, else a tone */
+static int16_t *load_source(const char *path, int *frames)
+{
+    int16_t *pcm;
+    int i;
+
+    if (path) {
+	FILE *f = fopen(path, "rb");
+	long len;
+
+	if (!f) {
+	    perror(path);
+	    exit(1);
+	}
+	fseek(f, 0, SEEK_END);
+	len = ftell(f);
+	rewind(f);
+	*frames = len / 4;
+	if (*frames == 0) {
+	    fprintf(stderr, "%s: no samples\n", path);
+	    exit(1);
+	}
+	pcm = malloc(*frames * 4);
+	if (fread(pcm, 4, *frames, f) != (size_t)*frames) {
+	    perror(path);
+	    exit(1);
+	}
+	fclose(f);
+	return pcm;
+    }
+
+    *frames = SAMPLE_RATE;
+    pcm = malloc(*frames * 4);
+    for (i = 0; i < *frames; i++) {
+	int16_t v = 8000 * sin(2 * M_PI * 440 * i / SAMPLE_RATE) + (rand() % 512 - 256);
+	pcm[2 * i] = pcm[2 * i + 1] = v;
+    }
+    return pcm;
+}
+
+static void map_fake_pages(struct alsa_stream *as)
+{
+    int i;
+
+    for (i = 0; i < N_AUD_BUFFER_PAGES; i++)
+	as->dma_buffer[i] = calloc(1, XENVSND_PAGE_SIZE);
+    as->be_info = calloc(1, XENVSND_PAGE_SIZE);
+}
+
+/* What the frontend does: copy the next samples into its DMA buffer */
+static void guest_write(struct alsa_stream *as, const int16_t *src, int src_frames,
+			int *src_pos, int frames)
+{
+    uint64_t appl = as->be_info->appl_ptr;
+
+    while (frames--) {
+	int off = (appl % GUEST_FRAMES) * 4;
+	int16_t *dst = (int16_t *)((char *)as->dma_buffer[off / XENVSND_PAGE_SIZE] +
+				   off % XENVSND_PAGE_SIZE);
+
+	dst[0] = src[2 * *src_pos];
+	dst[1] = src[2 * *src_pos + 1];
+	*src_pos = (*src_pos + 1) % src_frames;
+	appl++;
+    }
+    wmb();
+    as->be_info->appl_ptr = appl;
+}
+
+static void send_cmd(struct xen_vsnd_backend *xvb, int stream, int cmd,
+		     int period, int rate, int irq_periods)
+{
+    struct fe_cmd fe_cmd;
+    struct fe_open_params *params = (void *)fe_cmd.data;
+
+    memset(&fe_cmd, 0, sizeof(fe_cmd));
+    fe_cmd.stream = stream;
+    fe_cmd.cmd = cmd;
+    params->period_frames = period;
+    params->rate = rate;
+    params->irq_periods = irq_periods;
+    if (stream == XC_STREAM_PLAYBACK)
+	process_playback_cmd(&fe_cmd, xvb);
+    else
+	process_capture_cmd(&fe_cmd, xvb);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [-D device] [-p period_frames] [-n periods] [-r guest_rate]\n"
+	    "          [-i periods_per_irq] [-m moderation_us] [-f file.raw]\n"
+	    "  file.raw is S16_LE stereo at the guest rate, %d Hz by default\n", prog, SAMPLE_RATE);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *dev = "null", *path = NULL;
+    int period = PERIOD_FRAMES, periods = 2000, rate = SAMPLE_RATE, irq_periods = 1;
+    struct xen_vsnd_backend *xvb;
+    int16_t *src, *input;
+    int src_frames, play_pos = 0, cap_pos = 0;
+    uint64_t now;
+    uint64_t *cost, cpu, wall, total_cpu = 0;
+    unsigned int host;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "D:p:n:r:i:m:f:h")) != -1) {
+	switch (opt) {
+	case 'D': dev = optarg; break;
+	case 'p': period = atoi(optarg); break;
+	case 'n': periods = atoi(optarg); break;
+	case 'r': rate = atoi(optarg); break;
+	case 'i': irq_periods = atoi(optarg); break;
+	case 'm': alsa_set_irq_moderation(atoi(optarg)); break;
+	case 'f': path = optarg; break;
+	default: usage(argv[0]);
+	}
+    }
+    if (period < MIN_PERIOD_FRAMES || period > MAX_PERIOD_FRAMES ||
+	period % ECHO_FRAME_FRAMES || periods <= 0)
+	usage(argv[0]);
+
+    printf("dsp kernels: %s\n", dsp_impl_name(dsp_init()));
+    src = load_source(path, &src_frames);
+    input = malloc(period * 4);
+    cost = calloc(periods, sizeof(*cost));
+
+    xvb = calloc(1, sizeof(*xvb));
+    pthread_mutex_init(&xvb->p.mutex, NULL);
+    pthread_mutex_init(&xvb->c.mutex, NULL);
+    init_speex(xvb);
+    xvb->stats = stats_guest_alloc(0);
+    xvb->p.stats = &xvb->stats->p;
+    xvb->c.stats = &xvb->stats->c;
+    map_fake_pages(&xvb->p);
+    map_fake_pages(&xvb->c);
+
+    if (alsa_offline_attach(xvb, dev, period)) {
+	fprintf(stderr, "can't open %s\n", dev);
+	return 1;
+    }
+    send_cmd(xvb, XC_STREAM_PLAYBACK, XC_PCM_OPEN, period, rate, irq_periods);
+    send_cmd(xvb, XC_STREAM_CAPTURE, XC_PCM_OPEN, period, rate, irq_periods);
+    if (xvb->p.rate != rate) {
+	fprintf(stderr, "guest rate %d not accepted\n", rate);
+	return 1;
+    }
+    host = alsa_offline_rate();
+    printf("guest %d Hz, card %u Hz\n", rate, host);
+    send_cmd(xvb, XC_STREAM_PLAYBACK, XC_TRIGGER_START, 0, 0, 0);
+    send_cmd(xvb, XC_STREAM_CAPTURE, XC_TRIGGER_START, 0, 0, 0);
+    /* the start kicks aren't period interrupts */
+    interrupts = 0;
+
+    wall = stats_now_ns();
+    for (i = 0; i < periods; i++) {
+	int j;
+
+	/* keep one period queued ahead, like a well-behaved frontend */
+	while (alsa_get_live_frames(&xvb->p) < 2 * period)
+	    guest_write(&xvb->p, src, src_frames, &play_pos, period);
+	/* capture is fed the same material, as if echoed by the room */
+	for (j = 0; j < period; j++) {
+	    input[2 * j] = src[2 * cap_pos];
+	    input[2 * j + 1] = src[2 * cap_pos + 1];
+	    cap_pos = (cap_pos + 1) % src_frames;
+	}
+	/* the guest reads back whatever we captured */
+	xvb->c.be_info->appl_ptr = xvb->c.processed / 4;
+
+	/* moderation runs on the card's clock, not on how fast we go */
+	now = (uint64_t)i * period * 1000000000ULL / host;
+	cpu = thread_cpu_ns();
+	if (alsa_offline_playback(now) < 0) {
+	    fprintf(stderr, "playback write failed\n");
+	    return 1;
+	}
+	alsa_offline_capture(input, now);
+	cost[i] = thread_cpu_ns() - cpu;
+	total_cpu += cost[i];
+    }
+    wall = stats_now_ns() - wall;
+
+    qsort(cost, periods, sizeof(*cost), cmp_u64);
+    printf("device %s, period %d frames, %d periods, %s\n", dev, period, periods,
+	   path ? path : "synthetic tone");
+    printf("  throughput   %.0f frames/s (%.1fx real time)\n",
+	   (double)periods * period * 1e9 / wall,
+	   (double)periods * period * 1e9 / wall / host);
+    printf("  cpu/period   avg %.1fus p50 %.1fus p99 %.1fus max %.1fus\n",
+	   total_cpu / 1e3 / periods, cost[periods / 2] / 1e3,
+	   cost[(periods * 99) / 100] / 1e3, cost[periods - 1] / 1e3);
+    printf("  cpu/second   %.2f%% of one core at %u Hz\n",
+	   100.0 * total_cpu / periods * host / period / 1e9, host);
+    printf("  speex        %.1fus/period\n",
+	   xvb->stats->c.echo_cancel_ns / 1e3 / periods);
+    printf("  interrupts   %llu kicks for %llu playback + %llu capture periods elapsed\n",
+	   (unsigned long long)interrupts,
+	   (unsigned long long)xvb->stats->p.interrupts,
+	   (unsigned long long)xvb->stats->c.interrupts);
+
+    return 0;
+}
@@ -0,0 +1,118 @@
+/*
+ * audio-daemon-stats.c:
+ *
+ * Dump the statistics page published by audio-daemon.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include "stats.h"
+
+static void dump_hist(const char *name, const struct stats_hist *h)
+{
+    int i, last = -1;
+
+    if (h->count == 0) {
+	printf("    %-10s -\n", name);
+	return;
+    }
+    printf("    %-10s n=%llu avg=%lluus max=%lluus\n", name,
+	   (unsigned long long)h->count,
+	   (unsigned long long)(h->total_ns / h->count / 1000),
+	   (unsigned long long)(h->max_ns / 1000));
+
+    for (i = 0; i < STATS_HIST_BUCKETS; i++)
+	if (h->bucket[i])
+	    last = i;
+    for (i = 0; i <= last; i++)
+	printf("      <%7luus %llu\n", 2UL << i,
+	       (unsigned long long)h->bucket[i]);
+}
+
+static void dump_pcm(const char *name, const struct stats_pcm *p)
+{
+    printf("  %s: periods=%llu xruns=%llu delay=%lld max_delay=%lld frames\n",
+	   name, (unsigned long long)p->periods, (unsigned long long)p->xruns,
+	   (long long)p->delay_frames, (long long)p->delay_frames_max);
+    dump_hist("wakeup", &p->wakeup);
+    dump_hist("work", &p->work);
+    dump_hist("recovery", &p->recovery);
+}
+
+static void dump_stream(const char *name, const struct stats_stream *s)
+{
+    printf("    %s: periods=%llu irqs=%llu fill=%lld [%lld..%lld] frames",
+	   name, (unsigned long long)s->periods,
+	   (unsigned long long)s->interrupts, (long long)s->fill_frames,
+	   (long long)s->fill_frames_min, (long long)s->fill_frames_max);
+    if (s->echo_cancel_ns)
+	printf(" echo-cancel=%llums", (unsigned long long)(s->echo_cancel_ns / 1000000));
+    printf("\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct stats_page page;
+    const struct stats_page *shm;
+    int fd, i;
+
+    fd = shm_open(STATS_SHM_NAME, O_RDONLY, 0);
+    if (fd < 0) {
+	perror("shm_open " STATS_SHM_NAME " (is audio-daemon running?)");
+	return 1;
+    }
+    shm = mmap(NULL, sizeof(*shm), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm == MAP_FAILED) {
+	perror("mmap");
+	return 1;
+    }
+
+    /* work on a snapshot so the figures are at least close in time */
+    memcpy(&page, shm, sizeof(page));
+    if (page.magic != STATS_MAGIC || page.version != STATS_VERSION) {
+	fprintf(stderr, "unexpected statistics page (magic %x version %u)\n",
+		page.magic, page.version);
+	return 1;
+    }
+
+    printf("host period: %d frames\n", page.period_frames);
+    dump_pcm("playback", &page.p);
+    dump_pcm("capture", &page.c);
+
+    for (i = 0; i < STATS_MAX_GUESTS; i++) {
+	const struct stats_guest *g = &page.guests[i];
+
+	if (g->domid < 0)
+	    continue;
+	printf("  domain %d (period %d frames, %llu kicks)\n", g->domid,
+	       g->period_frames, (unsigned long long)g->kicks);
+	dump_stream("playback", &g->p);
+	dump_stream("capture", &g->c);
+    }
+
+    return 0;
+}
@@ -41,15 +41,18 @@
 #include <stdint.h>
 #include <time.h>
 #include <pthread.h>
+#include <speex/speex_echo.h>
+#include <speex/speex_preprocess.h>
 
 #include "ring.h"
 #include "mb.h"
+#include "stats.h"
+#include "dsp.h"
+#include "resample.h"
 #include "audio-daemon.h"
 
 struct xc_interface *xc_handle = NULL;
-struct xen_vsnd_backend *glob_xvb;
 char paulian_debug[4];
-struct ring_t *cmd_ring = 0;
 
 struct xen_vsnd_device
 {
@@ -67,9 +70,9 @@ uint64_t get_nsec_now(void)
     return now;
 }
 
-void generate_period_interrupt(struct alsa_stream *as)
+void generate_period_interrupt(struct xen_vsnd_backend *xvb)
 {
-    backend_evtchn_notify(glob_xvb->back, glob_xvb->devid);
+    backend_evtchn_notify(xvb->back, xvb->devid);
 }
 
 void *playback_worker_thread(void *arg);
@@ -81,17 +84,19 @@ static xen_device_t xen_vsnd_alloc(xen_backend_t backend, int devid, void *priv)
     struct xen_vsnd_backend *xvb;
     int err;
 
-    xvb = (struct xen_vsnd_backend*) malloc(sizeof (*xvb));
+    xvb = (struct xen_vsnd_backend*) calloc(1, sizeof (*xvb));
     xvb->devid = devid;
     xvb->dev = dev;
     xvb->back = backend;
 
-    glob_xvb = xvb;
-
     err = pthread_mutex_init(&xvb->p.mutex, NULL);
     err = pthread_mutex_init(&xvb->c.mutex, NULL);
 
-    init_speex();
+    init_speex(xvb);
+
+    xvb->stats = stats_guest_alloc(dev->domid);
+    xvb->p.stats = &xvb->stats->p;
+    xvb->c.stats = &xvb->stats->c;
 
     return xvb;
 }
@@ -100,7 +105,18 @@ static int xen_vsnd_init(xen_device_t xendev)
 {
     struct xen_vsnd_backend *xvb = xendev;
 
+    static const int rates[] = GUEST_RATES;
+    char list[64];
+    int i, len = 0;
+
     backend_print(xvb->back, xvb->devid, "sample-rate", "%d", SAMPLE_RATE);
+    /* values accepted in fe_open_params.rate */
+    for (i = 0; i < sizeof(rates) / sizeof(rates[0]); i++)
+	len += snprintf(list + len, sizeof(list) - len, "%s%d", i ? "," : "", rates[i]);
+    backend_print(xvb->back, xvb->devid, "sample-rates", "%s", list);
+    /* bounds for fe_open_params.period_frames */
+    backend_print(xvb->back, xvb->devid, "period-frames-min", "%d", MIN_PERIOD_FRAMES);
+    backend_print(xvb->back, xvb->devid, "period-frames-max", "%d", MAX_PERIOD_FRAMES);
 
     return 0;
 }
@@ -145,19 +161,20 @@ static int xen_vsnd_connect(xen_device_t xendev)
     }
     
 	/* cmd_ring */
-    if (!cmd_ring) {
-        printf("MAPPING CMDS RING!\n");
-    	cmd_ring = (struct ring_t *) xc_map_foreign_range(xc_handle, xvb->dev->domid,
-							  XENVSND_PAGE_SIZE, PROT_READ | PROT_WRITE,
-							  page_ref[300]);
-	ring_init(cmd_ring);
+    if (!xvb->cmd_ring) {
+        printf("MAPPING CMDS RING for domain %d\n", xvb->dev->domid);
+    	xvb->cmd_ring = (struct ring_t *) xc_map_foreign_range(xc_handle, xvb->dev->domid,
+							       XENVSND_PAGE_SIZE, PROT_READ | PROT_WRITE,
+							       page_ref[300]);
+	ring_init(xvb->cmd_ring);
     }
 
     xvb->p.be_info = (struct be_info *) &page_ref[400];
 	
     xvb->c.be_info = (struct be_info *) &page_ref[500];
 
-    init_alsa(xvb);
+    if (init_alsa(xvb))
+	return -1;
 
     printf("%s exit\n", __FUNCTION__); fflush(stdout);
     return 0;
@@ -194,8 +211,8 @@ static void xen_vsnd_disconnect(xen_device_t xendev)
 	xvb->c.dma_buffer[i] = NULL;
     }
 
-    munmap(cmd_ring, XENVSND_PAGE_SIZE);
-    cmd_ring = NULL;
+    munmap(xvb->cmd_ring, XENVSND_PAGE_SIZE);
+    xvb->cmd_ring = NULL;
 
     printf("%s exit\n", __FUNCTION__); fflush(stdout);
 }
@@ -204,15 +221,17 @@ static void xen_vsnd_disconnect(xen_device_t xendev)
 static void xen_vsnd_event(xen_device_t xendev)
 {
     struct xen_vsnd_backend *xvb = xendev;
-    struct fe_cmd cmd;
-    int len;
+    struct fe_cmd cmds[XC_RING_SIZE / sizeof(struct fe_cmd)];
+    int n, i;
 
-    while (1) {
-	len = ring_read(cmd_ring, (void *)&cmd, sizeof(cmd));
-	if (len == sizeof(cmd)) {
+    /* Drain everything the frontend queued, one index update per batch */
+    while ((n = ring_read_batch(xvb->cmd_ring, cmds, sizeof(cmds[0]),
+				sizeof(cmds) / sizeof(cmds[0]))) > 0) {
+	for (i = 0; i < n; i++) {
+	    struct fe_cmd *cmd = &cmds[i];
 
-	    printf("(%d) ", cmd.stream);
-	    switch(cmd.cmd) {
+	    printf("(%d) ", cmd->stream);
+	    switch(cmd->cmd) {
 	    case XC_PCM_OPEN:
 	    	printf("OPEN\n");
 	    	break;
@@ -230,12 +249,10 @@ static void xen_vsnd_event(xen_device_t xendev)
 	    	break;
 	    }
 
-	    if (cmd.stream == XC_STREAM_PLAYBACK)
-		process_playback_cmd(&cmd, &xvb->p);
+	    if (cmd->stream == XC_STREAM_PLAYBACK)
+		process_playback_cmd(cmd, xvb);
 	    else
-		process_capture_cmd(&cmd, &xvb->c);	
-	} else {
-	    return;
+		process_capture_cmd(cmd, xvb);
 	}
     }
 }
@@ -246,6 +263,8 @@ static void xen_vsnd_free(xen_device_t xendev)
     struct xen_vsnd_device *dev = xvb->dev;
 
     xen_vsnd_disconnect(xvb);
+    cleanup_speex(xvb);
+    stats_guest_free(xvb->stats);
     free(xvb);
 }
 
@@ -301,20 +320,51 @@ void xen_backend_init(int dom0)
     event_add(&backend_xenstore_event, NULL);
 }
 
+static void usage(const char *prog)
+{
+    printf("usage: %s [-m moderation_us] <domid> [<domid>...]\n"
+	   "  -m  hold period interrupts up to this long to merge them (default %d, 0: off)\n",
+	   prog, IRQ_MODERATION_US);
+    exit(1);
+}
+
 int main(int argc, char *argv[])
 {
-    int companion = atoi(argv[1]);
+    int i, opt;
+
+    while ((opt = getopt(argc, argv, "m:h")) != -1) {
+	switch (opt) {
+	case 'm':
+	    alsa_set_irq_moderation(atoi(optarg));
+	    break;
+	default:
+	    usage(argv[0]);
+	}
+    }
+    if (optind >= argc)
+	usage(argv[0]);
 
     event_init ();
 
+    printf("dsp kernels: %s\n", dsp_impl_name(dsp_init()));
+
+    /* not fatal, stats are then only kept in private memory */
+    if (stats_init() == 0)
+	printf("statistics published in shm %s\n", STATS_SHM_NAME);
+
     xc_handle = (struct xc_interface *)xc_interface_open(NULL, NULL, 0);
     if (!xc_handle)
         return -1;
 
     xen_backend_init (0);
         
-    printf("companion domain = %d\n", companion);
-    xen_vsnd_device_create(companion); 
+    /* One vsnd backend per guest, all mixed into the same card */
+    for (i = optind; i < argc; i++) {
+	int companion = atoi(argv[i]);
+
+	printf("companion domain = %d\n", companion);
+	xen_vsnd_device_create(companion);
+    }
 
     event_dispatch();
 	
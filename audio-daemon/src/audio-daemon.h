@@ -43,6 +43,23 @@ struct fe_cmd {
     uint64_t s_time;
 } __attribute__((packed));
 
+enum xc_latency_mode {
+    XC_LATENCY_DEFAULT = 0,
+    XC_LATENCY_LOW,         /* small periods, for VoIP */
+    XC_LATENCY_POWERSAVE,   /* large periods, fewer wakeups */
+};
+
+/*
+ * fe_cmd.data for XC_PCM_OPEN. Frontends that predate it send zeroes,
+ * which selects the default mode and period.
+ */
+struct fe_open_params {
+    uint8_t latency_mode;
+    uint8_t irq_periods;        /* periods per interrupt, 0: 1 */
+    uint16_t period_frames;     /* 0: use the mode's default */
+    uint16_t rate;              /* Hz, 0: SAMPLE_RATE */
+} __attribute__((packed));
+
 struct be_info {
     int hw_ptr;
     int delay;
@@ -63,16 +80,58 @@ struct be_info {
 #define SAMPLE_RATE            (44100)
 #define PERIOD_BYTES            (PERIOD_FRAMES * 4)
 
+/*
+ * Periods negotiated at XC_PCM_OPEN. They are multiples of the speex
+ * frame so echo cancellation runs the same whatever the period, and the
+ * largest one leaves two periods in the guest's DMA buffer.
+ */
+#define ECHO_FRAME_FRAMES 256
+#define LOW_LATENCY_PERIOD_FRAMES 256
+#define POWERSAVE_PERIOD_FRAMES 4096
+#define MIN_PERIOD_FRAMES ECHO_FRAME_FRAMES
+#define MAX_PERIOD_FRAMES 4096
+/* The card buffer holds this many host periods */
+#define HOST_BUFFER_PERIODS 4
+
+/*
+ * Guest streams are S16 stereo at one of these rates. Whatever the card
+ * runs at is converted to in the daemon, never by ALSA's plug layer.
+ */
+#define GUEST_RATES { 8000, 11025, 16000, 22050, 32000, 44100, 48000 }
+/* Host and guest rates may differ by at most this factor */
+#define MAX_RATE_RATIO 8
+#define RESAMPLE_MAX_FRAMES (MAX_PERIOD_FRAMES * MAX_RATE_RATIO)
+
+/* Periods of silence queued before playback starts or after an xrun */
+#define PREFILL_PERIODS 3
+/* Worker threads wake at least this often to notice a stop request */
+#define WORKER_WAIT_MS 100
+/* SCHED_FIFO priority requested for the worker threads */
+#define AUDIO_RT_PRIORITY 50
+
+/*
+ * Period interrupts for one guest within this window share a single
+ * event channel kick; 0 kicks for every period. Overridden with -m.
+ */
+#define IRQ_MODERATION_US 1000
+
+/* Echo reference periods handed from the playback to the capture thread */
+#define ECHO_REF_SLOTS 8
+#define ECHO_REF_LAG 2
+
+struct echo_ref {
+    int16_t frames[ECHO_REF_SLOTS][MAX_PERIOD_FRAMES];
+    uint32_t prod;
+    uint32_t cons;
+};
+
+/* Guest side of a stream: the frontend's DMA pages and shared state */
 struct alsa_stream {
     uint8_t stream_type;
     void *dma_buffer[N_AUD_BUFFER_PAGES];
     struct be_info *be_info;
     int hw_ptr;
     int app_ptr;
-    snd_pcm_t *handle;
-    snd_pcm_hw_params_t *hwparams;
-    snd_pcm_sw_params_t *swparams;
-    snd_async_handler_t *ahandler;
     int vol_l;
     int vol_r;
     enum stream_status status;
@@ -80,7 +139,33 @@ struct alsa_stream {
     int32_t processed;
     int32_t processed_periods;
     uint64_t last_time;
+    int is_running;
+    /* negotiated at XC_PCM_OPEN, 0 while the stream is closed */
+    int period_frames;
+    int irq_periods;
+    int rate;
+    /* the card couldn't run at the period asked for at XC_PCM_OPEN */
+    int refused;
+    /* guest rate <-> card rate, idle when they match */
+    struct resampler rs;
+    /* frames moved since the guest was last interrupted */
+    int irq_frames;
+    struct stats_stream *stats;
+};
+
+/* Host side of a stream: one ALSA PCM and the thread servicing it */
+struct alsa_pcm {
+    uint8_t stream_type;
+    snd_pcm_t *handle;
+    int mmap;
+    /* mmap ring is packed S16 stereo, so periods can be mixed into it */
+    int mmap_direct;
+    /* what the card accepted at open */
+    unsigned int rate;
+    enum dsp_format format;
     pthread_t worker_thread;
+    int running;
+    struct stats_pcm *stats;
 };
 
 struct xen_vsnd_backend {
@@ -90,10 +175,51 @@ struct xen_vsnd_backend {
 
     void *page;
     struct event evtchn_event;
+    struct ring_t *cmd_ring;
 
     struct alsa_stream p;
     struct alsa_stream c;
+
+    SpeexEchoState *echo_state;
+    SpeexPreprocessState *preprocess_state;
+
+    struct stats_guest *stats;
+    /* pending moderated interrupt, 0 if none; under irq_lock in alsa.c */
+    uint64_t irq_deadline;
+};
+
+/* Guests served by one daemon, all mixed into the same card */
+#define MAX_GUESTS 16
+
+struct alsa_mixer {
+    pthread_rwlock_t lock;
+    struct xen_vsnd_backend *guests[MAX_GUESTS];
+    int n_guests;
+
+    struct alsa_pcm p;
+    struct alsa_pcm c;
+    struct echo_ref echo;
+    /* smallest period any open guest stream asked for */
+    int period_frames;
+    /* p and c are open and their workers running */
+    int open;
 };
 
 struct event audio_work_timer;
 void audio_work(int a, short b, void *arg);
+
+/* audio-daemon.c */
+uint64_t get_nsec_now(void);
+void generate_period_interrupt(struct xen_vsnd_backend *xvb);
+
+/* alsa.c, used by audio-daemon-bench */
+int alsa_get_live_frames(struct alsa_stream *as);
+int alsa_offline_attach(struct xen_vsnd_backend *xvb, const char *dev,
+			int period_frames);
+unsigned int alsa_offline_rate(void);
+snd_pcm_sframes_t alsa_offline_playback(uint64_t now);
+void alsa_offline_capture(int16_t *input, uint64_t now);
+void alsa_set_irq_moderation(int usec);
+void init_speex(struct xen_vsnd_backend *xvb);
+void process_playback_cmd(struct fe_cmd *fe_cmd, struct xen_vsnd_backend *xvb);
+void process_capture_cmd(struct fe_cmd *fe_cmd, struct xen_vsnd_backend *xvb);
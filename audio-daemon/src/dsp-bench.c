@@ -0,0 +1,137 @@
+/*
+ * dsp-bench.c:
+ *
+ * Compares the dsp kernels against the loops they replaced in alsa.c, for
+ * every implementation the CPU supports.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "dsp.h"
+
+#define FRAMES 1024
+#define ITERATIONS 200000
+
+/* The original loops from alsa.c, kept here as the reference */
+static void fill_averege(int16_t *src, int16_t *dst)
+{
+    int i;
+    for (i=0; i<2048; i+=2) {
+	dst[i/2] = (src[i] + src[i+1])/2;
+    }
+}
+
+static void double_mono(int16_t *src, int16_t *dst)
+{
+    int i;
+    for (i=0; i<2048; i+=2) {
+	dst[i] = dst[i+1] = src[i/2];
+    }
+}
+
+static int16_t stereo[FRAMES * 2];
+static int16_t mono[FRAMES];
+static int16_t ref[FRAMES * 2];
+static int16_t out[FRAMES * 2];
+
+static double now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define BENCH(label, stmt) do {					\
+	double t0 = now_ns();					\
+	int it;							\
+	for (it = 0; it < ITERATIONS; it++) {			\
+	    stmt;						\
+	    __asm__ volatile("" : : : "memory");		\
+	}							\
+	printf("  %-24s %8.1f ns/period\n", label,		\
+	       (now_ns() - t0) / ITERATIONS);			\
+    } while (0)
+
+/* Check impl against the reference loops and the scalar kernels */
+static int check(enum dsp_impl impl)
+{
+    int16_t a[FRAMES * 2], b[FRAMES * 2];
+    int bad = 0;
+
+    dsp_select(impl);
+    fill_averege(stereo, ref);
+    dsp_downmix(stereo, out, FRAMES);
+    bad |= memcmp(ref, out, FRAMES * sizeof(int16_t));
+
+    double_mono(mono, ref);
+    dsp_upmix(mono, out, FRAMES);
+    bad |= memcmp(ref, out, FRAMES * 2 * sizeof(int16_t));
+
+    memcpy(a, stereo, sizeof(a));
+    memcpy(b, stereo, sizeof(b));
+    dsp_gain(a, FRAMES * 2, DSP_GAIN_UNITY + DSP_GAIN_UNITY / 2);
+    dsp_add_sat(a, stereo, FRAMES * 2);
+
+    dsp_select(DSP_IMPL_SCALAR);
+    dsp_gain(b, FRAMES * 2, DSP_GAIN_UNITY + DSP_GAIN_UNITY / 2);
+    dsp_add_sat(b, stereo, FRAMES * 2);
+    bad |= memcmp(a, b, sizeof(a));
+
+    return bad;
+}
+
+int main(int argc, char *argv[])
+{
+    enum dsp_impl best, impl;
+    int i;
+
+    srand(1);
+    for (i = 0; i < FRAMES * 2; i++)
+	stereo[i] = (rand() & 0xffff) - 0x8000;
+    for (i = 0; i < FRAMES; i++)
+	mono[i] = (rand() & 0xffff) - 0x8000;
+
+    best = dsp_init();
+    printf("best implementation: %s\n", dsp_impl_name(best));
+
+    printf("reference\n");
+    BENCH("fill_averege", fill_averege(stereo, out));
+    BENCH("double_mono", double_mono(mono, out));
+
+    for (impl = DSP_IMPL_SCALAR; impl <= best; impl++) {
+	if (check(impl)) {
+	    printf("%s: MISMATCH against reference\n", dsp_impl_name(impl));
+	    return 1;
+	}
+	dsp_select(impl);
+	printf("%s\n", dsp_impl_name(impl));
+	BENCH("downmix", dsp_downmix(stereo, out, FRAMES));
+	BENCH("upmix", dsp_upmix(mono, out, FRAMES));
+	BENCH("gain", dsp_gain(out, FRAMES * 2, DSP_GAIN_UNITY / 2));
+	BENCH("add_sat", dsp_add_sat(out, stereo, FRAMES * 2));
+    }
+
+    return 0;
+}
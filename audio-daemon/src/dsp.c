@@ -0,0 +1,344 @@
+/*
+ * dsp.c:
+ *
+ *
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#if defined(__i386__) || defined(__x86_64__)
+#include <immintrin.h>
+#define DSP_HAVE_X86 1
+#endif
+
+#include "dsp.h"
+
+static inline int16_t sat16(int32_t v)
+{
+    if (v > INT16_MAX)
+	return INT16_MAX;
+    if (v < INT16_MIN)
+	return INT16_MIN;
+    return v;
+}
+
+/* Scalar kernels, also used for the tails of the vector ones */
+
+static void downmix_scalar(const int16_t *src, int16_t *dst, int frames)
+{
+    int i;
+    for (i = 0; i < frames; i++)
+	dst[i] = (src[2 * i] + src[2 * i + 1]) / 2;
+}
+
+static void upmix_scalar(const int16_t *src, int16_t *dst, int frames)
+{
+    int i;
+    for (i = 0; i < frames; i++)
+	dst[2 * i] = dst[2 * i + 1] = src[i];
+}
+
+static void gain_scalar(int16_t *buf, int samples, int16_t gain)
+{
+    int i;
+    for (i = 0; i < samples; i++)
+	buf[i] = sat16(((int32_t)buf[i] * gain) >> 14);
+}
+
+static void add_sat_scalar(int16_t *dst, const int16_t *src, int samples)
+{
+    int i;
+    for (i = 0; i < samples; i++)
+	dst[i] = sat16((int32_t)dst[i] + src[i]);
+}
+
+#ifdef DSP_HAVE_X86
+
+/*
+ * (l + r) / 2 with C rounding towards zero: sum the pair in 32 bits with
+ * pmaddwd, add the sign bit, then shift.
+ */
+__attribute__((target("sse2")))
+static inline __m128i halve_epi32_sse2(__m128i v)
+{
+    return _mm_srai_epi32(_mm_add_epi32(v, _mm_srli_epi32(v, 31)), 1);
+}
+
+__attribute__((target("sse2")))
+static void downmix_sse2(const int16_t *src, int16_t *dst, int frames)
+{
+    const __m128i ones = _mm_set1_epi16(1);
+    int i;
+
+    for (i = 0; i + 8 <= frames; i += 8) {
+	__m128i a = _mm_loadu_si128((const __m128i *)(src + 2 * i));
+	__m128i b = _mm_loadu_si128((const __m128i *)(src + 2 * i + 8));
+	a = halve_epi32_sse2(_mm_madd_epi16(a, ones));
+	b = halve_epi32_sse2(_mm_madd_epi16(b, ones));
+	_mm_storeu_si128((__m128i *)(dst + i), _mm_packs_epi32(a, b));
+    }
+    downmix_scalar(src + 2 * i, dst + i, frames - i);
+}
+
+__attribute__((target("sse2")))
+static void upmix_sse2(const int16_t *src, int16_t *dst, int frames)
+{
+    int i;
+
+    for (i = 0; i + 8 <= frames; i += 8) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+	_mm_storeu_si128((__m128i *)(dst + 2 * i), _mm_unpacklo_epi16(v, v));
+	_mm_storeu_si128((__m128i *)(dst + 2 * i + 8), _mm_unpackhi_epi16(v, v));
+    }
+    upmix_scalar(src + i, dst + 2 * i, frames - i);
+}
+
+__attribute__((target("sse2")))
+static void gain_sse2(int16_t *buf, int samples, int16_t gain)
+{
+    const __m128i g = _mm_set1_epi16(gain);
+    int i;
+
+    for (i = 0; i + 8 <= samples; i += 8) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+	__m128i lo = _mm_mullo_epi16(v, g);
+	__m128i hi = _mm_mulhi_epi16(v, g);
+	__m128i a = _mm_srai_epi32(_mm_unpacklo_epi16(lo, hi), 14);
+	__m128i b = _mm_srai_epi32(_mm_unpackhi_epi16(lo, hi), 14);
+	_mm_storeu_si128((__m128i *)(buf + i), _mm_packs_epi32(a, b));
+    }
+    gain_scalar(buf + i, samples - i, gain);
+}
+
+__attribute__((target("sse2")))
+static void add_sat_sse2(int16_t *dst, const int16_t *src, int samples)
+{
+    int i;
+
+    for (i = 0; i + 8 <= samples; i += 8) {
+	__m128i a = _mm_loadu_si128((const __m128i *)(dst + i));
+	__m128i b = _mm_loadu_si128((const __m128i *)(src + i));
+	_mm_storeu_si128((__m128i *)(dst + i), _mm_adds_epi16(a, b));
+    }
+    add_sat_scalar(dst + i, src + i, samples - i);
+}
+
+/*
+ * AVX2 versions. The pack/unpack instructions work within 128-bit lanes,
+ * hence the 64-bit permutes to put samples back in order.
+ */
+__attribute__((target("avx2")))
+static inline __m256i halve_epi32_avx2(__m256i v)
+{
+    return _mm256_srai_epi32(_mm256_add_epi32(v, _mm256_srli_epi32(v, 31)), 1);
+}
+
+__attribute__((target("avx2")))
+static void downmix_avx2(const int16_t *src, int16_t *dst, int frames)
+{
+    const __m256i ones = _mm256_set1_epi16(1);
+    int i;
+
+    for (i = 0; i + 16 <= frames; i += 16) {
+	__m256i a = _mm256_loadu_si256((const __m256i *)(src + 2 * i));
+	__m256i b = _mm256_loadu_si256((const __m256i *)(src + 2 * i + 16));
+	a = halve_epi32_avx2(_mm256_madd_epi16(a, ones));
+	b = halve_epi32_avx2(_mm256_madd_epi16(b, ones));
+	_mm256_storeu_si256((__m256i *)(dst + i),
+			    _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xd8));
+    }
+    downmix_sse2(src + 2 * i, dst + i, frames - i);
+}
+
+__attribute__((target("avx2")))
+static void upmix_avx2(const int16_t *src, int16_t *dst, int frames)
+{
+    int i;
+
+    for (i = 0; i + 16 <= frames; i += 16) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(src + i));
+	v = _mm256_permute4x64_epi64(v, 0xd8);
+	_mm256_storeu_si256((__m256i *)(dst + 2 * i), _mm256_unpacklo_epi16(v, v));
+	_mm256_storeu_si256((__m256i *)(dst + 2 * i + 16), _mm256_unpackhi_epi16(v, v));
+    }
+    upmix_sse2(src + i, dst + 2 * i, frames - i);
+}
+
+__attribute__((target("avx2")))
+static void gain_avx2(int16_t *buf, int samples, int16_t gain)
+{
+    const __m256i g = _mm256_set1_epi16(gain);
+    int i;
+
+    for (i = 0; i + 16 <= samples; i += 16) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+	__m256i lo = _mm256_mullo_epi16(v, g);
+	__m256i hi = _mm256_mulhi_epi16(v, g);
+	__m256i a = _mm256_srai_epi32(_mm256_unpacklo_epi16(lo, hi), 14);
+	__m256i b = _mm256_srai_epi32(_mm256_unpackhi_epi16(lo, hi), 14);
+	/* unpack and pack are both in-lane, so the order is preserved */
+	_mm256_storeu_si256((__m256i *)(buf + i), _mm256_packs_epi32(a, b));
+    }
+    gain_sse2(buf + i, samples - i, gain);
+}
+
+__attribute__((target("avx2")))
+static void add_sat_avx2(int16_t *dst, const int16_t *src, int samples)
+{
+    int i;
+
+    for (i = 0; i + 16 <= samples; i += 16) {
+	__m256i a = _mm256_loadu_si256((const __m256i *)(dst + i));
+	__m256i b = _mm256_loadu_si256((const __m256i *)(src + i));
+	_mm256_storeu_si256((__m256i *)(dst + i), _mm256_adds_epi16(a, b));
+    }
+    add_sat_sse2(dst + i, src + i, samples - i);
+}
+
+#endif /* DSP_HAVE_X86 */
+
+struct dsp_ops dsp = {
+    downmix_scalar,
+    upmix_scalar,
+    gain_scalar,
+    add_sat_scalar,
+};
+
+/*
+ * Format conversion at the card boundary. Plain loops the compiler
+ * vectorises at -O2; narrowing rounds to nearest and saturates.
+ */
+
+int dsp_format_bytes(enum dsp_format fmt)
+{
+    return fmt == DSP_FORMAT_S16 ? 2 : 4;
+}
+
+void dsp_from_s16(void *dst, const int16_t *src, int samples, enum dsp_format fmt)
+{
+    int32_t *d32 = dst;
+    float *f = dst;
+    int i;
+
+    switch (fmt) {
+    case DSP_FORMAT_S24:
+	for (i = 0; i < samples; i++)
+	    d32[i] = (int32_t)src[i] << 8;
+	break;
+    case DSP_FORMAT_S32:
+	for (i = 0; i < samples; i++)
+	    d32[i] = (int32_t)src[i] << 16;
+	break;
+    case DSP_FORMAT_FLOAT:
+	for (i = 0; i < samples; i++)
+	    f[i] = src[i] * (1.0f / 32768.0f);
+	break;
+    default:
+	memcpy(dst, src, samples * sizeof(int16_t));
+	break;
+    }
+}
+
+void dsp_to_s16(int16_t *dst, const void *src, int samples, enum dsp_format fmt)
+{
+    const int32_t *s32 = src;
+    const float *f = src;
+    int i;
+
+    switch (fmt) {
+    case DSP_FORMAT_S24:
+	/* sign extend the 24 bit value before rounding it */
+	for (i = 0; i < samples; i++)
+	    dst[i] = sat16((((int32_t)((uint32_t)s32[i] << 8) >> 8) + (1 << 7)) >> 8);
+	break;
+    case DSP_FORMAT_S32:
+	for (i = 0; i < samples; i++)
+	    dst[i] = sat16(((int64_t)s32[i] + (1 << 15)) >> 16);
+	break;
+    case DSP_FORMAT_FLOAT:
+	for (i = 0; i < samples; i++) {
+	    float v = f[i] * 32768.0f;
+
+	    dst[i] = v >= 32767.0f ? INT16_MAX :
+		v <= -32768.0f ? INT16_MIN : (int16_t)lrintf(v);
+	}
+	break;
+    default:
+	memcpy(dst, src, samples * sizeof(int16_t));
+	break;
+    }
+}
+
+void dsp_select(enum dsp_impl impl)
+{
+    switch (impl) {
+#ifdef DSP_HAVE_X86
+    case DSP_IMPL_AVX2:
+	dsp.downmix = downmix_avx2;
+	dsp.upmix = upmix_avx2;
+	dsp.gain = gain_avx2;
+	dsp.add_sat = add_sat_avx2;
+	break;
+    case DSP_IMPL_SSE2:
+	dsp.downmix = downmix_sse2;
+	dsp.upmix = upmix_sse2;
+	dsp.gain = gain_sse2;
+	dsp.add_sat = add_sat_sse2;
+	break;
+#endif
+    default:
+	dsp.downmix = downmix_scalar;
+	dsp.upmix = upmix_scalar;
+	dsp.gain = gain_scalar;
+	dsp.add_sat = add_sat_scalar;
+	break;
+    }
+}
+
+enum dsp_impl dsp_init(void)
+{
+    enum dsp_impl impl = DSP_IMPL_SCALAR;
+
+#ifdef DSP_HAVE_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+	impl = DSP_IMPL_AVX2;
+    else if (__builtin_cpu_supports("sse2"))
+	impl = DSP_IMPL_SSE2;
+#endif
+
+    dsp_select(impl);
+    return impl;
+}
+
+const char *dsp_impl_name(enum dsp_impl impl)
+{
+    switch (impl) {
+    case DSP_IMPL_AVX2:
+	return "avx2";
+    case DSP_IMPL_SSE2:
+	return "sse2";
+    default:
+	return "scalar";
+    }
+}
@@ -0,0 +1,75 @@
+/*
+ * dsp.h:
+ *
+ * Small PCM kernels used on the capture/echo-cancel path. Every kernel has
+ * a scalar implementation and, on x86, SSE2 and AVX2 variants selected at
+ * run time by dsp_init().
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _DSP_H_
+#define _DSP_H_
+
+#include <stdint.h>
+
+/* Gains are Q14 fixed point: DSP_GAIN_UNITY is 1.0, the maximum is ~2.0 */
+#define DSP_GAIN_UNITY (1 << 14)
+
+enum dsp_impl {
+    DSP_IMPL_SCALAR = 0,
+    DSP_IMPL_SSE2,
+    DSP_IMPL_AVX2,
+};
+
+struct dsp_ops {
+    /* stereo S16 -> mono S16, (l + r) / 2 */
+    void (*downmix)(const int16_t *src, int16_t *dst, int frames);
+    /* mono S16 -> stereo S16, l = r = src */
+    void (*upmix)(const int16_t *src, int16_t *dst, int frames);
+    /* buf[i] = sat(buf[i] * gain >> 14) */
+    void (*gain)(int16_t *buf, int samples, int16_t gain);
+    /* dst[i] = sat(dst[i] + src[i]) */
+    void (*add_sat)(int16_t *dst, const int16_t *src, int samples);
+};
+
+extern struct dsp_ops dsp;
+
+/* Sample formats a host PCM may run in; the mixer itself is S16 */
+enum dsp_format {
+    DSP_FORMAT_S16 = 0,
+    DSP_FORMAT_S24,             /* S24_LE, low three bytes of 32 bits */
+    DSP_FORMAT_S32,
+    DSP_FORMAT_FLOAT,           /* FLOAT_LE, -1.0 .. 1.0 */
+};
+
+int dsp_format_bytes(enum dsp_format fmt);
+void dsp_from_s16(void *dst, const int16_t *src, int samples, enum dsp_format fmt);
+void dsp_to_s16(int16_t *dst, const void *src, int samples, enum dsp_format fmt);
+
+enum dsp_impl dsp_init(void);
+void dsp_select(enum dsp_impl impl);
+const char *dsp_impl_name(enum dsp_impl impl);
+
+#define dsp_downmix(src, dst, frames)   dsp.downmix((src), (dst), (frames))
+#define dsp_upmix(src, dst, frames)     dsp.upmix((src), (dst), (frames))
+#define dsp_gain(buf, samples, g)       dsp.gain((buf), (samples), (g))
+#define dsp_add_sat(dst, src, samples)  dsp.add_sat((dst), (src), (samples))
+
+#endif
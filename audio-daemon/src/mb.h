@@ -31,4 +31,12 @@
 #error "Unknow architecture"
 #endif
 
+/*
+ * Acquire/release accessors for indexes shared with the frontend. On x86
+ * these are plain moves plus a compiler barrier, which is all a
+ * single-producer/single-consumer ring needs.
+ */
+#define ring_load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define ring_store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
 #endif
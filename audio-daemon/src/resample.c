@@ -0,0 +1,198 @@
+/*
+ * resample.c:
+ *
+ * Polyphase FIR sample rate converter for interleaved S16 stereo.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "resample.h"
+
+/*
+ * The converter keeps the last RESAMPLE_TAPS input frames at the start
+ * of its window. Output frame k sits at frac + k * M in units of 1/L
+ * input frames, counted from the first frame of the window. Each output
+ * is the dot product of the RESAMPLE_TAPS frames starting at its
+ * integer position with the filter phase for its fractional part.
+ */
+
+static int gcd(int a, int b)
+{
+    while (b) {
+	int t = a % b;
+	a = b;
+	b = t;
+    }
+    return a;
+}
+
+static double sinc(double x)
+{
+    if (fabs(x) < 1e-9)
+	return 1.0;
+    return sin(M_PI * x) / (M_PI * x);
+}
+
+int resampler_init(struct resampler *r, int in_rate, int out_rate)
+{
+    int g, phase, j;
+    double cutoff;
+
+    memset(r, 0, sizeof(*r));
+    if (in_rate <= 0 || out_rate <= 0)
+	return -1;
+
+    g = gcd(in_rate, out_rate);
+    r->in_rate = in_rate;
+    r->out_rate = out_rate;
+    r->L = out_rate / g;
+    r->M = in_rate / g;
+    if (r->L == r->M)
+	return 0;
+
+    r->coefs = malloc(r->L * RESAMPLE_TAPS * sizeof(int16_t));
+    r->win_frames = RESAMPLE_TAPS;
+    r->win = calloc(r->win_frames, 4);
+    if (!r->coefs || !r->win) {
+	resampler_free(r);
+	return -1;
+    }
+
+    /* Blackman windowed sinc, band limited to the lower of both rates */
+    cutoff = 0.95 * (r->L < r->M ? (double)r->L / r->M : 1.0);
+    for (phase = 0; phase < r->L; phase++) {
+	double taps[RESAMPLE_TAPS], sum = 0;
+
+	for (j = 0; j < RESAMPLE_TAPS; j++) {
+	    /* distance from the output to tap j, minus the filter delay */
+	    double t = RESAMPLE_TAPS / 2 - 1 - j + (double)phase / r->L;
+	    double w = (t + RESAMPLE_TAPS / 2) / RESAMPLE_TAPS;
+
+	    if (w < 0 || w > 1)
+		taps[j] = 0;
+	    else
+		taps[j] = cutoff * sinc(cutoff * t) *
+		    (0.42 - 0.5 * cos(2 * M_PI * w) + 0.08 * cos(4 * M_PI * w));
+	    sum += taps[j];
+	}
+	/* unity DC gain for every phase */
+	for (j = 0; j < RESAMPLE_TAPS; j++)
+	    r->coefs[phase * RESAMPLE_TAPS + j] =
+		lrint(taps[j] / sum * (1 << 14));
+    }
+
+    return 0;
+}
+
+void resampler_free(struct resampler *r)
+{
+    free(r->coefs);
+    free(r->win);
+    r->coefs = NULL;
+    r->win = NULL;
+    r->win_frames = 0;
+    r->L = r->M = 1;
+}
+
+int resampler_active(const struct resampler *r)
+{
+    return r->coefs != NULL;
+}
+
+/* Input frames resampler_run() consumes to produce exactly out_frames */
+int resampler_needed(const struct resampler *r, int out_frames)
+{
+    if (!resampler_active(r))
+	return out_frames;
+    if (out_frames == 0)
+	return 0;
+    return (r->frac + (out_frames - 1) * r->M) / r->L;
+}
+
+/* Upper bound of the frames resampler_run() produces from in_frames */
+int resampler_max_out(const struct resampler *r, int in_frames)
+{
+    if (!resampler_active(r))
+	return in_frames;
+    return ((in_frames + 1) * r->L) / r->M + 1;
+}
+
+static inline int16_t clamp16(int32_t v)
+{
+    if (v > INT16_MAX)
+	return INT16_MAX;
+    if (v < INT16_MIN)
+	return INT16_MIN;
+    return v;
+}
+
+/*
+ * Consume in_frames and produce up to max_out frames. When max_out is
+ * resampler_needed()'s counterpart the output count is exact; with
+ * resampler_max_out() every output the input allows is produced.
+ * Returns the number of frames written to out.
+ */
+int resampler_run(struct resampler *r, const int16_t *in, int in_frames,
+		  int16_t *out, int max_out)
+{
+    int16_t *w;
+    int pos, k = 0;
+
+    if (!resampler_active(r)) {
+	if (in_frames > max_out)
+	    in_frames = max_out;
+	memcpy(out, in, in_frames * 4);
+	return in_frames;
+    }
+
+    /* The window only grows, so once the period size is settled the
+     * worker threads never allocate */
+    if (r->win_frames < RESAMPLE_TAPS + in_frames) {
+	w = realloc(r->win, (RESAMPLE_TAPS + in_frames) * 4);
+	if (!w)
+	    return 0;
+	r->win = w;
+	r->win_frames = RESAMPLE_TAPS + in_frames;
+    }
+    w = r->win;
+    memcpy(w + RESAMPLE_TAPS * 2, in, in_frames * 4);
+
+    for (pos = r->frac; k < max_out && pos / r->L <= in_frames; pos += r->M, k++) {
+	const int16_t *c = r->coefs + (pos % r->L) * RESAMPLE_TAPS;
+	const int16_t *x = w + (pos / r->L) * 2;
+	int32_t left = 0, right = 0;
+	int j;
+
+	for (j = 0; j < RESAMPLE_TAPS; j++) {
+	    left += x[2 * j] * c[j];
+	    right += x[2 * j + 1] * c[j];
+	}
+	out[2 * k] = clamp16((left + (1 << 13)) >> 14);
+	out[2 * k + 1] = clamp16((right + (1 << 13)) >> 14);
+    }
+
+    r->frac = pos - in_frames * r->L;
+    memmove(w, w + in_frames * 2, RESAMPLE_TAPS * 4);
+
+    return k;
+}
@@ -0,0 +1,52 @@
+/*
+ * resample.h:
+ *
+ * Polyphase FIR sample rate converter for interleaved S16 stereo.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _RESAMPLE_H_
+#define _RESAMPLE_H_
+
+#include <stdint.h>
+
+/* Taps per phase; 16 keeps the cost at 32 MACs per output frame */
+#define RESAMPLE_TAPS 16
+
+struct resampler {
+    int in_rate;
+    int out_rate;
+    int L;                      /* interpolation factor */
+    int M;                      /* decimation factor */
+    int frac;                   /* position of the next output, in 1/L input frames */
+    int16_t *coefs;             /* L phases of RESAMPLE_TAPS Q14 taps */
+    int16_t *win;               /* history followed by the current input */
+    int win_frames;
+};
+
+int resampler_init(struct resampler *r, int in_rate, int out_rate);
+void resampler_free(struct resampler *r);
+int resampler_active(const struct resampler *r);
+int resampler_needed(const struct resampler *r, int out_frames);
+int resampler_max_out(const struct resampler *r, int in_frames);
+int resampler_run(struct resampler *r, const int16_t *in, int in_frames,
+		  int16_t *out, int max_out);
+
+#endif
@@ -16,71 +16,78 @@
  * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
  */
 
+#include <string.h>
+#include <errno.h>
+
 #include "ring.h"
 #include "mb.h"
 
+/*
+ * Both directions of the ring are single-producer/single-consumer: the
+ * frontend produces requests and consumes responses, we do the opposite.
+ * We only ever need to acquire the index owned by the other side and
+ * release our own one after the payload has been copied, so there is no
+ * need for full barriers on every chunk.
+ */
+
 static int ring_check_indexes(XC_RING_IDX cons, XC_RING_IDX prod)
 {
 	return ((prod - cons) <= XC_RING_SIZE);
 }
-static void *ring_get_output_chunk(XC_RING_IDX cons,
-			      XC_RING_IDX prod,
-			      char *buf, uint32_t *len)
+
+/* Copy len bytes out of the ring starting at cons, handling the wrap. */
+static void ring_copy_out(const char *buf, XC_RING_IDX cons,
+			  char *data, unsigned int len)
 {
-	*len = XC_RING_SIZE - MASK_XC_RING_IDX(prod);
-	if ((XC_RING_SIZE - (prod - cons)) < *len)
-		*len = XC_RING_SIZE - (prod - cons);
-	return buf + MASK_XC_RING_IDX(prod);
+	unsigned int off = MASK_XC_RING_IDX(cons);
+	unsigned int chunk = XC_RING_SIZE - off;
+
+	if (chunk > len)
+		chunk = len;
+	memcpy(data, buf + off, chunk);
+	if (len > chunk)
+		memcpy(data + chunk, buf, len - chunk);
 }
 
-static const void *ring_get_input_chunk(XC_RING_IDX cons,
-				   XC_RING_IDX prod,
-				   const char *buf, uint32_t *len)
+/* Copy len bytes into the ring starting at prod, handling the wrap. */
+static void ring_copy_in(char *buf, XC_RING_IDX prod,
+			 const char *data, unsigned int len)
 {
-	*len = XC_RING_SIZE - MASK_XC_RING_IDX(cons);
-	if ((prod - cons) < *len)
-		*len = prod - cons;
-	return buf + MASK_XC_RING_IDX(cons);
+	unsigned int off = MASK_XC_RING_IDX(prod);
+	unsigned int chunk = XC_RING_SIZE - off;
+
+	if (chunk > len)
+		chunk = len;
+	memcpy(buf + off, data, chunk);
+	if (len > chunk)
+		memcpy(buf, data + chunk, len - chunk);
 }
 
 int ring_data_to_read(struct ring_t *intf)
 {
-	return (intf->req_cons != intf->req_prod);
+	return (ring_load_acquire(&intf->req_prod) != intf->req_cons);
 }
+
 int ring_write(struct ring_t *intf, const void *data, unsigned int len)
 {
 	XC_RING_IDX cons, prod;
-	int rc;
 
-	if ((intf->rsp_prod - intf->rsp_cons) == XC_RING_SIZE)
+	if (len > XC_RING_SIZE)
 		return -1;
 
-	while (len != 0) {
-		void *dst;
-		unsigned int avail;
-
-		cons = intf->rsp_cons;
-		prod = intf->rsp_prod;
-		if (!ring_check_indexes(cons, prod)) {
-			intf->rsp_cons = intf->rsp_prod = 0;
-			return -1;
-		}
-		dst = ring_get_output_chunk(cons, prod, intf->rsp, &avail);
-		if (avail < len)
-			return -1; /* FIXME ! wait here ? */
-		if (avail > len)
-			avail = len;
-
-		mb();
+	prod = intf->rsp_prod;
+	cons = ring_load_acquire(&intf->rsp_cons);
+	if (!ring_check_indexes(cons, prod)) {
+		intf->rsp_cons = intf->rsp_prod = 0;
+		return -1;
+	}
 
-		memcpy(dst, data, avail);
-		data += avail;
-		len -= avail;
+	/* Never publish a partial message, the frontend can't resync */
+	if ((XC_RING_SIZE - (prod - cons)) < len)
+		return -EAGAIN;
 
-		wmb();
-		intf->rsp_prod += avail;
-
-	}
+	ring_copy_in(intf->rsp, prod, data, len);
+	ring_store_release(&intf->rsp_prod, prod + len);
 
 	return 0;
 }
@@ -88,50 +95,56 @@ int ring_write(struct ring_t *intf, const void *data, unsigned int len)
 int ring_read(struct ring_t *intf, void *data, unsigned len)
 {
 	XC_RING_IDX cons, prod;
-	int rc = len;
-
-	while (len != 0) {
-		unsigned int avail;
-		const char *src;
 
-		if (!ring_data_to_read(intf))
-			return 0;
+	cons = intf->req_cons;
+	prod = ring_load_acquire(&intf->req_prod);
+	if (!ring_check_indexes(cons, prod)) {
+		intf->req_cons = intf->req_prod = 0;
+		return -1;
+	}
 
-		cons = intf->req_cons;
-		prod = intf->req_prod;
-		if (!ring_check_indexes(cons, prod)) {
-			intf->req_cons = intf->req_prod = 0;
-			return -1;
-		}
+	/* Leave incomplete messages in place until the rest shows up */
+	if ((prod - cons) < len)
+		return 0;
 
-		src = ring_get_input_chunk(cons, prod, intf->req, &avail);
-		if (avail == 0)
-			continue;
-		if (avail > len)
-			avail = len;
+	ring_copy_out(intf->req, cons, data, len);
+	ring_store_release(&intf->req_cons, cons + len);
 
-		rmb();
+	return len;
+}
 
-		memcpy(data, src, avail);
-		data += avail;
-		len -= avail;
+int ring_read_batch(struct ring_t *intf, void *data, unsigned int size,
+		    unsigned int max)
+{
+	XC_RING_IDX cons, prod;
+	unsigned int n;
 
-		mb();
-		intf->req_cons += avail;
+	if (size == 0)
+		return 0;
 
+	cons = intf->req_cons;
+	prod = ring_load_acquire(&intf->req_prod);
+	if (!ring_check_indexes(cons, prod)) {
+		intf->req_cons = intf->req_prod = 0;
+		return -1;
 	}
 
-	return rc;
+	n = (prod - cons) / size;
+	if (n > max)
+		n = max;
+	if (n == 0)
+		return 0;
+
+	ring_copy_out(intf->req, cons, data, n * size);
+	/* One index update for the whole batch */
+	ring_store_release(&intf->req_cons, cons + n * size);
+
+	return n;
 }
 
 void ring_init(struct ring_t *intf)
 {
 	intf->rsp_cons = intf->rsp_prod = 0;
 	intf->req_cons = intf->req_prod = 0;
+	mb();
 }
-
-
-
-
-
-
@@ -35,6 +35,8 @@ struct ring_t {
 void ring_init(struct ring_t *intf);
 int ring_data_to_read(struct ring_t *intf);
 int ring_read(struct ring_t *intf, void *data, unsigned len);
+int ring_read_batch(struct ring_t *intf, void *data, unsigned int size,
+		    unsigned int max);
 int ring_write(struct ring_t *intf, const void *data, unsigned int len);
 
 #endif
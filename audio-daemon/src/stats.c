@@ -0,0 +1,140 @@
+/*
+ * stats.c:
+ *
+ *
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "stats.h"
+
+/*
+ * Each counter has a single writer (a worker thread or the main loop), so
+ * they are plain stores; a reader may see a snapshot that is a few
+ * samples out of step between fields, which is fine for telemetry.
+ */
+static struct stats_page stats_fallback;
+struct stats_page *stats = &stats_fallback;
+
+/* Handed out when every slot is taken, so callers never check for NULL */
+static struct stats_guest stats_guest_overflow;
+
+uint64_t stats_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void stats_reset(struct stats_page *page)
+{
+    int i;
+
+    memset(page, 0, sizeof(*page));
+    page->magic = STATS_MAGIC;
+    page->version = STATS_VERSION;
+    page->start_ns = stats_now_ns();
+    for (i = 0; i < STATS_MAX_GUESTS; i++)
+	page->guests[i].domid = -1;
+}
+
+int stats_init(void)
+{
+    struct stats_page *page;
+    int fd;
+
+    stats_reset(&stats_fallback);
+
+    fd = shm_open(STATS_SHM_NAME, O_CREAT | O_RDWR | O_TRUNC, 0644);
+    if (fd < 0) {
+	perror("shm_open " STATS_SHM_NAME);
+	return -1;
+    }
+    if (ftruncate(fd, sizeof(*page)) < 0) {
+	perror("ftruncate " STATS_SHM_NAME);
+	close(fd);
+	return -1;
+    }
+    page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (page == MAP_FAILED) {
+	perror("mmap " STATS_SHM_NAME);
+	return -1;
+    }
+
+    stats_reset(page);
+    stats = page;
+    return 0;
+}
+
+void stats_hist_add(struct stats_hist *h, uint64_t ns)
+{
+    uint64_t us = ns / 1000;
+    int b = 0;
+
+    while (us > 1 && b < STATS_HIST_BUCKETS - 1) {
+	us >>= 1;
+	b++;
+    }
+    h->bucket[b]++;
+    h->count++;
+    h->total_ns += ns;
+    if (ns > h->max_ns)
+	h->max_ns = ns;
+}
+
+struct stats_guest *stats_guest_alloc(int domid)
+{
+    int i;
+
+    for (i = 0; i < STATS_MAX_GUESTS; i++) {
+	struct stats_guest *g = &stats->guests[i];
+
+	if (g->domid == -1) {
+	    memset(g, 0, sizeof(*g));
+	    g->domid = domid;
+	    return g;
+	}
+    }
+    return &stats_guest_overflow;
+}
+
+void stats_guest_free(struct stats_guest *g)
+{
+    if (g != &stats_guest_overflow)
+	g->domid = -1;
+}
+
+void stats_stream_fill(struct stats_stream *s, int64_t frames)
+{
+    s->fill_frames = frames;
+    if (s->fill_samples++ == 0 || frames < s->fill_frames_min)
+	s->fill_frames_min = frames;
+    if (frames > s->fill_frames_max)
+	s->fill_frames_max = frames;
+}
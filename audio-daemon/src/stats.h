@@ -0,0 +1,96 @@
+/*
+ * stats.h:
+ *
+ * Layout of the statistics page the daemon publishes in shared memory,
+ * shared with the audio-daemon-stats dump tool.
+ */
+
+/*
+ * Copyright (c) 2012 Citrix Systems, Inc.
+ * 
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * 
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+ */
+
+#ifndef _STATS_H_
+#define _STATS_H_
+
+#include <stdint.h>
+
+#define STATS_SHM_NAME "/audio-daemon-stats"
+#define STATS_MAGIC 0x58435354 /* "XCST" */
+#define STATS_VERSION 2
+
+/* Bucket n counts samples in [2^n, 2^(n+1)) microseconds, bucket 0 is < 2us */
+#define STATS_HIST_BUCKETS 20
+#define STATS_MAX_GUESTS 16
+
+struct stats_hist {
+    uint64_t bucket[STATS_HIST_BUCKETS];
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+};
+
+/* One host PCM, updated only by its worker thread */
+struct stats_pcm {
+    uint64_t periods;
+    uint64_t xruns;
+    struct stats_hist recovery;     /* time to get the PCM running again */
+    struct stats_hist wakeup;       /* interval between two worker wakeups */
+    struct stats_hist work;         /* time spent per wakeup */
+    int64_t delay_frames;           /* last snd_pcm_delay */
+    int64_t delay_frames_max;
+};
+
+/* One guest stream */
+struct stats_stream {
+    uint64_t periods;
+    uint64_t interrupts;
+    uint64_t fill_samples;
+    int64_t fill_frames;            /* appl_ptr lead over processed */
+    int64_t fill_frames_min;
+    int64_t fill_frames_max;
+    uint64_t echo_cancel_ns;        /* speex CPU time, capture only */
+};
+
+struct stats_guest {
+    int32_t domid;                  /* -1 for a free slot */
+    int32_t period_frames;
+    uint64_t kicks;                 /* event channel notifications sent */
+    struct stats_stream p;
+    struct stats_stream c;
+};
+
+struct stats_page {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t start_ns;
+    int32_t period_frames;
+    int32_t pad;
+    struct stats_pcm p;
+    struct stats_pcm c;
+    struct stats_guest guests[STATS_MAX_GUESTS];
+};
+
+extern struct stats_page *stats;
+
+int stats_init(void);
+uint64_t stats_now_ns(void);
+void stats_hist_add(struct stats_hist *h, uint64_t ns);
+struct stats_guest *stats_guest_alloc(int domid);
+void stats_guest_free(struct stats_guest *g);
+void stats_stream_fill(struct stats_stream *s, int64_t frames);
+
+#endif
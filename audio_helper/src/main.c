@@ -39,6 +39,9 @@ void help(const char *name)
     openxt_info("\n");
     openxt_info("Available Commands:\n");
     openxt_info("    <stubdomid>            start audio backend for guest with stubdomid=<stubdomid>\n");
+    openxt_info("    multi <ids> [pcm] [capture]\n");
+    openxt_info("                           start one audio backend for the stubdomains in the comma\n");
+    openxt_info("                           separated list <ids>, mixed into pcm\n");
     openxt_info("    unittest               run audio backend unittest\n");
     openxt_info("    scontrols              show all mixer simple controls\n");
     openxt_info("    scontents              show contents of all mixer simple controls (default command)\n");
@@ -108,6 +111,7 @@ int parse_options(int argc, char *argv[])
         if (strncmp(argv[optind], "sget", 4) == 0) return openxt_mixer_ctl_sget(argc, argv);
 
         // VM Backend
+        if (strncmp(argv[optind], "multi", 5) == 0) return openxt_vmaudio_multi(argc - optind, argv + optind);
         return openxt_vmaudio(argc, argv);
     }
 }
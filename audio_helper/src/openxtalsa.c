@@ -316,6 +316,33 @@ int openxt_alsa_start(Settings *settings)
     return snd_pcm_start(settings->handle);
 }
 
+///
+/// Bring the PCM back after an xrun or a suspend. This is done once per
+/// call: if ALSA fails again right away, the caller reports no progress and
+/// tries again the next time the event loop comes around, rather than
+/// spinning here.
+///
+/// @param settings a pointer to the settings structure
+/// @param err the error ALSA returned
+/// @return 0 if the PCM was recovered, or is still resuming
+///         err if the error is not an xrun or a suspend
+///         negative error code on failure
+///
+static int openxt_alsa_recover(Settings *settings, int err)
+{
+    int ret;
+
+    // Still waking up from a suspend. Come back later.
+    if (err == -ESTRPIPE && (ret = snd_pcm_resume(settings->handle)) == -EAGAIN)
+        return 0;
+
+    // xrun, or a suspend that the hardware cannot resume from.
+    if (err == -EPIPE || err == -ESTRPIPE)
+        return openxt_alsa_prepare(settings);
+
+    return err;
+}
+
 ///
 /// Get the available samples in the PCM
 ///
@@ -334,19 +361,13 @@ int openxt_alsa_get_available(Settings *settings)
     openxt_checkp(settings, -EINVAL);
     openxt_checkp(settings->handle, -EINVAL);
 
-    // We add this loop here because if we get an EPIPE error, we need to
-    // try again, and this provides an easy way to do that.
-    while(1) {
+    // If we get an xrun, recover and ask once more.
+    if ((ret = snd_pcm_avail(settings->handle)) < 0) {
 
-        if ((ret = snd_pcm_avail(settings->handle)) < 0) {
+        if (openxt_alsa_recover(settings, ret) == 0)
+            ret = snd_pcm_avail(settings->handle);
 
-            // Check for EPIPE (xrun / suspended). If this is the case, we
-            // restart ALSA and try again.
-            if (ret == -EPIPE) {
-                ret = openxt_alsa_prepare(settings);
-                openxt_assert_ret(ret == 0, ret, ret);
-                continue;
-            }
+        if (ret < 0) {
 
             // If we got this far, we got have an error.
             openxt_error("snd_pcm_avail failed: %d - %s\n", ret, snd_strerror(ret));
@@ -354,15 +375,47 @@ int openxt_alsa_get_available(Settings *settings)
             // If this happens, no samples are available
             ret = 0;
         }
-
-        // Done
-        break;
     }
 
     // Return the number of samples
     return ret;
 }
 
+///
+/// Get the delay of the PCM: how many frames are queued before a frame
+/// written now is heard.
+///
+/// @param settings a pointer to the settings structure
+/// @return -EINVAL settings == NULL
+///         -EINVAL PCM closed
+///         the delay in frames on success
+///         0 on failure
+///
+int openxt_alsa_get_delay(Settings *settings)
+{
+    int ret;
+    snd_pcm_sframes_t delay = 0;
+
+    // Sanity checks
+    openxt_checkp(settings, -EINVAL);
+    openxt_checkp(settings->handle, -EINVAL);
+
+    // Same as openxt_alsa_get_available: recover an xrun, and ask once more.
+    if ((ret = snd_pcm_delay(settings->handle, &delay)) < 0) {
+
+        if (openxt_alsa_recover(settings, ret) == 0)
+            ret = snd_pcm_delay(settings->handle, &delay);
+
+        if (ret < 0) {
+            openxt_error("snd_pcm_delay failed: %d - %s\n", ret, snd_strerror(ret));
+            delay = 0;
+        }
+    }
+
+    // A PCM in underrun can report a negative delay
+    return (delay > 0) ? delay : 0;
+}
+
 ///
 /// Write samples to the PCM
 ///
@@ -382,41 +435,29 @@ int openxt_alsa_writei(Settings *settings, void *buffer, int32_t num, int32_t si
     openxt_checkp(buffer, -EINVAL);
     openxt_checkp(settings, -EINVAL);
     openxt_checkp(settings->handle, -EINVAL);
-    openxt_assert(settings->sample_size * num <= size, -EINVAL);
+    openxt_assert(num <= size / settings->sample_size, -EINVAL);
 
     // No need to run this if we are writing 0 samples
     if (num <= 0)
         return 0;
 
-    // We add this loop here because if we get an EPIPE error, we need to
-    // try again, and this provides an easy way to do that.
-    while(1) {
-
-        if ((ret = snd_pcm_writei(settings->handle, buffer, num)) < 0) {
+    // On an xrun or a suspend we recover and try exactly once more. If
+    // that does not work either, we report 0 samples and let the event
+    // loop bring us back, instead of spinning on -EPIPE.
+    if ((ret = snd_pcm_writei(settings->handle, buffer, num)) < 0) {
 
-            // Check for EPIPE (xrun / suspended). If this is the case, we
-            // restart ALSA and try again.
-            if (ret == -EPIPE) {
-                ret = openxt_alsa_prepare(settings);
-                openxt_assert_ret(ret == 0, ret, ret);
-                continue;
-            }
+        if (ret != -EAGAIN && openxt_alsa_recover(settings, ret) == 0)
+            ret = snd_pcm_writei(settings->handle, buffer, num);
 
-            // If the error is EAGAIN, it means that we are in non-blocking
-            // mode, and that we should try again later. In this case, we
-            // report 0 bytes.
-            if (ret == -EAGAIN) {
-                ret = 0;
-                break;
-            }
+        // If the error is EAGAIN, it means that we are in non-blocking
+        // mode, and that we should try again later. The same goes for a
+        // PCM that is still recovering.
+        if (ret == -EAGAIN || ret == -EPIPE || ret == -ESTRPIPE)
+            ret = 0;
 
-            // If we got this far, we got have an error.
+        // If we got this far, we got have an error.
+        if (ret < 0)
             openxt_error("snd_pcm_writei failed: %d - %s\n", ret, snd_strerror(ret));
-            break;
-        }
-
-        // Done
-        break;
     }
 
     // Done
@@ -442,51 +483,184 @@ int openxt_alsa_readi(Settings *settings, void *buffer, int32_t num, int32_t siz
     openxt_checkp(buffer, -EINVAL);
     openxt_checkp(settings, -EINVAL);
     openxt_checkp(settings->handle, -EINVAL);
-    openxt_assert(settings->sample_size * num <= size, -EINVAL);
+    openxt_assert(num <= size / settings->sample_size, -EINVAL);
 
     // No need to run this if we are reading 0 samples
     if (num <= 0)
         return 0;
 
-    // We add this loop here because if we get an EPIPE error, we need to
-    // try again, and this provides an easy way to do that.
-    while(1) {
-
-        if ((ret = snd_pcm_readi(settings->handle, buffer, num)) < 0) {
+    // On an xrun or a suspend we recover and try exactly once more. If
+    // that does not work either, we report 0 samples and let the event
+    // loop bring us back, instead of spinning on -EPIPE.
+    if ((ret = snd_pcm_readi(settings->handle, buffer, num)) < 0) {
 
-            // Check for EPIPE (xrun / suspended). If this is the case, we
-            // restart ALSA and try again.
-            if (ret == -EPIPE) {
-                ret = openxt_alsa_prepare(settings);
-                openxt_assert_ret(ret == 0, ret, ret);
-                continue;
-            }
+        if (ret != -EAGAIN && openxt_alsa_recover(settings, ret) == 0)
+            ret = snd_pcm_readi(settings->handle, buffer, num);
 
-            // If the error is EAGAIN, it means that we are in non-blocking
-            // mode, and that we should try again later. In this case, we
-            // report 0 bytes.
-            if (ret == -EAGAIN) {
-                ret = 0;
-                break;
-            }
+        // If the error is EAGAIN, it means that we are in non-blocking
+        // mode, and that we should try again later. The same goes for a
+        // PCM that is still recovering.
+        if (ret == -EAGAIN || ret == -EPIPE || ret == -ESTRPIPE)
+            ret = 0;
 
-            // If we got this far, we got have an error.
+        // If we got this far, we got have an error.
+        if (ret < 0)
             openxt_error("snd_pcm_readi failed: %d - %s\n", ret, snd_strerror(ret));
-            break;
-        }
-
-        // Done
-        break;
     }
 
     // Done
     return ret;
 }
 
+///
+/// Get the poll descriptors of the PCM, so that it can be watched together
+/// with other file descriptors.
+///
+/// @param settings a pointer to the settings structure
+/// @param pfds where to store the descriptors
+/// @param space number of entries in pfds
+/// @return -EINVAL settings == NULL
+///         -EINVAL PCM closed
+///         -ENOSPC pfds is too small
+///         number of descriptors on success
+///
+int openxt_alsa_poll_descriptors(Settings *settings, struct pollfd *pfds, int32_t space)
+{
+    int count;
+
+    // Sanity checks
+    openxt_checkp(pfds, -EINVAL);
+    openxt_checkp(settings, -EINVAL);
+    openxt_checkp(settings->handle, -EINVAL);
+
+    count = snd_pcm_poll_descriptors_count(settings->handle);
+    openxt_assert_ret(count >= 0, count, count);
+    openxt_assert(count <= space, -ENOSPC);
+
+    return snd_pcm_poll_descriptors(settings->handle, pfds, count);
+}
+
+///
+/// Turn the events reported on the PCM's poll descriptors into the events
+/// of the PCM itself. Plugins can use their descriptors for anything, so
+/// the raw events say nothing until they have gone through ALSA.
+///
+/// @param settings a pointer to the settings structure
+/// @param pfds descriptors from openxt_alsa_poll_descriptors, with revents
+///        filled in
+/// @param count number of entries in pfds
+/// @return -EINVAL settings == NULL
+///         -EINVAL PCM closed
+///         negative error code on failure
+///         the PCM's poll events on success
+///
+int openxt_alsa_poll_revents(Settings *settings, struct pollfd *pfds, int32_t count)
+{
+    int ret;
+    unsigned short revents = 0;
+
+    // Sanity checks
+    openxt_checkp(pfds, -EINVAL);
+    openxt_checkp(settings, -EINVAL);
+    openxt_checkp(settings->handle, -EINVAL);
+
+    ret = snd_pcm_poll_descriptors_revents(settings->handle, pfds, count, &revents);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    return revents;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Simple Element Functions                                                                            //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+///
+/// Forget the cached simple element. The next openxt_alsa_mixer_sget
+/// searches for it again.
+///
+/// @param settings a pointer to the settings structure
+///
+static void openxt_alsa_mixer_invalidate(Settings *settings)
+{
+    settings->elem = NULL;
+    settings->elem_cached = false;
+    settings->last_vol = -1;
+    settings->last_enabled = -1;
+}
+
+///
+/// Called by ALSA, from snd_mixer_handle_events, when the cached element
+/// changes. A new value (someone else moved the slider) means the last value
+/// we wrote is no longer what the element holds. New info can mean a new
+/// range, and a removed element must not be touched again.
+///
+static int openxt_alsa_mixer_elem_event(snd_mixer_elem_t *elem, unsigned int mask)
+{
+    Settings *settings = snd_mixer_elem_get_callback_private(elem);
+
+    if (settings == NULL || settings->elem != elem)
+        return 0;
+
+    if (mask == SND_CTL_EVENT_MASK_REMOVE || (mask & SND_CTL_EVENT_MASK_INFO) != 0) {
+        openxt_alsa_mixer_invalidate(settings);
+        return 0;
+    }
+
+    if ((mask & SND_CTL_EVENT_MASK_VALUE) != 0) {
+        settings->last_vol = -1;
+        settings->last_enabled = -1;
+    }
+
+    return 0;
+}
+
+///
+/// Fills in what we need to know about settings->elem to set it, so that
+/// doing so is a single ALSA write.
+///
+/// @param settings a pointer to the settings structure
+///
+static void openxt_alsa_mixer_cache(Settings *settings)
+{
+    int ret = -1;
+    snd_mixer_elem_t *elem = settings->elem;
+
+    settings->volume_type = 0;
+    settings->switch_type = 0;
+    settings->volume_min = 0;
+    settings->volume_max = 0;
+    settings->last_vol = -1;
+    settings->last_enabled = -1;
+
+    // Figure out if this is a playback or a capture element
+    if (snd_mixer_selem_has_common_volume(elem) == 1 ||
+        snd_mixer_selem_has_playback_volume(elem) == 1) {
+        settings->volume_type = 'P';
+        ret = snd_mixer_selem_get_playback_volume_range(elem, &settings->volume_min, &settings->volume_max);
+    } else if (snd_mixer_selem_has_capture_volume(elem) == 1) {
+        settings->volume_type = 'C';
+        ret = snd_mixer_selem_get_capture_volume_range(elem, &settings->volume_min, &settings->volume_max);
+    }
+
+    // Without a range, we cannot set the volume
+    if (settings->volume_type != 0 && ret != 0)
+        settings->volume_type = 0;
+
+    if (snd_mixer_selem_has_common_switch(elem) == 1 ||
+        snd_mixer_selem_has_playback_switch(elem) == 1) {
+        settings->switch_type = 'P';
+    } else if (snd_mixer_selem_has_capture_switch(elem) == 1) {
+        settings->switch_type = 'C';
+    }
+
+    snd_mixer_elem_set_callback_private(elem, settings);
+    snd_mixer_elem_set_callback(elem, openxt_alsa_mixer_elem_event);
+
+    strncpy(settings->elem_name, settings->selement_name, MAX_NAME_LENGTH - 1);
+    settings->elem_index = settings->selement_index;
+    settings->elem_cached = true;
+}
+
 ///
 /// Initialize the mixer
 ///
@@ -515,6 +689,7 @@ int openxt_alsa_mixer_fini(Settings *settings)
 
     // Reset
     settings->mhandle = NULL;
+    openxt_alsa_mixer_invalidate(settings);
 
     // Done
     return ret;
@@ -548,6 +723,9 @@ int openxt_alsa_mixer_init(Settings *settings)
     ret = snd_mixer_load(settings->mhandle);
     openxt_assert_goto(ret == 0, falure);
 
+    // Nothing is cached yet
+    openxt_alsa_mixer_invalidate(settings);
+
     // Success
     return 0;
 
@@ -848,6 +1026,14 @@ int openxt_alsa_mixer_sget(Settings *settings)
     openxt_checkp(settings, -EINVAL);
     openxt_checkp(settings->mhandle, -EINVAL);
 
+    // Same element as last time, and ALSA has not told us otherwise
+    if (settings->elem_cached == true &&
+        settings->elem_index == settings->selement_index &&
+        strncmp(settings->elem_name, settings->selement_name, MAX_NAME_LENGTH) == 0)
+        return 0;
+
+    openxt_alsa_mixer_invalidate(settings);
+
     // Create a simple element id. For whatever reason, if you want to search
     // for a simple element, you need to define the selement id, and then set
     // the name there so that you can do the search
@@ -865,6 +1051,9 @@ int openxt_alsa_mixer_sget(Settings *settings)
     settings->elem = snd_mixer_find_selem(settings->mhandle, selem_id);
     openxt_checkp_goto(settings->elem, failure);
 
+    // Remember it, and what it can do
+    openxt_alsa_mixer_cache(settings);
+
     // Success
     snd_mixer_selem_id_free(selem_id);
     return 0;
@@ -931,70 +1120,43 @@ int openxt_alsa_mixer_sset_enum(Settings *settings, char *name)
 int openxt_alsa_mixer_sset_volume(Settings *settings, int32_t vol)
 {
     int ret;
-    int chn;
-    long min;
-    long max;
-    char type = 0;
+    long value;
 
     // Sanity checks
     openxt_checkp(settings, -EINVAL);
     openxt_checkp(settings->elem, -EINVAL);
     openxt_assert(vol >= 0 && vol <= 100, -EINVAL);
 
-    // Figure out if this is a playback element
-    if (snd_mixer_selem_has_common_volume(settings->elem) == 1 ||
-        snd_mixer_selem_has_playback_volume(settings->elem) == 1) {
-        type = 'P';
-    }
-
-    // Figure out if this is a capture element
-    else if (snd_mixer_selem_has_capture_volume(settings->elem) == 1) {
-        type = 'C';
-    }
+    // The element may have been set by the caller rather than by
+    // openxt_alsa_mixer_sget
+    if (settings->elem_cached == false)
+        openxt_alsa_mixer_cache(settings);
 
-    // Not supported
-    else {
+    // Nothing to do if the element already holds this volume
+    if (vol == settings->last_vol)
         return 0;
-    }
 
-    // We need to get the actual range that ALSA has setup for the simple
-    // element. This function accepts a percentage (0-100) so we need to
-    // convert
-    switch(type) {
+    // Now that we have the max and min, we can calculate the volume .
+    // Note that we don't support setting each channel manually, you set the
+    // volume for all of the channels, in one write.
+    value = round(((double)((settings->volume_max - settings->volume_min) * vol)) / 100.0);
+
+    switch(settings->volume_type) {
         case 'P':
-            ret = snd_mixer_selem_get_playback_volume_range(settings->elem, &min, &max);
+            ret = snd_mixer_selem_set_playback_volume_all(settings->elem, value);
             openxt_assert_ret(ret == 0, ret, ret);
             break;
         case 'C':
-            ret = snd_mixer_selem_get_capture_volume_range(settings->elem, &min, &max);
+            ret = snd_mixer_selem_set_capture_volume_all(settings->elem, value);
             openxt_assert_ret(ret == 0, ret, ret);
             break;
+
+        // Not supported
         default:
-            break;
+            return 0;
     }
 
-    // Now that we have the max and min, we can calculate the volume .
-    // Note that we don't support setting each channel manually, you set the
-    // volume for all of the channels.
-    vol = round(((double)((max - min) * vol)) / 100.0);
-
-    // Loop through all of the channles, and their their volume as well
-    // as their switch
-    for (chn = 0; chn <= SND_MIXER_SCHN_LAST; chn++) {
-
-        switch(type) {
-            case 'P':
-                ret = snd_mixer_selem_set_playback_volume(settings->elem, chn, vol);
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-            case 'C':
-                ret = snd_mixer_selem_set_capture_volume(settings->elem, chn, vol);
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-            default:
-                break;
-        }
-    }
+    settings->last_vol = vol;
 
     // Success
     return 0;
@@ -1012,51 +1174,95 @@ int openxt_alsa_mixer_sset_volume(Settings *settings, int32_t vol)
 int openxt_alsa_mixer_sset_switch(Settings *settings, int32_t enabled)
 {
     int ret;
-    int chn;
-    char type = 0;
 
     // Sanity checks
     openxt_checkp(settings, -EINVAL);
     openxt_checkp(settings->elem, -EINVAL);
 
-    // Figure out if this is a playback element
-    if (snd_mixer_selem_has_common_switch(settings->elem) == 1 ||
-        snd_mixer_selem_has_playback_switch(settings->elem) == 1) {
-        type = 'P';
-    }
-
-    // Figure out if this is a capture element
-    else if (snd_mixer_selem_has_capture_switch(settings->elem) == 1) {
-        type = 'C';
-    }
+    // The element may have been set by the caller rather than by
+    // openxt_alsa_mixer_sget
+    if (settings->elem_cached == false)
+        openxt_alsa_mixer_cache(settings);
 
-    // Not supported
-    else {
+    // Nothing to do if the switch is already there
+    if (enabled == settings->last_enabled)
         return 0;
-    }
 
-    // Loop through all of the channles, and their their volume as well
-    // as their switch
-    for (chn = 0; chn <= SND_MIXER_SCHN_LAST; chn++) {
+    // All of the channels, in one write
+    switch(settings->switch_type) {
+        case 'P':
+            ret = snd_mixer_selem_set_playback_switch_all(settings->elem, enabled);
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+        case 'C':
+            ret = snd_mixer_selem_set_capture_switch_all(settings->elem, enabled);
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
 
-        switch(type) {
-            case 'P':
-                ret = snd_mixer_selem_set_playback_switch(settings->elem, chn, enabled);
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-            case 'C':
-                ret = snd_mixer_selem_set_capture_switch(settings->elem, chn, enabled);
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
-            default:
-                break;
-        }
+        // Not supported
+        default:
+            return 0;
     }
 
+    settings->last_enabled = enabled;
+
     // Success
     return 0;
 }
 
+///
+/// Get the poll descriptors of the mixer. When they fire, call
+/// openxt_alsa_mixer_handle_events so that the element cache hears about
+/// changes.
+///
+/// @param settings a pointer to the settings structure
+/// @param pfds where to store the descriptors
+/// @param space number of entries in pfds
+/// @return -EINVAL settings == NULL
+///         -EINVAL mixer closed
+///         -ENOSPC pfds is too small
+///         number of descriptors on success
+///
+int openxt_alsa_mixer_poll_descriptors(Settings *settings, struct pollfd *pfds, int32_t space)
+{
+    int count;
+
+    // Sanity checks
+    openxt_checkp(pfds, -EINVAL);
+    openxt_checkp(settings, -EINVAL);
+    openxt_checkp(settings->mhandle, -EINVAL);
+
+    count = snd_mixer_poll_descriptors_count(settings->mhandle);
+    openxt_assert_ret(count >= 0, count, count);
+    openxt_assert(count <= space, -ENOSPC);
+
+    return snd_mixer_poll_descriptors(settings->mhandle, pfds, count);
+}
+
+///
+/// Let ALSA deliver pending mixer events, which keeps the element cache
+/// up to date.
+///
+/// @param settings a pointer to the settings structure
+/// @return -EINVAL settings == NULL
+///         -EINVAL mixer closed
+///         negative error code on failure
+///         0 on success
+///
+int openxt_alsa_mixer_handle_events(Settings *settings)
+{
+    int ret;
+
+    // Sanity checks
+    openxt_checkp(settings, -EINVAL);
+    openxt_checkp(settings->mhandle, -EINVAL);
+
+    ret = snd_mixer_handle_events(settings->mhandle);
+    openxt_assert_ret(ret >= 0, ret, ret);
+
+    return 0;
+}
+
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Control Functions                                                                                   //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
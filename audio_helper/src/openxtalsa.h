@@ -26,6 +26,7 @@
 #define ALSA_PCM_NEW_HW_PARAMS_API
 #include <alsa/asoundlib.h>
 
+#include <poll.h>
 #include <stdint.h>
 #include <stdbool.h>
 #include <sys/types.h>
@@ -50,6 +51,18 @@ typedef struct Settings {
     snd_mixer_t *mhandle;
     snd_mixer_elem_t *elem;
 
+    // What openxt_alsa_mixer_sget found last, and what we know about it.
+    // ALSA tells us through the mixer callbacks when this goes stale.
+    bool elem_cached;
+    char elem_name[MAX_NAME_LENGTH];
+    long elem_index;
+    char volume_type;
+    char switch_type;
+    long volume_min;
+    long volume_max;
+    int32_t last_vol;
+    int32_t last_enabled;
+
     int32_t fmt;
     uint32_t freq;
     int32_t mode;
@@ -79,8 +92,11 @@ int openxt_alsa_prepare(Settings *settings);
 int openxt_alsa_drop(Settings *settings);
 int openxt_alsa_start(Settings *settings);
 int openxt_alsa_get_available(Settings *settings);
+int openxt_alsa_get_delay(Settings *settings);
 int openxt_alsa_writei(Settings *settings, void *buffer, int32_t num, int32_t size);
 int openxt_alsa_readi(Settings *settings, void *buffer, int32_t num, int32_t size);
+int openxt_alsa_poll_descriptors(Settings *settings, struct pollfd *pfds, int32_t space);
+int openxt_alsa_poll_revents(Settings *settings, struct pollfd *pfds, int32_t count);
 
 // Simple Mixer
 int openxt_alsa_mixer_fini(Settings *settings);
@@ -91,6 +107,8 @@ int openxt_alsa_mixer_sget(Settings *settings);
 int openxt_alsa_mixer_sset_enum(Settings *settings, char *name);
 int openxt_alsa_mixer_sset_volume(Settings *settings, int32_t vol);
 int openxt_alsa_mixer_sset_switch(Settings *settings, int32_t enabled);
+int openxt_alsa_mixer_poll_descriptors(Settings *settings, struct pollfd *pfds, int32_t space);
+int openxt_alsa_mixer_handle_events(Settings *settings);
 
 // Control
 int openxt_alsa_remove_pcm(Settings *settings);
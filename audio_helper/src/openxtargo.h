@@ -23,6 +23,7 @@
 #include <stdbool.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/socket.h>
 
 #include "openxtsettings.h"
 
@@ -30,12 +31,14 @@ typedef struct ArgoConnection {
 
     int fd;
     bool connected;
+    bool loopback;
     xen_argo_addr_t local_addr;
     xen_argo_addr_t remote_addr;
 
 } ArgoConnection;
 
 ArgoConnection *openxt_argo_open(int32_t lport, int32_t ldomid, int32_t rport, int32_t rdomid);
+int openxt_argo_open_loopback(ArgoConnection **end1, ArgoConnection **end2);
 int openxt_argo_close_internal(ArgoConnection *conn);
 int openxt_argo_close(ArgoConnection *conn);
 bool openxt_argo_isconnected(ArgoConnection *conn);
@@ -71,4 +74,16 @@ void *openxt_argo_get_body(ArgoPacket *packet);
 int openxt_argo_send(ArgoConnection *conn, ArgoPacket *packet);
 int openxt_argo_recv(ArgoConnection *conn, ArgoPacket *packet);
 
+typedef struct ArgoPacketPool {
+
+    ArgoPacket *packets;
+    int32_t count;
+    int32_t next;
+
+} ArgoPacketPool;
+
+int openxt_argo_pool_init(ArgoPacketPool *pool, int32_t count);
+int openxt_argo_pool_fini(ArgoPacketPool *pool);
+void *openxt_argo_build(ArgoPacketPool *pool, ArgoPacket **packet, int32_t opcode, int32_t length);
+
 #endif // OPENXT_ARGO_H
@@ -0,0 +1,214 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "openxtmix.h"
+#include "openxtalsa.h"
+#include "openxtdebug.h"
+
+///
+/// Sets up a channel that holds up to size frames.
+///
+/// @param channel the channel
+/// @param size number of frames, must be a power of two
+/// @param nchannels samples per frame
+/// @return -EINVAL if channel == NULL or size is not a power of two
+///         -ENOMEM if out of memory
+///         0 on success
+///
+int openxt_mix_channel_init(MixChannel *channel, uint32_t size, uint32_t nchannels)
+{
+    // Sanity checks
+    openxt_checkp(channel, -EINVAL);
+    openxt_assert(size != 0 && (size & (size - 1)) == 0, -EINVAL);
+    openxt_assert(nchannels != 0, -EINVAL);
+
+    channel->frames = calloc(size * nchannels, sizeof(int16_t));
+    openxt_checkp(channel->frames, -ENOMEM);
+
+    channel->size = size;
+    channel->nchannels = nchannels;
+    channel->gain = OPENXT_MIX_UNITY;
+    openxt_mix_channel_reset(channel);
+
+    // Success
+    return 0;
+}
+
+///
+/// @param channel the channel
+/// @return -EINVAL if channel == NULL
+///         0 on success
+///
+int openxt_mix_channel_fini(MixChannel *channel)
+{
+    // Sanity checks
+    openxt_checkp(channel, -EINVAL);
+
+    free(channel->frames);
+    channel->frames = NULL;
+    channel->size = 0;
+
+    // Success
+    return 0;
+}
+
+///
+/// Throws away whatever is queued, for instance when the voice is disabled.
+///
+void openxt_mix_channel_reset(MixChannel *channel)
+{
+    channel->prod = 0;
+    channel->cons = 0;
+}
+
+uint32_t openxt_mix_channel_used(MixChannel *channel)
+{
+    return channel->prod - channel->cons;
+}
+
+uint32_t openxt_mix_channel_free(MixChannel *channel)
+{
+    return channel->size - openxt_mix_channel_used(channel);
+}
+
+///
+/// Queues frames to be mixed. What does not fit is left out; QEMU asks how
+/// much room there is before it writes, so this only happens to a client
+/// that does not play by the rules.
+///
+/// @param channel the channel
+/// @param frames the frames to queue
+/// @param count number of frames
+/// @return number of frames queued
+///
+uint32_t openxt_mix_channel_write(MixChannel *channel, const void *frames, uint32_t count)
+{
+    uint32_t index;
+    uint32_t first;
+    uint32_t frame_size = channel->nchannels * sizeof(int16_t);
+
+    count = min(count, openxt_mix_channel_free(channel));
+
+    // At most two copies, either side of the wrap
+    index = channel->prod & (channel->size - 1);
+    first = min(count, channel->size - index);
+
+    memcpy(channel->frames + (index * channel->nchannels), frames, first * frame_size);
+    memcpy(channel->frames, (const char *)frames + (first * frame_size), (count - first) * frame_size);
+
+    channel->prod += count;
+    return count;
+}
+
+///
+/// Sets the gain from the guest's volume. The guest's mixer already maps
+/// its slider to a percentage, which we take as linear amplitude.
+///
+/// @param channel the channel
+/// @param vol volume in percent
+/// @param enabled 0 mutes the channel
+///
+void openxt_mix_channel_set_gain(MixChannel *channel, int32_t vol, int32_t enabled)
+{
+    vol = min(max(vol, 0), 100);
+    channel->gain = (enabled != 0) ? (vol * OPENXT_MIX_UNITY) / 100 : 0;
+}
+
+///
+/// A channel that is playing holds the mix back until it has something
+/// queued, so that guests are mixed sample for sample rather than taking
+/// turns. Only once another channel has a whole period queued while this
+/// one has nothing is it taken to have underrun, and left out.
+///
+/// @return how many frames every channel that has not underrun has queued,
+///         which is how many openxt_mix_render would produce if given the room
+///
+uint32_t openxt_mix_pending(MixChannel **channels, int32_t count)
+{
+    int32_t i;
+    uint32_t used;
+    uint32_t fullest = 0;
+    uint32_t pending = UINT32_MAX;
+
+    for (i = 0; i < count; i++)
+        fullest = max(fullest, openxt_mix_channel_used(channels[i]));
+
+    if (fullest == 0)
+        return 0;
+
+    for (i = 0; i < count; i++) {
+
+        used = openxt_mix_channel_used(channels[i]);
+        if (used == 0 && fullest >= OPENXT_MIX_PERIOD)
+            continue;
+
+        pending = min(pending, used);
+    }
+
+    return pending;
+}
+
+///
+/// Mixes the channels into out, applying each channel's gain, and clipping
+/// the sum. Only a channel that has underrun (see openxt_mix_pending) runs
+/// short, and it is padded with silence rather than holding back the others.
+///
+/// @param channels the channels to mix, all with the same nchannels
+/// @param count number of channels
+/// @param out where the mixed frames go
+/// @param frames most frames to produce
+/// @return number of frames produced, 0 if nothing is queued
+///
+uint32_t openxt_mix_render(MixChannel **channels, int32_t count, int16_t *out, uint32_t frames)
+{
+    int32_t i;
+    uint32_t n;
+    uint32_t s;
+    uint32_t nchannels;
+    int32_t acc[OPENXT_MIX_PERIOD * 2];
+
+    if (count <= 0)
+        return 0;
+
+    nchannels = channels[0]->nchannels;
+    frames = min(frames, openxt_mix_pending(channels, count));
+    frames = min(frames, (uint32_t)(sizeof(acc) / sizeof(acc[0])) / nchannels);
+
+    memset(acc, 0, frames * nchannels * sizeof(int32_t));
+
+    for (i = 0; i < count; i++) {
+
+        MixChannel *channel = channels[i];
+        uint32_t avail = min(frames, openxt_mix_channel_used(channel));
+
+        for (n = 0; n < avail; n++) {
+
+            int16_t *frame = channel->frames + (((channel->cons + n) & (channel->size - 1)) * nchannels);
+
+            for (s = 0; s < nchannels; s++)
+                acc[(n * nchannels) + s] += (frame[s] * channel->gain) >> 16;
+        }
+
+        channel->cons += avail;
+    }
+
+    for (n = 0; n < frames * nchannels; n++)
+        out[n] = (int16_t)min(max(acc[n], INT16_MIN), INT16_MAX);
+
+    return frames;
+}
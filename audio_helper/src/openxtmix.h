@@ -0,0 +1,61 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef OPENXT_MIX_H
+#define OPENXT_MIX_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "openxtsettings.h"
+
+// Unity gain
+#define OPENXT_MIX_UNITY (1 << 16)
+
+///
+/// One client's playback, waiting to be mixed. Samples are 16 bit signed,
+/// interleaved, nchannels of them per frame. The indices are free running
+/// frame counts.
+///
+typedef struct MixChannel {
+
+    int16_t *frames;
+    uint32_t size;
+    uint32_t nchannels;
+
+    uint32_t prod;
+    uint32_t cons;
+
+    // Q16 fixed point, OPENXT_MIX_UNITY is unity gain
+    int32_t gain;
+
+} MixChannel;
+
+int openxt_mix_channel_init(MixChannel *channel, uint32_t size, uint32_t nchannels);
+int openxt_mix_channel_fini(MixChannel *channel);
+void openxt_mix_channel_reset(MixChannel *channel);
+uint32_t openxt_mix_channel_used(MixChannel *channel);
+uint32_t openxt_mix_channel_free(MixChannel *channel);
+uint32_t openxt_mix_channel_write(MixChannel *channel, const void *frames, uint32_t count);
+void openxt_mix_channel_set_gain(MixChannel *channel, int32_t vol, int32_t enabled);
+
+uint32_t openxt_mix_pending(MixChannel **channels, int32_t count);
+uint32_t openxt_mix_render(MixChannel **channels, int32_t count, int16_t *out, uint32_t frames);
+
+#endif // OPENXT_MIX_H
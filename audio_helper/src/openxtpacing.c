@@ -0,0 +1,164 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include "openxtpacing.h"
+
+///
+/// Starts over, for instance after the PCM was prepared or dropped, when
+/// the old delay says nothing about the new one.
+///
+/// @param pacer the pacer
+/// @param rate the rate of the PCM
+///
+void openxt_pacing_reset(Pacer *pacer, uint32_t rate)
+{
+    pacer->rate = rate;
+    pacer->started = false;
+    pacer->locked = false;
+    pacer->start_time = 0;
+    pacer->last_time = 0;
+    pacer->delay = 0;
+    pacer->target = 0;
+    pacer->raw_delay = 0;
+    pacer->corrected = 0;
+    pacer->drift = 0;
+    pacer->owed = 0;
+}
+
+///
+/// Feeds a new snd_pcm_delay reading. The delay is smoothed, and the drift
+/// between the guest and the card is the slope of the delay we would have
+/// seen without any correction. Once the delay has settled, it becomes the
+/// target that the correction holds it to.
+///
+/// @param pacer the pacer
+/// @param delay frames queued in the PCM
+/// @param now CLOCK_MONOTONIC time of the reading, in nanoseconds
+///
+void openxt_pacing_update(Pacer *pacer, int32_t delay, uint64_t now)
+{
+    double dt;
+    double prev;
+    double slope;
+    double raw = (double)delay + pacer->corrected;
+
+    if (pacer->started == false) {
+        pacer->started = true;
+        pacer->start_time = now;
+        pacer->last_time = now;
+        pacer->delay = delay;
+        pacer->raw_delay = raw;
+        return;
+    }
+
+    dt = (double)(now - pacer->last_time) / 1e9;
+    if (dt <= 0 || pacer->rate == 0)
+        return;
+
+    pacer->last_time = now;
+
+    pacer->delay += (dt / (dt + OPENXT_PACING_DELAY_TAU)) * (delay - pacer->delay);
+
+    prev = pacer->raw_delay;
+    pacer->raw_delay += (dt / (dt + OPENXT_PACING_DELAY_TAU)) * (raw - pacer->raw_delay);
+
+    slope = ((pacer->raw_delay - prev) / dt) / pacer->rate * 1e6;
+    pacer->drift += (dt / (dt + OPENXT_PACING_DRIFT_TAU)) * (slope - pacer->drift);
+
+    if (pacer->locked == false && (double)(now - pacer->start_time) / 1e9 >= OPENXT_PACING_SETTLE) {
+        pacer->locked = true;
+        pacer->target = pacer->delay;
+    }
+}
+
+///
+/// Tells the caller how many frames to drop or duplicate in the next write
+/// of frames frames. The rate of correction is the measured drift, plus
+/// whatever it takes to bring the delay back to the target over
+/// OPENXT_PACING_CORRECT_TAU. A frame now and then is inaudible, unlike
+/// the xrun we would get if the delay were left to drift. The caller
+/// reports what it actually did with openxt_pacing_applied.
+///
+/// @param pacer the pacer
+/// @param frames number of frames about to be written
+/// @return > 0 number of frames to drop
+///         < 0 number of frames to duplicate
+///         0 to write the frames as they are
+///
+int32_t openxt_pacing_adjust(Pacer *pacer, int32_t frames)
+{
+    double ppm;
+    int32_t adjust;
+
+    if (pacer->locked == false || frames <= 1)
+        return 0;
+
+    ppm = pacer->drift;
+    ppm += (pacer->delay - pacer->target) / pacer->rate / OPENXT_PACING_CORRECT_TAU * 1e6;
+
+    if (ppm > OPENXT_PACING_MAX_PPM)
+        ppm = OPENXT_PACING_MAX_PPM;
+    if (ppm < -OPENXT_PACING_MAX_PPM)
+        ppm = -OPENXT_PACING_MAX_PPM;
+
+    pacer->owed += ppm * 1e-6 * frames;
+
+    // Whole frames only, and never the entire write
+    adjust = (int32_t)pacer->owed;
+    if (adjust >= frames)
+        adjust = frames - 1;
+    if (adjust <= -frames)
+        adjust = -(frames - 1);
+
+    pacer->owed -= adjust;
+
+    return adjust;
+}
+
+///
+/// Records how much of a correction made it to the card. Frames that could
+/// not be dropped or duplicated are owed again, and only the rest count
+/// towards the delay we would have seen without any correction.
+///
+/// @param pacer the pacer
+/// @param adjust what openxt_pacing_adjust asked for
+/// @param applied what was actually done, of the same sign
+///
+void openxt_pacing_applied(Pacer *pacer, int32_t adjust, int32_t applied)
+{
+    pacer->owed += adjust - applied;
+    pacer->corrected += applied;
+}
+
+///
+/// @param pacer the pacer
+/// @return the smoothed delay, in frames
+///
+int32_t openxt_pacing_delay(Pacer *pacer)
+{
+    return (int32_t)pacer->delay;
+}
+
+///
+/// @param pacer the pacer
+/// @return the smoothed drift, in parts per million
+///
+int32_t openxt_pacing_drift(Pacer *pacer)
+{
+    return (int32_t)pacer->drift;
+}
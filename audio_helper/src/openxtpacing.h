@@ -0,0 +1,62 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef OPENXT_PACING_H
+#define OPENXT_PACING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "openxtsettings.h"
+
+typedef struct Pacer {
+
+    uint32_t rate;
+    bool started;
+    bool locked;
+
+    uint64_t start_time;
+    uint64_t last_time;
+
+    // Smoothed delay of the PCM, and the delay we hold it at, in frames
+    double delay;
+    double target;
+
+    // What the delay would be without our corrections, and the corrections
+    // so far (dropped minus duplicated frames)
+    double raw_delay;
+    int64_t corrected;
+
+    // Smoothed drift in parts per million, positive when the guest runs
+    // faster than the card
+    double drift;
+
+    // Fraction of a frame owed to the correction
+    double owed;
+
+} Pacer;
+
+void openxt_pacing_reset(Pacer *pacer, uint32_t rate);
+void openxt_pacing_update(Pacer *pacer, int32_t delay, uint64_t now);
+int32_t openxt_pacing_adjust(Pacer *pacer, int32_t frames);
+void openxt_pacing_applied(Pacer *pacer, int32_t adjust, int32_t applied);
+int32_t openxt_pacing_delay(Pacer *pacer);
+int32_t openxt_pacing_drift(Pacer *pacer);
+
+#endif // OPENXT_PACING_H
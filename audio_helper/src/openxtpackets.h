@@ -23,8 +23,27 @@
 #ifndef OPENXT_PACKETS_H
 #define OPENXT_PACKETS_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #include "openxtsettings.h"
 
+// Protocol versions, negotiated with OPENXT_PLAYBACK_INIT. Version 1 peers
+// send an empty init packet.
+//
+// - 1: one period per OPENXT_PLAYBACK packet, available queried separately
+// - 2: OPENXT_PLAYBACK_WRITE_AVAILABLE and OPENXT_PLAYBACK_VECTOR
+// - 3: shared sample rings, Argo only carries ring indices (doorbells)
+// - 4: OPENXT_PLAYBACK_GET_DELAY
+#define OPENXT_PROTOCOL_VERSION_1 1
+#define OPENXT_PROTOCOL_VERSION_2 2
+#define OPENXT_PROTOCOL_VERSION_3 3
+#define OPENXT_PROTOCOL_VERSION_4 4
+#define OPENXT_PROTOCOL_VERSION OPENXT_PROTOCOL_VERSION_4
+
+// Most periods a single OPENXT_PLAYBACK_VECTOR packet can carry
+#define OPENXT_MAX_VECTOR_PERIODS 8
+
 typedef enum PacketOpCode {
 
     // Global
@@ -45,6 +64,8 @@ typedef enum PacketOpCode {
     OPENXT_PLAYBACK_GET_AVAILABLE_ACK   = 31,
     OPENXT_CAPTURE_GET_AVAILABLE        = 32,
     OPENXT_CAPTURE_GET_AVAILABLE_ACK    = 33,
+    OPENXT_PLAYBACK_GET_DELAY           = 34,
+    OPENXT_PLAYBACK_GET_DELAY_ACK       = 35,
 
     // Control
     OPENXT_PLAYBACK_ENABLE_VOICE        = 40,
@@ -58,12 +79,33 @@ typedef enum PacketOpCode {
     OPENXT_CAPTURE                      = 51,
     OPENXT_CAPTURE_ACK                  = 53,
 
+    // Process (protocol version 2)
+    OPENXT_PLAYBACK_WRITE_AVAILABLE     = 54,
+    OPENXT_PLAYBACK_WRITE_AVAILABLE_ACK = 55,
+    OPENXT_PLAYBACK_VECTOR              = 56,
+
+    // Shared rings (protocol version 3)
+    OPENXT_PLAYBACK_RING_INIT           = 60,
+    OPENXT_PLAYBACK_RING_INIT_ACK       = 61,
+    OPENXT_PLAYBACK_DOORBELL            = 62,
+    OPENXT_PLAYBACK_DOORBELL_ACK        = 63,
+    OPENXT_CAPTURE_RING_INIT            = 64,
+    OPENXT_CAPTURE_RING_INIT_ACK        = 65,
+    OPENXT_CAPTURE_DOORBELL             = 66,
+    OPENXT_CAPTURE_DOORBELL_ACK         = 67,
+
 } PacketOpCode;
 
 typedef struct  __attribute__((packed)) {
 
 } OpenBlankPacket;
 
+typedef struct  __attribute__((packed)) {
+
+    int32_t version;
+
+} OpenXTPlaybackInitPacket;
+
 typedef struct  __attribute__((packed)) {
 
     int32_t fmt;
@@ -71,6 +113,9 @@ typedef struct  __attribute__((packed)) {
     int32_t valid;
     int32_t nchannels;
 
+    // Version 2 and up, not sent to version 1 peers
+    int32_t version;
+
 } OpenXTPlaybackInitAckPacket;
 
 typedef struct  __attribute__((packed)) {
@@ -79,6 +124,18 @@ typedef struct  __attribute__((packed)) {
 
 } OpenXTPlaybackGetAvailableAckPacket;
 
+// How much audio is queued, so that QEMU can pace itself instead of filling
+// whatever room is available. delay and avg_delay are in samples, drift is
+// in parts per million, positive when the guest runs faster than the card.
+typedef struct  __attribute__((packed)) {
+
+    int32_t available;
+    int32_t delay;
+    int32_t avg_delay;
+    int32_t drift;
+
+} OpenXTPlaybackGetDelayAckPacket;
+
 typedef struct  __attribute__((packed)) {
 
     int32_t num_samples;
@@ -93,6 +150,51 @@ typedef struct  __attribute__((packed)) {
 
 } OpenXTPlaybackSetVolumePacket;
 
+// Several periods back to back. The samples of period n follow those of
+// period n - 1, num_samples[n] of them.
+typedef struct  __attribute__((packed)) {
+
+    int32_t num_periods;
+    int32_t num_samples[OPENXT_MAX_VECTOR_PERIODS];
+    char samples[ARGO_MAX_PACKET_BODY_SIZE - (sizeof(int32_t) * (OPENXT_MAX_VECTOR_PERIODS + 1))];
+
+} OpenXTPlaybackVectorPacket;
+
+// Reply to OPENXT_PLAYBACK_WRITE_AVAILABLE and OPENXT_PLAYBACK_VECTOR:
+// what was queued, and the room left afterwards.
+typedef struct  __attribute__((packed)) {
+
+    int32_t written;
+    int32_t available;
+
+} OpenXTPlaybackWriteAvailableAckPacket;
+
+// Reply to OPENXT_PLAYBACK_RING_INIT and OPENXT_CAPTURE_RING_INIT: the
+// shared memory object holding the samples. Both indices start at 0.
+typedef struct  __attribute__((packed)) {
+
+    int32_t size;
+    int32_t sample_size;
+    char name[OPENXT_RING_NAME_LENGTH];
+
+} OpenXTRingInitAckPacket;
+
+// QEMU has written samples up to prod (a free running byte index).
+typedef struct  __attribute__((packed)) {
+
+    uint32_t prod;
+
+} OpenXTPlaybackDoorbellPacket;
+
+// Everything up to cons has been handed to ALSA, and ALSA has room for
+// available more samples.
+typedef struct  __attribute__((packed)) {
+
+    uint32_t cons;
+    int32_t available;
+
+} OpenXTPlaybackDoorbellAckPacket;
+
 typedef struct  __attribute__((packed)) {
 
     int32_t fmt;
@@ -121,7 +223,26 @@ typedef struct  __attribute__((packed)) {
 
 } OpenXTCaptureAckPacket;
 
+// QEMU has consumed everything up to cons, and wants up to num_samples
+// more samples.
+typedef struct  __attribute__((packed)) {
+
+    uint32_t cons;
+    int32_t num_samples;
+
+} OpenXTCaptureDoorbellPacket;
+
+// Captured samples have been written up to prod.
+typedef struct  __attribute__((packed)) {
+
+    uint32_t prod;
+
+} OpenXTCaptureDoorbellAckPacket;
+
 #define PLAYBACK_PACKET_LENGTH(a) (sizeof(int32_t) + (sizeof(uint32_t) * a))
 #define CAPTURE_ACK_PACKET_LENGTH(a) (sizeof(int32_t) + (sizeof(uint32_t) * a))
+#define PLAYBACK_VECTOR_PACKET_LENGTH(a) (offsetof(OpenXTPlaybackVectorPacket, samples) + (sizeof(uint32_t) * a))
+#define PLAYBACK_INIT_ACK_PACKET_LENGTH(v) \
+    ((v) >= OPENXT_PROTOCOL_VERSION_2 ? sizeof(OpenXTPlaybackInitAckPacket) : offsetof(OpenXTPlaybackInitAckPacket, version))
 
 #endif // OPENXT_PACKETS_H
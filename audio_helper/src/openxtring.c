@@ -0,0 +1,275 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "openxtring.h"
+#include "openxtdebug.h"
+
+static size_t openxt_ring_length(uint32_t size)
+{
+    return sizeof(SampleRingHeader) + size;
+}
+
+static SampleRing *openxt_ring_map(const char *name, int fd, size_t length, bool owner)
+{
+    void *addr;
+    SampleRing *ring;
+
+    addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    openxt_assert_ret(addr != MAP_FAILED, -errno, NULL);
+
+    ring = calloc(1, sizeof(SampleRing));
+    openxt_assert_goto(ring != NULL, failed);
+
+    snprintf(ring->name, OPENXT_RING_NAME_LENGTH, "%s", name);
+    ring->owner = owner;
+    ring->header = addr;
+    ring->data = (char *)addr + sizeof(SampleRingHeader);
+    ring->length = length;
+
+    return ring;
+
+failed:
+
+    munmap(addr, length);
+    return NULL;
+}
+
+///
+/// Creates a new sample ring. The region is a POSIX shared memory object
+/// that the peer maps with openxt_ring_attach, so samples never have to go
+/// through the Argo ring.
+///
+/// @param name shared memory object name, starting with '/'
+/// @param size size of the data area in bytes, must be a power of two
+/// @param sample_size size of a sample in bytes, all indices are multiples
+/// @return NULL on failure, the new ring on success
+///
+SampleRing *openxt_ring_create(const char *name, uint32_t size, uint32_t sample_size)
+{
+    int fd;
+    SampleRing *ring;
+
+    // Sanity checks
+    openxt_checkp(name, NULL);
+    openxt_assert(strlen(name) < OPENXT_RING_NAME_LENGTH, NULL);
+    openxt_assert(size > 0 && (size & (size - 1)) == 0, NULL);
+    openxt_assert(sample_size > 0 && size % sample_size == 0, NULL);
+
+    // A stale object from a previous instance would have the wrong owner,
+    // start from scratch.
+    shm_unlink(name);
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, S_IRUSR | S_IWUSR);
+    openxt_assert_ret(fd >= 0, -errno, NULL);
+
+    if (ftruncate(fd, openxt_ring_length(size)) != 0) {
+        openxt_error("ftruncate failed: %d - %s\n", errno, strerror(errno));
+        goto failed;
+    }
+
+    ring = openxt_ring_map(name, fd, openxt_ring_length(size), true);
+    openxt_checkp_goto(ring, failed);
+
+    close(fd);
+
+    ring->size = size;
+    ring->sample_size = sample_size;
+
+    // ftruncate gives us zeroed memory, so only the header needs filling in.
+    ring->header->size = size;
+    ring->header->sample_size = sample_size;
+    ring->header->magic = OPENXT_RING_MAGIC;
+
+    return ring;
+
+failed:
+
+    close(fd);
+    shm_unlink(name);
+    return NULL;
+}
+
+///
+/// Maps a ring that was created by the peer with openxt_ring_create.
+///
+/// @param name shared memory object name
+/// @return NULL on failure, the ring on success
+///
+SampleRing *openxt_ring_attach(const char *name)
+{
+    int fd;
+    struct stat st;
+    SampleRingHeader header;
+    SampleRing *ring = NULL;
+
+    // Sanity checks
+    openxt_checkp(name, NULL);
+    openxt_assert(strlen(name) < OPENXT_RING_NAME_LENGTH, NULL);
+
+    fd = shm_open(name, O_RDWR, 0);
+    openxt_assert_ret(fd >= 0, -errno, NULL);
+
+    openxt_assert_goto(fstat(fd, &st) == 0, done);
+    openxt_assert_goto((size_t)st.st_size > sizeof(SampleRingHeader), done);
+
+    ring = openxt_ring_map(name, fd, st.st_size, false);
+    openxt_checkp_goto(ring, done);
+
+    // The header has to describe the object we actually mapped, otherwise
+    // the peer could make us index past the end of it. It is checked, and
+    // then used, from a single copy, so that the peer cannot change it in
+    // between.
+    memcpy(&header, ring->header, sizeof(header));
+
+    if (header.magic != OPENXT_RING_MAGIC ||
+        openxt_ring_length(header.size) != (size_t)st.st_size ||
+        (header.size & (header.size - 1)) != 0 ||
+        header.sample_size == 0 ||
+        header.size % header.sample_size != 0) {
+        openxt_error("%s: not a valid sample ring\n", name);
+        openxt_ring_destroy(ring);
+        ring = NULL;
+        goto done;
+    }
+
+    ring->size = header.size;
+    ring->sample_size = header.sample_size;
+
+done:
+
+    close(fd);
+    return ring;
+}
+
+///
+/// Unmaps the ring, and removes the shared memory object if we created it.
+///
+/// @param ring ring to destroy
+/// @return -EINVAL if ring is NULL
+///         0 on success
+///
+int openxt_ring_destroy(SampleRing *ring)
+{
+    // Sanity checks
+    openxt_checkp(ring, -EINVAL);
+
+    if (ring->owner == true)
+        shm_unlink(ring->name);
+
+    munmap(ring->header, ring->length);
+    free(ring);
+
+    return 0;
+}
+
+///
+/// @param ring ring to query
+/// @return bytes between the consumer and the producer
+///
+uint32_t openxt_ring_used(SampleRing *ring)
+{
+    return ring->prod - ring->cons;
+}
+
+///
+/// @param ring ring to query
+/// @return bytes the producer can still write
+///
+uint32_t openxt_ring_free(SampleRing *ring)
+{
+    return ring->size - openxt_ring_used(ring);
+}
+
+///
+/// Returns the longest contiguous run of samples that can be read at the
+/// consumer index. When the used area wraps, a second call after
+/// openxt_ring_set_cons returns the rest.
+///
+/// @param ring ring to read from
+/// @param len set to the length of the span in bytes
+/// @return start of the span
+///
+void *openxt_ring_read_span(SampleRing *ring, uint32_t *len)
+{
+    uint32_t used = openxt_ring_used(ring);
+    uint32_t offset = ring->cons & (ring->size - 1);
+
+    *len = (used < ring->size - offset) ? used : ring->size - offset;
+    return ring->data + offset;
+}
+
+///
+/// Returns the longest contiguous free area at the producer index.
+///
+/// @param ring ring to write to
+/// @param len set to the length of the span in bytes
+/// @return start of the span
+///
+void *openxt_ring_write_span(SampleRing *ring, uint32_t *len)
+{
+    uint32_t room = openxt_ring_free(ring);
+    uint32_t offset = ring->prod & (ring->size - 1);
+
+    *len = (room < ring->size - offset) ? room : ring->size - offset;
+    return ring->data + offset;
+}
+
+///
+/// Moves the producer index forward, either because we wrote samples, or
+/// because the peer told us it did. Indices come from the other domain, so
+/// they are checked against our own copies of the indices and of the ring
+/// geometry, never against the shared header.
+///
+/// @param ring ring to update
+/// @param prod new producer index
+/// @return -EINVAL if the index is not a whole sample, moves backwards, or
+///         would overrun the consumer
+///         0 on success
+///
+int openxt_ring_set_prod(SampleRing *ring, uint32_t prod)
+{
+    openxt_assert(prod % ring->sample_size == 0, -EINVAL);
+    openxt_assert(prod - ring->prod <= ring->size, -EINVAL);
+    openxt_assert(prod - ring->cons <= ring->size, -EINVAL);
+
+    ring->prod = prod;
+    return 0;
+}
+
+///
+/// Moves the consumer index forward.
+///
+/// @param ring ring to update
+/// @param cons new consumer index
+/// @return -EINVAL if the index is not a whole sample, moves backwards, or
+///         passes the producer
+///         0 on success
+///
+int openxt_ring_set_cons(SampleRing *ring, uint32_t cons)
+{
+    openxt_assert(cons % ring->sample_size == 0, -EINVAL);
+    openxt_assert(cons - ring->cons <= openxt_ring_used(ring), -EINVAL);
+
+    ring->cons = cons;
+    return 0;
+}
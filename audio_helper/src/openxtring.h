@@ -0,0 +1,76 @@
+//
+// Copyright (c) 2015 Assured Information Security, Inc
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation; either version 2 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program; if not, write to the Free Software
+// Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
+//
+
+#ifndef OPENXT_RING_H
+#define OPENXT_RING_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "openxtsettings.h"
+
+#define OPENXT_RING_MAGIC 0x58524e47 // "XRNG"
+
+///
+/// Layout of the shared region: this header, then size bytes of samples.
+/// The producer and consumer indices are free running byte counts that
+/// travel in the Argo doorbells; the region itself only carries samples.
+///
+typedef struct __attribute__((packed)) SampleRingHeader {
+
+    uint32_t magic;
+    uint32_t size;
+    uint32_t sample_size;
+    uint32_t reserved;
+
+} SampleRingHeader;
+
+typedef struct SampleRing {
+
+    char name[OPENXT_RING_NAME_LENGTH];
+    bool owner;
+
+    SampleRingHeader *header;
+    char *data;
+
+    // The geometry, copied out of the header once it was validated. The
+    // header lives in memory the peer can write to at any time, so it is
+    // never read again.
+    uint32_t size;
+    uint32_t sample_size;
+    size_t length;
+
+    // Our side's copy of both indices
+    uint32_t prod;
+    uint32_t cons;
+
+} SampleRing;
+
+SampleRing *openxt_ring_create(const char *name, uint32_t size, uint32_t sample_size);
+SampleRing *openxt_ring_attach(const char *name);
+int openxt_ring_destroy(SampleRing *ring);
+
+uint32_t openxt_ring_used(SampleRing *ring);
+uint32_t openxt_ring_free(SampleRing *ring);
+void *openxt_ring_read_span(SampleRing *ring, uint32_t *len);
+void *openxt_ring_write_span(SampleRing *ring, uint32_t *len);
+int openxt_ring_set_prod(SampleRing *ring, uint32_t prod);
+int openxt_ring_set_cons(SampleRing *ring, uint32_t cons);
+
+#endif // OPENXT_RING_H
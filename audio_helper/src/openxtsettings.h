@@ -37,4 +37,33 @@
 // The following is the Argo port that we will use for communications.
 #define OPENXT_AUDIO_PORT 5001
 
+// Number of packets in the pool that replies are built in. Packets are
+// handed out round robin, so this is how many can be in use at once.
+#define ARGO_PACKET_POOL_SIZE 4
+
+// Shared sample rings (protocol version 3). The size must be a power of two.
+#define OPENXT_RING_SIZE (64 * 1024)
+#define OPENXT_RING_NAME_LENGTH 64
+
+// Most poll descriptors a single PCM may use, and most events handled per
+// pass of the event loop.
+#define OPENXT_MAX_POLL_FDS 16
+
+// Playback pacing (see openxtpacing.c). Time constants are in seconds.
+#define OPENXT_PACING_SETTLE 2.0
+#define OPENXT_PACING_DELAY_TAU 0.5
+#define OPENXT_PACING_DRIFT_TAU 10.0
+#define OPENXT_PACING_CORRECT_TAU 5.0
+#define OPENXT_PACING_MAX_PPM 2000.0
+
+// Window in which bursts of volume changes are folded into one
+#define OPENXT_VOLUME_COALESCE_MS 20
+
+// Multi-client mode: most guests served by one helper, frames each guest
+// may have queued for the mixer (a power of two), and most frames mixed
+// per pass.
+#define OPENXT_MAX_CLIENTS 16
+#define OPENXT_MIX_CHANNEL_SIZE 4096
+#define OPENXT_MIX_PERIOD 1024
+
 #endif // OPENXT_SETTINGS
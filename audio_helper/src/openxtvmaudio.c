@@ -20,10 +20,16 @@
 // Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307  USA
 //
 
+#include <time.h>
+#include <sys/epoll.h>
+
 #include "openxtargo.h"
 #include "openxtalsa.h"
 #include "openxtdebug.h"
 #include "openxtpackets.h"
+#include "openxtmix.h"
+#include "openxtpacing.h"
+#include "openxtring.h"
 #include "openxtvmaudio.h"
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -33,8 +39,54 @@
 Settings *playback_settings = NULL;
 Settings *capture_settings = NULL;
 
-// Global Argo Packets
-ArgoPacket snd_packet;
+// Protocol version agreed on in OPENXT_PLAYBACK_INIT
+int32_t protocol_version = OPENXT_PROTOCOL_VERSION_1;
+
+// The stubdomain we are serving
+int32_t stubdomid = 0;
+
+// Shared sample rings (protocol version 3)
+SampleRing *playback_ring = NULL;
+SampleRing *capture_ring = NULL;
+
+// Keeps the playback delay from drifting
+Pacer playback_pacer;
+
+// Volume changes come in bursts while a guest slider is dragged. The first
+// one is applied right away, and opens a window of OPENXT_VOLUME_COALESCE_MS
+// in which later ones only replace each other. The last one is applied when
+// the window closes.
+bool volume_pending = false;
+int32_t pending_vol = 0;
+int32_t pending_enabled = 0;
+uint64_t volume_deadline = 0;
+
+// Event loop. Each epoll event carries what it belongs to in the upper half
+// of its data, and the index of the poll descriptor in the lower half.
+#define OPENXT_EVENT_ARGO 0
+#define OPENXT_EVENT_PLAYBACK 1
+#define OPENXT_EVENT_CAPTURE 2
+#define OPENXT_EVENT_MIXER 3
+
+typedef struct PollStream {
+
+    uint32_t tag;
+    bool watching;
+
+    struct pollfd pfds[OPENXT_MAX_POLL_FDS];
+    int32_t npfds;
+
+} PollStream;
+
+int epfd = -1;
+PollStream playback_poll = { .tag = OPENXT_EVENT_PLAYBACK };
+PollStream capture_poll = { .tag = OPENXT_EVENT_CAPTURE };
+PollStream mixer_poll = { .tag = OPENXT_EVENT_MIXER };
+bool capture_running = false;
+
+// Global Argo Packets. Replies are built in packets from the pool, which is
+// allocated once, so that nothing is cleared or staged per period.
+ArgoPacketPool pool;
 ArgoPacket rcv_packet;
 
 // GLobal Argo Connection
@@ -42,20 +94,225 @@ ArgoConnection *conn = NULL;
 
 // Global Argo Packet Playback Bodies
 OpenXTPlaybackPacket *playback_packet = NULL;
-OpenXTPlaybackInitAckPacket *playback_init_ack_packet = NULL;
+OpenXTPlaybackInitPacket *playback_init_packet = NULL;
+OpenXTPlaybackVectorPacket *playback_vector_packet = NULL;
 OpenXTPlaybackSetVolumePacket *playback_set_volume_packet = NULL;
-OpenXTPlaybackGetAvailableAckPacket *playback_get_available_ack_packet = NULL;
+OpenXTPlaybackDoorbellPacket *playback_doorbell_packet = NULL;
 
 // Global Argo Packet Capture Bodies
 OpenXTCapturePacket *capture_packet = NULL;
-OpenXTCaptureAckPacket *capture_ack_packet = NULL;
-OpenXTCaptureInitAckPacket *capture_init_ack_packet = NULL;
-OpenXTCaptureGetAvailableAckPacket *capture_get_available_ack_packet = NULL;
+OpenXTCaptureDoorbellPacket *capture_doorbell_packet = NULL;
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Event Loop Functions                                                                                //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Starts or stops watching a PCM's poll descriptors. The descriptors are
+/// removed from epoll altogether when not watched: an idle playback PCM
+/// sits in underrun, and would otherwise wake us up with POLLERR forever.
+///
+/// @param ps the stream to (un)watch
+/// @param enable true to watch the stream
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_poll_watch(PollStream *ps, bool enable)
+{
+    int i;
+    struct epoll_event ev;
+
+    if (enable == ps->watching)
+        return 0;
+
+    for (i = 0; i < ps->npfds; i++) {
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = ps->pfds[i].events;
+        ev.data.u64 = ((uint64_t)ps->tag << 32) | i;
+
+        if (epoll_ctl(epfd, enable ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, ps->pfds[i].fd, &ev) != 0) {
+            openxt_error("epoll_ctl failed: %d - %s\n", errno, strerror(errno));
+            return -errno;
+        }
+    }
+
+    ps->watching = enable;
+    return 0;
+}
+
+///
+/// Picks up the poll descriptors of a PCM that was just opened. They stay
+/// the same until the PCM is closed.
+///
+/// @param ps the stream
+/// @param settings the PCM
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_poll_open(PollStream *ps, Settings *settings)
+{
+    int ret;
+
+    openxt_poll_watch(ps, false);
+
+    if (ps->tag == OPENXT_EVENT_MIXER)
+        ret = openxt_alsa_mixer_poll_descriptors(settings, ps->pfds, OPENXT_MAX_POLL_FDS);
+    else
+        ret = openxt_alsa_poll_descriptors(settings, ps->pfds, OPENXT_MAX_POLL_FDS);
+    openxt_assert_ret(ret >= 0, ret, ret);
+
+    ps->npfds = ret;
+    return 0;
+}
+
+static void openxt_poll_close(PollStream *ps)
+{
+    openxt_poll_watch(ps, false);
+    ps->npfds = 0;
+}
+
+///
+/// @return CLOCK_MONOTONIC in nanoseconds
+///
+static uint64_t openxt_vmaudio_now(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Ring Functions                                                                                      //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Protocol version 3: (re)creates the shared sample ring for one direction
+/// and tells QEMU where to find it. From then on samples go through the ring
+/// and Argo only carries the doorbells.
+///
+/// @param ring the ring to (re)create
+/// @param settings the stream the ring feeds
+/// @param direction "playback" or "capture", used in the ring's name
+/// @param opcode opcode of the ack
+/// @return -EPROTO if version 3 was not negotiated
+///         -ENOMEM if the ring could not be created
+///         negative error code on failure
+///         0 on success
+///
+static int openxt_process_ring_init(SampleRing **ring, Settings *settings, const char *direction, int32_t opcode)
+{
+    int ret;
+    ArgoPacket *packet;
+    OpenXTRingInitAckPacket *ack;
+    char name[OPENXT_RING_NAME_LENGTH];
+
+    openxt_assert(protocol_version >= OPENXT_PROTOCOL_VERSION_3, -EPROTO);
+
+    // A new ring always starts with both indices at 0
+    if (*ring != NULL)
+        openxt_ring_destroy(*ring);
+
+    snprintf(name, OPENXT_RING_NAME_LENGTH, "/openxt-audio-%d-%s", stubdomid, direction);
+    *ring = openxt_ring_create(name, OPENXT_RING_SIZE, settings->sample_size);
+    openxt_checkp(*ring, -ENOMEM);
+
+    // Setup the ack packet
+    ack = openxt_argo_build(&pool, &packet, opcode, sizeof(OpenXTRingInitAckPacket));
+    openxt_checkp(ack, -EINVAL);
+
+    ack->size = OPENXT_RING_SIZE;
+    ack->sample_size = settings->sample_size;
+    snprintf(ack->name, OPENXT_RING_NAME_LENGTH, "%s", name);
+
+    // Send the ack.
+    ret = openxt_argo_send(conn, packet);
+    openxt_assert_ret(ret == sizeof(OpenXTRingInitAckPacket), ret, ret);
+
+    // Success
+    return 0;
+}
+
+static void openxt_vmaudio_ring_fini(SampleRing **ring)
+{
+    if (*ring != NULL)
+        openxt_ring_destroy(*ring);
+
+    *ring = NULL;
+}
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 // Playback Functions                                                                                  //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+///
+/// Writes samples to the playback PCM. The guest's emulated clock and the
+/// card's clock never quite agree, so every now and then a frame is dropped
+/// or duplicated to hold the delay where it settled (see openxtpacing.c).
+///
+/// @param buffer the samples
+/// @param num number of samples
+/// @param size size of buffer in bytes
+/// @return negative error code on failure
+///         number of samples taken from buffer on success
+///
+static int openxt_playback_write(void *buffer, int32_t num, int32_t size)
+{
+    int i;
+    int ret;
+    int32_t delay;
+    int32_t adjust;
+    int32_t sample_size = playback_settings->sample_size;
+
+    // An empty PCM means an underrun (or a fresh start), and what was
+    // learned before it no longer applies.
+    delay = openxt_alsa_get_delay(playback_settings);
+    if (delay <= 0)
+        openxt_pacing_reset(&playback_pacer, playback_settings->freq);
+
+    openxt_pacing_update(&playback_pacer, delay, openxt_vmaudio_now());
+    adjust = openxt_pacing_adjust(&playback_pacer, num);
+
+    // Dropped frames are taken off the end, and count as written.
+    if (adjust > 0) {
+        ret = openxt_alsa_writei(playback_settings, buffer, num - adjust, size);
+        openxt_pacing_applied(&playback_pacer, adjust, (ret == num - adjust) ? adjust : 0);
+        return (ret == num - adjust) ? num : ret;
+    }
+
+    ret = openxt_alsa_writei(playback_settings, buffer, num, size);
+
+    // Duplicates repeat the last frame. Those ALSA has no room for are left
+    // owed, for the next write.
+    for (i = 0; i < -adjust && ret == num; i++) {
+        if (openxt_alsa_writei(playback_settings, (char *)buffer + ((num - 1) * sample_size), 1, sample_size) != 1)
+            break;
+    }
+    openxt_pacing_applied(&playback_pacer, adjust, -i);
+
+    return ret;
+}
+
+///
+/// Checks the sample count of the single period packet in rcv_packet. It
+/// must fit in a period, and the packet must hold all the samples it
+/// claims, so that nothing stale from an earlier packet is played.
+///
+/// @return -EINVAL if the packet is malformed
+///         the number of samples on success
+///
+static int32_t openxt_playback_packet_samples(void)
+{
+    int32_t num = playback_packet->num_samples;
+    int32_t length = openxt_argo_get_length(&rcv_packet);
+
+    openxt_assert(num >= 0 && num <= MAX_PCM_BUFFER_SIZE / playback_settings->sample_size, -EINVAL);
+    openxt_assert(PLAYBACK_PACKET_LENGTH(num) <= (uint32_t)length, -EINVAL);
+
+    return num;
+}
+
 ///
 ///
 ///
@@ -68,12 +325,22 @@ OpenXTCaptureGetAvailableAckPacket *capture_get_available_ack_packet = NULL;
 static int openxt_process_playback(void)
 {
     int ret;
+    int32_t num;
+
+    num = openxt_playback_packet_samples();
+    openxt_assert_ret(num >= 0, num, num);
+
+    ret = openxt_playback_write(playback_packet->samples,
+                                num,
+                                MAX_PCM_BUFFER_SIZE);
+    openxt_assert_ret(ret >= 0, ret, ret);
 
-    ret = openxt_alsa_writei(playback_settings,
-                             playback_packet->samples,
-                             playback_packet->num_samples,
-                             MAX_PCM_BUFFER_SIZE);
-    openxt_assert_ret(ret == playback_packet->num_samples, ret, -EPIPE);
+    // Version 1 has no ack to report a short write with. What ALSA could
+    // not take, during an xrun it has not recovered from yet or a resume
+    // still in progress, is dropped like a real card would drop it, and
+    // the next period carries on.
+    if (ret < num)
+        openxt_warn("playback: dropped %d of %d samples\n", num - ret, num);
 
     return 0;
 }
@@ -90,7 +357,20 @@ static int openxt_process_playback(void)
 static int openxt_process_playback_init(void)
 {
     int ret;
+    ArgoPacket *packet;
+    OpenXTPlaybackInitAckPacket *ack;
     int valid = 1;
+    int32_t version = OPENXT_PROTOCOL_VERSION_1;
+
+    // Version 1 peers send an empty init packet. Otherwise we settle on the
+    // highest version both sides know.
+    if (openxt_argo_get_length(&rcv_packet) >= (int32_t)sizeof(OpenXTPlaybackInitPacket))
+        version = playback_init_packet->version;
+    protocol_version = min(max(version, OPENXT_PROTOCOL_VERSION_1), OPENXT_PROTOCOL_VERSION);
+
+    // With the shared ring, playback never blocks: what ALSA cannot take
+    // stays in the ring until the PCM's poll descriptors say there is room.
+    playback_settings->mode = (protocol_version >= OPENXT_PROTOCOL_VERSION_3) ? SND_PCM_NONBLOCK : 0;
 
     // Set the valid bit
     valid &= (openxt_alsa_init(playback_settings) == 0) ? 1 : 0;
@@ -99,30 +379,107 @@ static int openxt_process_playback_init(void)
     // Store the resulting valid state for later use.
     playback_settings->valid = valid;
 
+    if (valid == 1) {
+        ret = openxt_poll_open(&playback_poll, playback_settings);
+        openxt_assert_ret(ret == 0, ret, ret);
+
+        // The mixer is always watched, so that the element cache hears
+        // about changes as they happen.
+        ret = openxt_poll_open(&mixer_poll, playback_settings);
+        openxt_assert_ret(ret == 0, ret, ret);
+        ret = openxt_poll_watch(&mixer_poll, true);
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
     // Setup the ack packet
-    ret = openxt_argo_set_opcode(&snd_packet, OPENXT_PLAYBACK_INIT_ACK);
-    openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_argo_set_length(&snd_packet, sizeof(OpenXTPlaybackInitAckPacket));
-    openxt_assert_ret(ret == 0, ret, ret);
+    ack = openxt_argo_build(&pool, &packet, OPENXT_PLAYBACK_INIT_ACK, PLAYBACK_INIT_ACK_PACKET_LENGTH(protocol_version));
+    openxt_checkp(ack, -EINVAL);
 
     // Setup the ack body that will be sent back to QEMU. Specifically we need to
     // tell QEMU what frequency we are actually running at, as well as
     // if ALSA was actually configured
-    playback_init_ack_packet->fmt = playback_settings->fmt;
-    playback_init_ack_packet->freq = playback_settings->freq;
-    playback_init_ack_packet->valid = playback_settings->valid;
-    playback_init_ack_packet->nchannels = playback_settings->nchannels;
+    ack->fmt = playback_settings->fmt;
+    ack->freq = playback_settings->freq;
+    ack->valid = playback_settings->valid;
+    ack->nchannels = playback_settings->nchannels;
+    ack->version = protocol_version;
 
     // Send the ack.
-    ret = openxt_argo_send(conn, &snd_packet);
-    openxt_assert_ret(ret == sizeof(OpenXTPlaybackInitAckPacket), ret, ret);
+    ret = openxt_argo_send(conn, packet);
+    openxt_assert_ret((unsigned int)ret == PLAYBACK_INIT_ACK_PACKET_LENGTH(protocol_version), ret, ret);
 
     // Success
     return 0;
 }
 
+///
+/// Applies a volume change. The element is cached, so this costs at most
+/// one ALSA write for the volume and one for the switch, and nothing at all
+/// if neither changed.
+///
+/// @param vol the volume, in percent
+/// @param enabled the switch
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_playback_apply_volume(int32_t vol, int32_t enabled)
+{
+    int ret;
+
+    ret = openxt_alsa_mixer_sget(playback_settings);
+    openxt_assert_ret(ret == 0, ret, ret);
+    ret = openxt_alsa_mixer_sset_volume(playback_settings, vol);
+    openxt_assert_ret(ret == 0, ret, ret);
+    ret = openxt_alsa_mixer_sset_switch(playback_settings, enabled);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    return 0;
+}
+
+///
+/// Applies the last volume change of a burst, once its window has closed.
+///
+/// @param force apply it even if the window is still open
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_playback_flush_volume(bool force)
+{
+    uint64_t now = openxt_vmaudio_now();
+
+    if (volume_pending == false || (force == false && now < volume_deadline))
+        return 0;
+
+    volume_pending = false;
+    volume_deadline = now + (OPENXT_VOLUME_COALESCE_MS * 1000000ULL);
+
+    return openxt_playback_apply_volume(pending_vol, pending_enabled);
+}
+
+static int openxt_process_playback_set_volume(void)
+{
+    uint64_t now = openxt_vmaudio_now();
+
+    // Inside a window, only remember the latest change
+    if (now < volume_deadline) {
+        volume_pending = true;
+        pending_vol = playback_set_volume_packet->vol;
+        pending_enabled = playback_set_volume_packet->enabled;
+        return 0;
+    }
+
+    volume_deadline = now + (OPENXT_VOLUME_COALESCE_MS * 1000000ULL);
+
+    return openxt_playback_apply_volume(playback_set_volume_packet->vol,
+                                        playback_set_volume_packet->enabled);
+}
+
 static int openxt_process_playback_fini(void)
 {
+    openxt_playback_flush_volume(true);
+    openxt_vmaudio_ring_fini(&playback_ring);
+    openxt_poll_close(&playback_poll);
+    openxt_poll_close(&mixer_poll);
     openxt_alsa_mixer_fini(playback_settings);
     openxt_alsa_fini(playback_settings);
 
@@ -133,330 +490,872 @@ static int openxt_process_playback_fini(void)
     return 0;
 }
 
-static int openxt_process_playback_set_volume(void)
+static int openxt_process_playback_enable_voice(void)
 {
     int ret;
 
-    ret = openxt_alsa_mixer_sget(playback_settings);
-    openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_alsa_mixer_sset_volume(playback_settings, playback_set_volume_packet->vol);
-    openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_alsa_mixer_sset_switch(playback_settings, playback_set_volume_packet->enabled);
+    ret = openxt_alsa_prepare(playback_settings);
     openxt_assert_ret(ret == 0, ret, ret);
 
+    openxt_pacing_reset(&playback_pacer, playback_settings->freq);
+
     return 0;
 }
 
-static int openxt_process_playback_enable_voice(void)
+static int openxt_process_playback_disable_voice(void)
 {
     int ret;
 
-    ret = openxt_alsa_prepare(playback_settings);
+    ret = openxt_poll_watch(&playback_poll, false);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    ret = openxt_alsa_drop(playback_settings);
     openxt_assert_ret(ret == 0, ret, ret);
 
+    openxt_pacing_reset(&playback_pacer, playback_settings->freq);
+
     return 0;
 }
 
-static int openxt_process_playback_disable_voice(void)
+///
+/// Protocol version 4: tells QEMU how much audio is queued, smoothed, and
+/// how fast the guest runs compared to the card, so that it can keep the
+/// queue short instead of filling all the room there is.
+///
+/// @return -EPROTO if version 4 was not negotiated
+///         negative error code on failure
+///         0 on success
+///
+static int openxt_process_playback_get_delay(void)
 {
     int ret;
+    ArgoPacket *packet;
+    OpenXTPlaybackGetDelayAckPacket *ack;
 
-    ret = openxt_alsa_drop(playback_settings);
-    openxt_assert_ret(ret == 0, ret, ret);
+    openxt_assert(protocol_version >= OPENXT_PROTOCOL_VERSION_4, -EPROTO);
+
+    // Setup the packet.
+    ack = openxt_argo_build(&pool, &packet, OPENXT_PLAYBACK_GET_DELAY_ACK, sizeof(OpenXTPlaybackGetDelayAckPacket));
+    openxt_checkp(ack, -EINVAL);
+
+    // Fill in the packet's contents.
+    ack->available = openxt_alsa_get_available(playback_settings);
+    ack->delay = openxt_alsa_get_delay(playback_settings);
+    ack->avg_delay = openxt_pacing_delay(&playback_pacer);
+    ack->drift = openxt_pacing_drift(&playback_pacer);
+
+    // Send the packet.
+    ret = openxt_argo_send(conn, packet);
+    openxt_assert_ret(ret == sizeof(OpenXTPlaybackGetDelayAckPacket), ret, ret);
 
+    // Success
     return 0;
 }
 
 static int openxt_process_playback_get_available(void)
 {
     int ret;
+    ArgoPacket *packet;
+    OpenXTPlaybackGetAvailableAckPacket *ack;
 
     // Setup the packet.
-    ret = openxt_argo_set_opcode(&snd_packet, OPENXT_PLAYBACK_GET_AVAILABLE_ACK);
-    openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_argo_set_length(&snd_packet, sizeof(OpenXTPlaybackGetAvailableAckPacket));
-    openxt_assert_ret(ret == 0, ret, ret);
+    ack = openxt_argo_build(&pool, &packet, OPENXT_PLAYBACK_GET_AVAILABLE_ACK, sizeof(OpenXTPlaybackGetAvailableAckPacket));
+    openxt_checkp(ack, -EINVAL);
 
     // Fill in the packet's contents.
-    playback_get_available_ack_packet->available = openxt_alsa_get_available(playback_settings);
+    ack->available = openxt_alsa_get_available(playback_settings);
 
     // Send the packet.
-    ret = openxt_argo_send(conn, &snd_packet);
+    ret = openxt_argo_send(conn, packet);
     openxt_assert_ret(ret == sizeof(OpenXTPlaybackGetAvailableAckPacket), ret, ret);
 
     // Success
     return 0;
 }
 
-/////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Playback Functions                                                                                  //
-/////////////////////////////////////////////////////////////////////////////////////////////////////////
-
-static int openxt_process_capture(void)
+///
+/// Tells QEMU how many samples were queued, and how much room is left
+/// afterwards, so that it does not need a separate
+/// OPENXT_PLAYBACK_GET_AVAILABLE round trip before the next period.
+///
+/// @param written number of samples queued
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_send_playback_write_available_ack(int32_t written)
 {
     int ret;
-    int nread;
-
-    // Fill in the packet with the samples from the sound card.
-    nread = openxt_alsa_readi(capture_settings,
-                              capture_ack_packet->samples,
-                              capture_packet->num_samples,
-                              MAX_PCM_BUFFER_SIZE);
-    openxt_assert_ret(nread >= 0, nread, nread);
+    ArgoPacket *packet;
+    OpenXTPlaybackWriteAvailableAckPacket *ack;
 
     // Setup the packet.
-    ret = openxt_argo_set_opcode(&snd_packet, OPENXT_CAPTURE_ACK);
-    openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_argo_set_length(&snd_packet, CAPTURE_ACK_PACKET_LENGTH(nread));
-    openxt_assert_ret(ret == 0, ret, ret);
+    ack = openxt_argo_build(&pool, &packet, OPENXT_PLAYBACK_WRITE_AVAILABLE_ACK, sizeof(OpenXTPlaybackWriteAvailableAckPacket));
+    openxt_checkp(ack, -EINVAL);
 
-    capture_ack_packet->num_samples = nread;
+    // Fill in the packet's contents.
+    ack->written = written;
+    ack->available = openxt_alsa_get_available(playback_settings);
 
     // Send the packet.
-    ret = openxt_argo_send(conn, &snd_packet);
-    openxt_assert_ret((unsigned int)ret == CAPTURE_ACK_PACKET_LENGTH(nread), ret, ret);
+    ret = openxt_argo_send(conn, packet);
+    openxt_assert_ret(ret == sizeof(OpenXTPlaybackWriteAvailableAckPacket), ret, ret);
 
     // Success
     return 0;
 }
 
-static int openxt_process_capture_init(void)
+///
+/// Protocol version 2: write one period and report the room left. A short
+/// write is not an error here, QEMU gets told how much went through.
+///
+/// @return -EPROTO if version 2 was not negotiated
+///         negative error code on failure
+///         0 on success
+///
+static int openxt_process_playback_write_available(void)
 {
-    int ret;
-    int valid = 1;
+    int written;
+    int32_t num;
 
-    // Set the valid bit
-    valid &= (openxt_alsa_init(capture_settings) == 0) ? 1 : 0;
+    openxt_assert(protocol_version >= OPENXT_PROTOCOL_VERSION_2, -EPROTO);
 
-    // Store the resulting valid state for later use.
-    capture_settings->valid = valid;
+    num = openxt_playback_packet_samples();
+    openxt_assert_ret(num >= 0, num, num);
 
-    // Setup the ack packet
-    ret = openxt_argo_set_opcode(&snd_packet, OPENXT_CAPTURE_INIT_ACK);
-    openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_argo_set_length(&snd_packet, sizeof(OpenXTCaptureInitAckPacket));
-    openxt_assert_ret(ret == 0, ret, ret);
+    written = openxt_playback_write(playback_packet->samples,
+                                    num,
+                                    MAX_PCM_BUFFER_SIZE);
+    openxt_assert_ret(written >= 0, written, written);
 
-    // Setup the ack body that will be sent back to QEMU. Specifically we need to
-    // tell QEMU what frequency we are actually running at, as well as
-    // if ALSA was actually configured
-    capture_init_ack_packet->fmt = capture_settings->fmt;
-    capture_init_ack_packet->freq = capture_settings->freq;
-    capture_init_ack_packet->valid = capture_settings->valid;
-    capture_init_ack_packet->nchannels = capture_settings->nchannels;
+    return openxt_send_playback_write_available_ack(written);
+}
 
-    // Send the ack.
-    ret = openxt_argo_send(conn, &snd_packet);
-    openxt_assert_ret(ret == sizeof(OpenXTCaptureInitAckPacket), ret, ret);
+///
+/// Adds up the periods of the vector packet in rcv_packet. The periods are
+/// back to back, so they all go out in one write. Each count is bounded by
+/// what a period can hold, and the running total by what was actually
+/// received, so that the sum cannot overflow.
+///
+/// @return -EINVAL if the packet is malformed
+///         the total number of samples on success
+///
+static int32_t openxt_playback_vector_samples(void)
+{
+    int i;
+    int32_t num_samples = 0;
+    int32_t length = openxt_argo_get_length(&rcv_packet);
 
-    // Success
-    return 0;
+    openxt_assert(playback_vector_packet->num_periods >= 0, -EINVAL);
+    openxt_assert(playback_vector_packet->num_periods <= OPENXT_MAX_VECTOR_PERIODS, -EINVAL);
+
+    for (i = 0; i < playback_vector_packet->num_periods; i++) {
+        openxt_assert(playback_vector_packet->num_samples[i] >= 0, -EINVAL);
+        openxt_assert(playback_vector_packet->num_samples[i] <= MAX_PCM_BUFFER_SIZE / playback_settings->sample_size, -EINVAL);
+
+        num_samples += playback_vector_packet->num_samples[i];
+        openxt_assert(PLAYBACK_VECTOR_PACKET_LENGTH(num_samples) <= (uint32_t)length, -EINVAL);
+    }
+
+    return num_samples;
 }
 
-static int openxt_process_capture_fini(void)
+///
+/// Protocol version 2: write several periods at once, with a single ALSA
+/// call, and report the room left.
+///
+/// @return -EPROTO if version 2 was not negotiated
+///         -EINVAL if the packet is malformed
+///         negative error code on failure
+///         0 on success
+///
+static int openxt_process_playback_vector(void)
 {
-    openxt_alsa_fini(capture_settings);
+    int written;
+    int32_t num_samples;
 
-    // No validation code on fini. If there is an error there really isn't
-    // much you can do about it and you want as much of the code closing
-    // down safely as possible
+    openxt_assert(protocol_version >= OPENXT_PROTOCOL_VERSION_2, -EPROTO);
 
-    return 0;
+    num_samples = openxt_playback_vector_samples();
+    openxt_assert_ret(num_samples >= 0, num_samples, num_samples);
+
+    written = openxt_playback_write(playback_vector_packet->samples,
+                                    num_samples,
+                                    sizeof(playback_vector_packet->samples));
+    openxt_assert_ret(written >= 0, written, written);
+
+    return openxt_send_playback_write_available_ack(written);
 }
 
-static int openxt_process_capture_enable_voice(void)
+///
+/// Hands ALSA as much of the playback ring as it takes. The PCM is non
+/// blocking in protocol version 3, so whatever is left is written once
+/// ALSA's poll descriptors say there is room.
+///
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_playback_drain(void)
 {
     int ret;
+    int written;
+    void *span;
+    uint32_t len;
+    uint32_t sample_size = playback_settings->sample_size;
 
-    ret = openxt_alsa_prepare(capture_settings);
-    openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_alsa_start(capture_settings);
-    openxt_assert_ret(ret == 0, ret, ret);
+    // At most two spans, if the samples wrap around the end of the ring.
+    span = openxt_ring_read_span(playback_ring, &len);
+    while (len > 0) {
 
-    return 0;
+        written = openxt_playback_write(span, len / sample_size, len);
+        openxt_assert_ret(written >= 0, written, written);
+
+        ret = openxt_ring_set_cons(playback_ring, playback_ring->cons + (written * sample_size));
+        openxt_assert_ret(ret == 0, ret, ret);
+
+        if (written * sample_size < len)
+            break;
+
+        span = openxt_ring_read_span(playback_ring, &len);
+    }
+
+    return openxt_poll_watch(&playback_poll, openxt_ring_used(playback_ring) > 0);
 }
 
-static int openxt_process_capture_disable_voice(void)
+///
+/// Protocol version 3: QEMU has put samples in the playback ring. They are
+/// handed to ALSA straight from the shared memory, without going through
+/// Argo, and QEMU is told how far we got.
+///
+/// @return -EPROTO if version 3 was not negotiated
+///         -EINVAL if there is no ring, or the index is bogus
+///         negative error code on failure
+///         0 on success
+///
+static int openxt_process_playback_doorbell(void)
 {
     int ret;
+    ArgoPacket *packet;
+    OpenXTPlaybackDoorbellAckPacket *ack;
 
-    ret = openxt_alsa_drop(capture_settings);
+    openxt_assert(protocol_version >= OPENXT_PROTOCOL_VERSION_3, -EPROTO);
+    openxt_checkp(playback_ring, -EINVAL);
+
+    ret = openxt_ring_set_prod(playback_ring, playback_doorbell_packet->prod);
     openxt_assert_ret(ret == 0, ret, ret);
 
+    ret = openxt_playback_drain();
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    // Setup the packet.
+    ack = openxt_argo_build(&pool, &packet, OPENXT_PLAYBACK_DOORBELL_ACK, sizeof(OpenXTPlaybackDoorbellAckPacket));
+    openxt_checkp(ack, -EINVAL);
+
+    // Fill in the packet's contents.
+    ack->cons = playback_ring->cons;
+    ack->available = openxt_alsa_get_available(playback_settings);
+
+    // Send the packet.
+    ret = openxt_argo_send(conn, packet);
+    openxt_assert_ret(ret == sizeof(OpenXTPlaybackDoorbellAckPacket), ret, ret);
+
+    // Success
     return 0;
 }
 
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
-// Main                                                                                                //
+// Capture Functions                                                                                   //
 /////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-int openxt_vmaudio(int argc, char *argv[])
+static int openxt_process_capture(void)
 {
-    // Local variables
     int ret;
-    int32_t opcode = 0;
-    int32_t stubdomid = 0;
+    int nread;
+    ArgoPacket *packet;
+    OpenXTCaptureAckPacket *ack;
 
-    // Make sure that we have the right number of arguments.
-    if (argc != 2) {
-        openxt_info("wrong syntax: expecting %s <stubdomid>\n", argv[0]);
-        return -EINVAL;
+    // Setup the packet. The samples from the sound card are read straight
+    // into its body, and the length trimmed to what we actually got.
+    ack = openxt_argo_build(&pool, &packet, OPENXT_CAPTURE_ACK, sizeof(OpenXTCaptureAckPacket));
+    openxt_checkp(ack, -EINVAL);
+
+    nread = openxt_alsa_readi(capture_settings,
+                              ack->samples,
+                              capture_packet->num_samples,
+                              MAX_PCM_BUFFER_SIZE);
+    openxt_assert_ret(nread >= 0, nread, nread);
+
+    ret = openxt_argo_set_length(packet, CAPTURE_ACK_PACKET_LENGTH(nread));
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    ack->num_samples = nread;
+
+    // Send the packet.
+    ret = openxt_argo_send(conn, packet);
+    openxt_assert_ret((unsigned int)ret == CAPTURE_ACK_PACKET_LENGTH(nread), ret, ret);
+
+    // Success
+    return 0;
+}
+
+///
+/// Reads from ALSA straight into the capture ring, up to wanted bytes or
+/// until the ring is full. This runs as soon as ALSA has samples, so that
+/// they are already waiting when QEMU rings the doorbell.
+///
+/// @param wanted most bytes to read
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_capture_fill(uint32_t wanted)
+{
+    int ret;
+    int nread;
+    void *span;
+    uint32_t len;
+    uint32_t sample_size = capture_settings->sample_size;
+
+    // Same as playback: at most two spans, and a short read means ALSA has
+    // nothing more for now.
+    span = openxt_ring_write_span(capture_ring, &len);
+    while (wanted > 0 && len > 0) {
+
+        len = min(len, wanted);
+
+        nread = openxt_alsa_readi(capture_settings, span, len / sample_size, len);
+        openxt_assert_ret(nread >= 0, nread, nread);
+
+        ret = openxt_ring_set_prod(capture_ring, capture_ring->prod + (nread * sample_size));
+        openxt_assert_ret(ret == 0, ret, ret);
+
+        wanted -= nread * sample_size;
+        if (nread * sample_size < len)
+            break;
+
+        span = openxt_ring_write_span(capture_ring, &len);
     }
 
-    // Get the stubdomain's id
-    stubdomid = atoi(argv[1]);
+    return openxt_poll_watch(&capture_poll, capture_running && openxt_ring_free(capture_ring) > 0);
+}
 
-    // Create the settings structures.
-    ret = openxt_alsa_create(&playback_settings);
+///
+/// Protocol version 3: QEMU has consumed the capture ring up to the index
+/// it sent, and wants more samples. Most of the time they are already in
+/// the ring; if not, we read what ALSA has right now.
+///
+/// @return -EPROTO if version 3 was not negotiated
+///         -EINVAL if there is no ring, or the index is bogus
+///         negative error code on failure
+///         0 on success
+///
+static int openxt_process_capture_doorbell(void)
+{
+    int ret;
+    ArgoPacket *packet;
+    OpenXTCaptureDoorbellAckPacket *ack;
+    uint32_t wanted;
+    uint32_t sample_size = capture_settings->sample_size;
+
+    openxt_assert(protocol_version >= OPENXT_PROTOCOL_VERSION_3, -EPROTO);
+    openxt_checkp(capture_ring, -EINVAL);
+    openxt_assert(capture_doorbell_packet->num_samples >= 0, -EINVAL);
+
+    ret = openxt_ring_set_cons(capture_ring, capture_doorbell_packet->cons);
     openxt_assert_ret(ret == 0, ret, ret);
-    ret = openxt_alsa_create(&capture_settings);
+
+    wanted = capture_doorbell_packet->num_samples * sample_size;
+    if (wanted > openxt_ring_used(capture_ring) && capture_running) {
+        ret = openxt_capture_fill(wanted - openxt_ring_used(capture_ring));
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    // QEMU may just have made room in a full ring
+    ret = openxt_poll_watch(&capture_poll, capture_running && openxt_ring_free(capture_ring) > 0);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    // Setup the packet.
+    ack = openxt_argo_build(&pool, &packet, OPENXT_CAPTURE_DOORBELL_ACK, sizeof(OpenXTCaptureDoorbellAckPacket));
+    openxt_checkp(ack, -EINVAL);
+
+    ack->prod = capture_ring->prod;
+
+    // Send the packet.
+    ret = openxt_argo_send(conn, packet);
+    openxt_assert_ret(ret == sizeof(OpenXTCaptureDoorbellAckPacket), ret, ret);
+
+    // Success
+    return 0;
+}
+
+static int openxt_process_capture_init(void)
+{
+    int ret;
+    ArgoPacket *packet;
+    OpenXTCaptureInitAckPacket *ack;
+    int valid = 1;
+
+    // Set the valid bit
+    valid &= (openxt_alsa_init(capture_settings) == 0) ? 1 : 0;
+
+    // Store the resulting valid state for later use.
+    capture_settings->valid = valid;
+
+    if (valid == 1) {
+        ret = openxt_poll_open(&capture_poll, capture_settings);
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    // Setup the ack packet
+    ack = openxt_argo_build(&pool, &packet, OPENXT_CAPTURE_INIT_ACK, sizeof(OpenXTCaptureInitAckPacket));
+    openxt_checkp(ack, -EINVAL);
+
+    // Setup the ack body that will be sent back to QEMU. Specifically we need to
+    // tell QEMU what frequency we are actually running at, as well as
+    // if ALSA was actually configured
+    ack->fmt = capture_settings->fmt;
+    ack->freq = capture_settings->freq;
+    ack->valid = capture_settings->valid;
+    ack->nchannels = capture_settings->nchannels;
+
+    // Send the ack.
+    ret = openxt_argo_send(conn, packet);
+    openxt_assert_ret(ret == sizeof(OpenXTCaptureInitAckPacket), ret, ret);
+
+    // Success
+    return 0;
+}
+
+static int openxt_process_capture_fini(void)
+{
+    openxt_vmaudio_ring_fini(&capture_ring);
+    openxt_poll_close(&capture_poll);
+    capture_running = false;
+    openxt_alsa_fini(capture_settings);
+
+    // No validation code on fini. If there is an error there really isn't
+    // much you can do about it and you want as much of the code closing
+    // down safely as possible
+
+    return 0;
+}
+
+static int openxt_process_capture_enable_voice(void)
+{
+    int ret;
+
+    ret = openxt_alsa_prepare(capture_settings);
+    openxt_assert_ret(ret == 0, ret, ret);
+    ret = openxt_alsa_start(capture_settings);
     openxt_assert_ret(ret == 0, ret, ret);
 
-    // Setup the playback ALSA settings. Note that because the format is
-    // 16 bit signed little endian with 2 channels, the total sample size per
-    // channel is 32 bits.
-    playback_settings->fmt = SND_PCM_FORMAT_S16_LE;
-    playback_settings->freq = 44100;
-    playback_settings->mode = 0;
-    playback_settings->stream = SND_PCM_STREAM_PLAYBACK;
-    playback_settings->nchannels = 2;
-    playback_settings->sample_size = sizeof(uint32_t);
-    playback_settings->selement_index = 0;
-
-    // Setup the capture ALSA settings. Note that because the format is
-    // 16 bit signed little endian with 2 channels, the total sample size per
-    // channel is 32 bits.
-    capture_settings->fmt = SND_PCM_FORMAT_S16_LE;
-    capture_settings->freq = 44100;
-    capture_settings->mode = SND_PCM_NONBLOCK;
-    capture_settings->stream = SND_PCM_STREAM_CAPTURE;
-    capture_settings->nchannels = 2;
-    capture_settings->sample_size = sizeof(uint32_t);
-    capture_settings->selement_index = 0;
-
-    // Set the ALSA device names. These device names exist inside of the
-    // ALSA configuration file, so we need to make sure that they match. To
-    // see where these are being set, look at the audio_helper_start script.
-    snprintf(capture_settings->pcm_name, MAX_NAME_LENGTH, "dsnoop0");
-    snprintf(playback_settings->pcm_name, MAX_NAME_LENGTH, "plug:vm-%d", stubdomid - 1);
-    snprintf(playback_settings->selement_name, MAX_NAME_LENGTH, "vm-%d", stubdomid - 1);
+    capture_running = true;
+
+    // Samples now go into the ring as soon as ALSA has them
+    if (capture_ring != NULL) {
+        ret = openxt_poll_watch(&capture_poll, openxt_ring_free(capture_ring) > 0);
+        openxt_assert_ret(ret == 0, ret, ret);
+    }
+
+    return 0;
+}
+
+static int openxt_process_capture_disable_voice(void)
+{
+    int ret;
+
+    capture_running = false;
+
+    ret = openxt_poll_watch(&capture_poll, false);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    ret = openxt_alsa_drop(capture_settings);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    return 0;
+}
+
+///
+/// Processes one packet from QEMU.
+///
+/// @param opcode the packet's opcode
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_vmaudio_dispatch(int32_t opcode)
+{
+    int ret;
+
+    // Process the packet
+    switch(opcode) {
+
+        case OPENXT_FINI:
+            break;
+
+        case OPENXT_PLAYBACK:
+            ret = openxt_process_playback();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_INIT:
+            ret = openxt_process_playback_init();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_FINI:
+            ret = openxt_process_playback_fini();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_SET_VOLUME:
+            ret = openxt_process_playback_set_volume();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_ENABLE_VOICE:
+            ret = openxt_process_playback_enable_voice();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_DISABLE_VOICE:
+            ret = openxt_process_playback_disable_voice();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_GET_AVAILABLE:
+            ret = openxt_process_playback_get_available();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_GET_DELAY:
+            ret = openxt_process_playback_get_delay();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_WRITE_AVAILABLE:
+            ret = openxt_process_playback_write_available();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_VECTOR:
+            ret = openxt_process_playback_vector();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_RING_INIT:
+            ret = openxt_process_ring_init(&playback_ring, playback_settings, "playback", OPENXT_PLAYBACK_RING_INIT_ACK);
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_PLAYBACK_DOORBELL:
+            ret = openxt_process_playback_doorbell();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_CAPTURE:
+            ret = openxt_process_capture();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_CAPTURE_INIT:
+            ret = openxt_process_capture_init();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_CAPTURE_FINI:
+            ret = openxt_process_capture_fini();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_CAPTURE_ENABLE_VOICE:
+            ret = openxt_process_capture_enable_voice();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_CAPTURE_DISABLE_VOICE:
+            ret = openxt_process_capture_disable_voice();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_CAPTURE_RING_INIT:
+            ret = openxt_process_ring_init(&capture_ring, capture_settings, "capture", OPENXT_CAPTURE_RING_INIT_ACK);
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        case OPENXT_CAPTURE_DOORBELL:
+            ret = openxt_process_capture_doorbell();
+            openxt_assert_ret(ret == 0, ret, ret);
+            break;
+
+        default:
+            openxt_warn("unknown packet opcode: %d\n", opcode);
+            exit(-EINVAL);
+    }
+
+    return 0;
+}
+
+///
+/// Services a PCM whose poll descriptors fired: playback gets more of its
+/// ring, capture reads into its ring.
+///
+/// @param ps the stream
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_vmaudio_service(PollStream *ps)
+{
+    int i;
+    int revents;
+    bool playback = (ps == &playback_poll);
+
+    // The stream may have been closed by a packet in the same batch
+    if (ps->watching == false)
+        return 0;
+
+    revents = openxt_alsa_poll_revents(playback ? playback_settings : capture_settings, ps->pfds, ps->npfds);
+    openxt_assert_ret(revents >= 0, revents, revents);
+
+    for (i = 0; i < ps->npfds; i++)
+        ps->pfds[i].revents = 0;
+
+    if (playback == true) {
+        if (playback_ring == NULL)
+            return openxt_poll_watch(ps, false);
+        if (revents & (POLLOUT | POLLERR))
+            return openxt_playback_drain();
+    } else {
+        if (capture_ring == NULL)
+            return openxt_poll_watch(ps, false);
+        if (revents & (POLLIN | POLLERR))
+            return openxt_capture_fill(openxt_ring_free(capture_ring));
+    }
+
+    return 0;
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Main                                                                                                //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+///
+/// Sets up the playback ALSA settings. Note that because the format is 16
+/// bit signed little endian with 2 channels, the total sample size per
+/// channel is 32 bits.
+///
+static void openxt_vmaudio_playback_settings(Settings *settings, const char *pcm_name)
+{
+    settings->fmt = SND_PCM_FORMAT_S16_LE;
+    settings->freq = 44100;
+    settings->mode = 0;
+    settings->stream = SND_PCM_STREAM_PLAYBACK;
+    settings->nchannels = 2;
+    settings->sample_size = sizeof(uint32_t);
+    settings->selement_index = 0;
+
+    snprintf(settings->pcm_name, MAX_NAME_LENGTH, "%s", pcm_name);
+}
+
+///
+/// Sets up the capture ALSA settings, in the same format as playback.
+///
+static void openxt_vmaudio_capture_settings(Settings *settings, const char *pcm_name)
+{
+    settings->fmt = SND_PCM_FORMAT_S16_LE;
+    settings->freq = 44100;
+    settings->mode = SND_PCM_NONBLOCK;
+    settings->stream = SND_PCM_STREAM_CAPTURE;
+    settings->nchannels = 2;
+    settings->sample_size = sizeof(uint32_t);
+    settings->selement_index = 0;
+
+    snprintf(settings->pcm_name, MAX_NAME_LENGTH, "%s", pcm_name);
+}
+
+///
+/// Allocates the reply packets, and points the packet bodies into the
+/// receive packet.
+///
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_vmaudio_packets_init(void)
+{
+    int ret;
 
     // Cleanup memory (safety)
-    memset(&snd_packet, 0, sizeof(ArgoPacket));
     memset(&rcv_packet, 0, sizeof(ArgoPacket));
 
+    // Allocate the packets that replies are built in
+    ret = openxt_argo_pool_init(&pool, ARGO_PACKET_POOL_SIZE);
+    openxt_assert_ret(ret == 0, ret, ret);
+
     // Pointer checks
     openxt_checkp(playback_packet = openxt_argo_get_body(&rcv_packet), -EINVAL);
-    openxt_checkp(playback_init_ack_packet = openxt_argo_get_body(&snd_packet), -EINVAL);
+    openxt_checkp(playback_init_packet = openxt_argo_get_body(&rcv_packet), -EINVAL);
+    openxt_checkp(playback_vector_packet = openxt_argo_get_body(&rcv_packet), -EINVAL);
     openxt_checkp(playback_set_volume_packet = openxt_argo_get_body(&rcv_packet), -EINVAL);
-    openxt_checkp(playback_get_available_ack_packet = openxt_argo_get_body(&snd_packet), -EINVAL);
+    openxt_checkp(playback_doorbell_packet = openxt_argo_get_body(&rcv_packet), -EINVAL);
 
     // Pointer checks
     openxt_checkp(capture_packet = openxt_argo_get_body(&rcv_packet), -EINVAL);
-    openxt_checkp(capture_ack_packet = openxt_argo_get_body(&snd_packet), -EINVAL);
-    openxt_checkp(capture_init_ack_packet = openxt_argo_get_body(&snd_packet), -EINVAL);
-    openxt_checkp(capture_get_available_ack_packet = openxt_argo_get_body(&snd_packet), -EINVAL);
+    openxt_checkp(capture_doorbell_packet = openxt_argo_get_body(&rcv_packet), -EINVAL);
 
     // Size checks
     openxt_assert(openxt_argo_validate(sizeof(OpenXTPlaybackPacket)) == true, -EINVAL);
+    openxt_assert(openxt_argo_validate(sizeof(OpenXTPlaybackInitPacket)) == true, -EINVAL);
+    openxt_assert(openxt_argo_validate(sizeof(OpenXTPlaybackVectorPacket)) == true, -EINVAL);
     openxt_assert(openxt_argo_validate(sizeof(OpenXTPlaybackInitAckPacket)) == true, -EINVAL);
     openxt_assert(openxt_argo_validate(sizeof(OpenXTPlaybackSetVolumePacket)) == true, -EINVAL);
     openxt_assert(openxt_argo_validate(sizeof(OpenXTPlaybackGetAvailableAckPacket)) == true, -EINVAL);
+    openxt_assert(openxt_argo_validate(sizeof(OpenXTPlaybackWriteAvailableAckPacket)) == true, -EINVAL);
+    openxt_assert(openxt_argo_validate(sizeof(OpenXTPlaybackDoorbellPacket)) == true, -EINVAL);
+    openxt_assert(openxt_argo_validate(sizeof(OpenXTPlaybackDoorbellAckPacket)) == true, -EINVAL);
+    openxt_assert(openxt_argo_validate(sizeof(OpenXTPlaybackGetDelayAckPacket)) == true, -EINVAL);
 
     // Size checks
     openxt_assert(openxt_argo_validate(sizeof(OpenXTCapturePacket)) == true, -EINVAL);
     openxt_assert(openxt_argo_validate(sizeof(OpenXTCaptureAckPacket)) == true, -EINVAL);
     openxt_assert(openxt_argo_validate(sizeof(OpenXTCaptureInitAckPacket)) == true, -EINVAL);
     openxt_assert(openxt_argo_validate(sizeof(OpenXTCaptureGetAvailableAckPacket)) == true, -EINVAL);
+    openxt_assert(openxt_argo_validate(sizeof(OpenXTCaptureDoorbellPacket)) == true, -EINVAL);
+    openxt_assert(openxt_argo_validate(sizeof(OpenXTCaptureDoorbellAckPacket)) == true, -EINVAL);
 
-    // Setup Argo
-    conn = openxt_argo_open(OPENXT_AUDIO_PORT, XEN_ARGO_DOMID_ANY, XEN_ARGO_PORT_NONE, stubdomid);
-    openxt_assert_ret(conn != NULL, -errno, -errno);
+    // Size checks
+    openxt_assert(openxt_argo_validate(sizeof(OpenXTRingInitAckPacket)) == true, -EINVAL);
 
-    // Process incoming commands from QEMU in the stubdomain. Once we get a
-    // "fini" command from QEMU, we know that we can stop executing.
-    while (opcode != OPENXT_FINI) {
+    return 0;
+}
 
-        // Wait for a packet to come in from Argo
-        ret = openxt_argo_recv(conn, &rcv_packet);
-        openxt_assert_ret(ret >= 0, ret, ret);
+///
+/// Runs the backend until QEMU sends OPENXT_FINI.
+///
+/// @param argo the connection to QEMU, or NULL to open one to stubdomid
+/// @param playback_pcm name of the playback PCM
+/// @param capture_pcm name of the capture PCM
+/// @param selement_name name of the mixer element driven by the guest
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_vmaudio_run(ArgoConnection *argo,
+                              const char *playback_pcm,
+                              const char *capture_pcm,
+                              const char *selement_name)
+{
+    // Local variables
+    int i;
+    int ret;
+    int nevents;
+    int timeout;
+    bool mixer;
+    bool packet;
+    int32_t opcode = 0;
+    struct epoll_event ev;
+    struct epoll_event events[OPENXT_MAX_POLL_FDS];
 
-        // Process the packet
-        switch(opcode = openxt_argo_get_opcode(&rcv_packet)) {
+    // Create the settings structures.
+    ret = openxt_alsa_create(&playback_settings);
+    openxt_assert_ret(ret == 0, ret, ret);
+    ret = openxt_alsa_create(&capture_settings);
+    openxt_assert_ret(ret == 0, ret, ret);
 
-            case OPENXT_FINI:
-                break;
+    openxt_vmaudio_playback_settings(playback_settings, playback_pcm);
+    openxt_vmaudio_capture_settings(capture_settings, capture_pcm);
+    snprintf(playback_settings->selement_name, MAX_NAME_LENGTH, "%s", selement_name);
 
-            case OPENXT_PLAYBACK:
-                ret = openxt_process_playback();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+    ret = openxt_vmaudio_packets_init();
+    openxt_assert_ret(ret == 0, ret, ret);
 
-            case OPENXT_PLAYBACK_INIT:
-                ret = openxt_process_playback_init();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+    // Setup Argo
+    conn = argo;
+    if (conn == NULL)
+        conn = openxt_argo_open(OPENXT_AUDIO_PORT, XEN_ARGO_DOMID_ANY, XEN_ARGO_PORT_NONE, stubdomid);
+    openxt_assert_ret(conn != NULL, -errno, -errno);
 
-            case OPENXT_PLAYBACK_FINI:
-                ret = openxt_process_playback_fini();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+    // Setup the event loop. The PCMs join in once they are open.
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    openxt_assert_ret(epfd >= 0, -errno, -errno);
 
-            case OPENXT_PLAYBACK_SET_VOLUME:
-                ret = openxt_process_playback_set_volume();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)OPENXT_EVENT_ARGO << 32;
+    ret = epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev);
+    openxt_assert_ret(ret == 0, -errno, -errno);
 
-            case OPENXT_PLAYBACK_ENABLE_VOICE:
-                ret = openxt_process_playback_enable_voice();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+    // Process incoming commands from QEMU in the stubdomain, and service the
+    // PCMs whenever ALSA is ready for them. Once we get a "fini" command from
+    // QEMU, we know that we can stop executing.
+    while (opcode != OPENXT_FINI) {
 
-            case OPENXT_PLAYBACK_DISABLE_VOICE:
-                ret = openxt_process_playback_disable_voice();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+        // Wake up in time to close an open volume window
+        timeout = -1;
+        if (volume_pending == true) {
+            uint64_t now = openxt_vmaudio_now();
+            timeout = (now < volume_deadline) ? (int)((volume_deadline - now + 999999) / 1000000) : 0;
+        }
 
-            case OPENXT_PLAYBACK_GET_AVAILABLE:
-                ret = openxt_process_playback_get_available();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+        nevents = epoll_wait(epfd, events, OPENXT_MAX_POLL_FDS, timeout);
+        if (nevents < 0 && errno == EINTR)
+            continue;
+        if (nevents < 0)
+            ret = -errno;
+        openxt_assert_goto(nevents >= 0, done);
+
+        // ALSA can spread one PCM over several descriptors, so gather all of
+        // their events before asking ALSA what they mean.
+        packet = false;
+        mixer = false;
+        for (i = 0; i < nevents; i++) {
+
+            uint32_t tag = events[i].data.u64 >> 32;
+            uint32_t index = (uint32_t)events[i].data.u64;
+
+            if (tag == OPENXT_EVENT_ARGO)
+                packet = true;
+            if (tag == OPENXT_EVENT_MIXER)
+                mixer = true;
+            if (tag == OPENXT_EVENT_PLAYBACK && index < (uint32_t)playback_poll.npfds)
+                playback_poll.pfds[index].revents = events[i].events;
+            if (tag == OPENXT_EVENT_CAPTURE && index < (uint32_t)capture_poll.npfds)
+                capture_poll.pfds[index].revents = events[i].events;
+        }
 
-            case OPENXT_CAPTURE:
-                ret = openxt_process_capture();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+        ret = openxt_vmaudio_service(&playback_poll);
+        openxt_assert_goto(ret == 0, done);
+        ret = openxt_vmaudio_service(&capture_poll);
+        openxt_assert_goto(ret == 0, done);
 
-            case OPENXT_CAPTURE_INIT:
-                ret = openxt_process_capture_init();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+        if (mixer == true && mixer_poll.watching == true) {
+            ret = openxt_alsa_mixer_handle_events(playback_settings);
+            openxt_assert_goto(ret == 0, done);
+        }
 
-            case OPENXT_CAPTURE_FINI:
-                ret = openxt_process_capture_fini();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+        ret = openxt_playback_flush_volume(false);
+        openxt_assert_goto(ret == 0, done);
 
-            case OPENXT_CAPTURE_ENABLE_VOICE:
-                ret = openxt_process_capture_enable_voice();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+        if (packet == false)
+            continue;
 
-            case OPENXT_CAPTURE_DISABLE_VOICE:
-                ret = openxt_process_capture_disable_voice();
-                openxt_assert_ret(ret == 0, ret, ret);
-                break;
+        // Get the packet that came in from Argo
+        ret = openxt_argo_recv(conn, &rcv_packet);
+        openxt_assert_goto(ret >= 0, done);
 
-            default:
-                openxt_warn("unknown packet opcode: %d\n", opcode);
-                exit(-EINVAL);
-        }
+        ret = openxt_vmaudio_dispatch(opcode = openxt_argo_get_opcode(&rcv_packet));
+        openxt_assert_goto(ret == 0, done);
     }
 
+done:
+
+    close(epfd);
+    epfd = -1;
+
+    // Remove the shared rings
+    openxt_vmaudio_ring_fini(&playback_ring);
+    openxt_vmaudio_ring_fini(&capture_ring);
+
     // Remove the PCM
     openxt_alsa_remove_pcm(playback_settings);
 
     // Safely shutdown ALSA mixer
+    openxt_poll_close(&mixer_poll);
     openxt_alsa_mixer_fini(playback_settings);
 
     // Safely shutdown ALSA
@@ -466,7 +1365,563 @@ int openxt_vmaudio(int argc, char *argv[])
     // Cleanup
     openxt_alsa_destroy(playback_settings);
     openxt_alsa_destroy(capture_settings);
+    openxt_argo_pool_fini(&pool);
 
     // Done
+    return ret;
+}
+
+int openxt_vmaudio(int argc, char *argv[])
+{
+    char playback_pcm[MAX_NAME_LENGTH];
+    char selement_name[MAX_NAME_LENGTH];
+
+    // Make sure that we have the right number of arguments.
+    if (argc != 2) {
+        openxt_info("wrong syntax: expecting %s <stubdomid>\n", argv[0]);
+        return -EINVAL;
+    }
+
+    // Get the stubdomain's id
+    stubdomid = atoi(argv[1]);
+
+    // These device names exist inside of the ALSA configuration file, so we
+    // need to make sure that they match. To see where these are being set,
+    // look at the audio_helper_start script.
+    snprintf(playback_pcm, MAX_NAME_LENGTH, "plug:vm-%d", stubdomid - 1);
+    snprintf(selement_name, MAX_NAME_LENGTH, "vm-%d", stubdomid - 1);
+
+    return openxt_vmaudio_run(NULL, playback_pcm, "dsnoop0", selement_name);
+}
+
+///
+/// Runs the backend over an already open connection, with both streams on
+/// the same PCM. This lets the unit test drive the real event loop through
+/// a loopback connection, against any device, such as ALSA's "null".
+///
+/// @param argo the connection to QEMU (or whatever stands in for it)
+/// @param pcm_name the PCM to play to and capture from
+/// @return negative error code on failure
+///         0 on success
+///
+int openxt_vmaudio_loopback(ArgoConnection *argo, const char *pcm_name)
+{
+    openxt_checkp(argo, -EINVAL);
+    openxt_checkp(pcm_name, -EINVAL);
+
+    return openxt_vmaudio_run(argo, pcm_name, pcm_name, "Master");
+}
+
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+// Multi-Client Mode                                                                                   //
+/////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// In multi-client mode one helper serves every guest. playback_settings is
+// a single hardware PCM, opened once, that all guests are mixed into in
+// software, each with its own gain, so there is no dmix in the way. Each
+// guest has its own capture PCM; capture_settings points at the one of the
+// guest whose packet is being processed.
+//
+// Rings and delay reports are per process, so guests are held to protocol
+// version 2 here.
+typedef struct VmAudioClient {
+
+    bool active;
+    int32_t domid;
+    int32_t version;
+    bool playing;
+
+    MixChannel mix;
+    Settings *capture_settings;
+
+} VmAudioClient;
+
+VmAudioClient clients[OPENXT_MAX_CLIENTS];
+char multi_capture_pcm[MAX_NAME_LENGTH];
+
+// The stubdomains allowed to connect, from the command line
+int32_t multi_domids[OPENXT_MAX_CLIENTS];
+int32_t multi_ndomids;
+int16_t mix_buffer[OPENXT_MIX_PERIOD * 2];
+
+///
+/// Parses the comma separated list of stubdomains that may connect.
+///
+/// @param list e.g. "5,7,12"
+/// @return -EINVAL if the list is empty, malformed or too long
+///         0 on success
+///
+static int openxt_multi_parse_domids(const char *list)
+{
+    long domid;
+    char *end;
+
+    multi_ndomids = 0;
+
+    do {
+        openxt_assert(multi_ndomids < OPENXT_MAX_CLIENTS, -EINVAL);
+
+        errno = 0;
+        domid = strtol(list, &end, 10);
+        openxt_assert(errno == 0 && end != list && domid > 0 && domid < XEN_ARGO_DOMID_ANY, -EINVAL);
+        openxt_assert(*end == ',' || *end == '\0', -EINVAL);
+
+        multi_domids[multi_ndomids++] = (int32_t)domid;
+        list = end + 1;
+
+    } while (*end == ',');
+
+    return 0;
+}
+
+///
+/// @return true if domid was given on the command line
+///
+static bool openxt_multi_allowed(int32_t domid)
+{
+    int32_t i;
+
+    for (i = 0; i < multi_ndomids; i++)
+        if (multi_domids[i] == domid)
+            return true;
+
+    return false;
+}
+
+///
+/// Finds the guest a packet came from, and optionally takes a free slot
+/// for a guest that was not seen before.
+///
+/// @param domid the guest's domain
+/// @param create true to add the guest if it is new
+/// @return NULL if the guest is unknown (or there is no room for it)
+///
+static VmAudioClient *openxt_multi_client(int32_t domid, bool create)
+{
+    int i;
+    int ret;
+    VmAudioClient *client = NULL;
+
+    for (i = 0; i < OPENXT_MAX_CLIENTS; i++) {
+        if (clients[i].active == true && clients[i].domid == domid)
+            return &clients[i];
+        if (clients[i].active == false && client == NULL)
+            client = &clients[i];
+    }
+
+    if (create == false || client == NULL)
+        return NULL;
+
+    memset(client, 0, sizeof(*client));
+
+    ret = openxt_mix_channel_init(&client->mix, OPENXT_MIX_CHANNEL_SIZE, playback_settings->nchannels);
+    openxt_assert_ret(ret == 0, ret, NULL);
+
+    ret = openxt_alsa_create(&client->capture_settings);
+    if (ret != 0) {
+        openxt_mix_channel_fini(&client->mix);
+        return NULL;
+    }
+    openxt_vmaudio_capture_settings(client->capture_settings, multi_capture_pcm);
+
+    client->active = true;
+    client->domid = domid;
+    client->version = OPENXT_PROTOCOL_VERSION_1;
+
+    openxt_info("audio client added: domid %d\n", domid);
+    return client;
+}
+
+static void openxt_multi_client_remove(VmAudioClient *client)
+{
+    if (client->active == false)
+        return;
+
+    openxt_alsa_fini(client->capture_settings);
+    openxt_alsa_destroy(client->capture_settings);
+    openxt_mix_channel_fini(&client->mix);
+
+    openxt_info("audio client removed: domid %d\n", client->domid);
+    memset(client, 0, sizeof(*client));
+}
+
+///
+/// Mixes what the guests have queued into the PCM, as much as it has room
+/// for. The PCM is only watched while something is queued.
+///
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_multi_pump(void)
+{
+    int i;
+    int ret;
+    int avail;
+    int32_t count = 0;
+    uint32_t frames;
+    MixChannel *channels[OPENXT_MAX_CLIENTS];
+
+    for (i = 0; i < OPENXT_MAX_CLIENTS; i++)
+        if (clients[i].active == true && clients[i].playing == true)
+            channels[count++] = &clients[i].mix;
+
+    while (openxt_mix_pending(channels, count) > 0) {
+
+        avail = openxt_alsa_get_available(playback_settings);
+        if (avail <= 0)
+            break;
+
+        frames = openxt_mix_render(channels, count, mix_buffer, avail);
+        ret = openxt_alsa_writei(playback_settings, mix_buffer, frames, sizeof(mix_buffer));
+        openxt_assert_ret(ret >= 0, ret, ret);
+
+        if ((uint32_t)ret < frames)
+            break;
+    }
+
+    return openxt_poll_watch(&playback_poll, openxt_mix_pending(channels, count) > 0);
+}
+
+///
+/// Queues a guest's samples for the mixer, and acks with what was taken
+/// and the room left (protocol version 2).
+///
+/// @param client the guest
+/// @param samples the samples
+/// @param num number of samples
+/// @param size size of the samples buffer in bytes
+/// @param ack_opcode the ack to send, or 0 for none (protocol version 1)
+/// @return -EINVAL if num does not fit in size
+///         negative error code on failure
+///         0 on success
+///
+static int openxt_multi_playback(VmAudioClient *client, void *samples, int32_t num, uint32_t size, int32_t ack_opcode)
+{
+    int ret;
+    uint32_t written;
+    ArgoPacket *packet;
+    OpenXTPlaybackWriteAvailableAckPacket *ack;
+
+    openxt_assert(num >= 0, -EINVAL);
+    openxt_assert((uint32_t)num <= size / playback_settings->sample_size, -EINVAL);
+
+    written = openxt_mix_channel_write(&client->mix, samples, num);
+
+    ret = openxt_multi_pump();
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    if (ack_opcode == 0)
+        return 0;
+
+    ack = openxt_argo_build(&pool, &packet, ack_opcode, sizeof(OpenXTPlaybackWriteAvailableAckPacket));
+    openxt_checkp(ack, -EINVAL);
+
+    ack->written = written;
+    ack->available = openxt_mix_channel_free(&client->mix);
+
+    ret = openxt_argo_send(conn, packet);
+    openxt_assert_ret(ret == sizeof(OpenXTPlaybackWriteAvailableAckPacket), ret, ret);
+
     return 0;
 }
+
+///
+/// Queues a single period packet, which must hold all the samples it claims.
+///
+/// @return -EINVAL if the packet is malformed
+///         negative error code on failure
+///         0 on success
+///
+static int openxt_multi_playback_packet(VmAudioClient *client, int32_t ack_opcode)
+{
+    int32_t num;
+
+    num = openxt_playback_packet_samples();
+    openxt_assert_ret(num >= 0, num, num);
+
+    return openxt_multi_playback(client, playback_packet->samples, num, MAX_PCM_BUFFER_SIZE, ack_opcode);
+}
+
+static int openxt_multi_playback_init(VmAudioClient *client)
+{
+    int ret;
+    ArgoPacket *packet;
+    OpenXTPlaybackInitAckPacket *ack;
+    int32_t version = OPENXT_PROTOCOL_VERSION_1;
+
+    if (openxt_argo_get_length(&rcv_packet) >= (int32_t)sizeof(OpenXTPlaybackInitPacket))
+        version = playback_init_packet->version;
+    client->version = min(max(version, OPENXT_PROTOCOL_VERSION_1), OPENXT_PROTOCOL_VERSION_2);
+
+    client->playing = false;
+    openxt_mix_channel_reset(&client->mix);
+    openxt_mix_channel_set_gain(&client->mix, 100, 1);
+
+    ack = openxt_argo_build(&pool, &packet, OPENXT_PLAYBACK_INIT_ACK, PLAYBACK_INIT_ACK_PACKET_LENGTH(client->version));
+    openxt_checkp(ack, -EINVAL);
+
+    // The guest gets the format of the shared PCM
+    ack->fmt = playback_settings->fmt;
+    ack->freq = playback_settings->freq;
+    ack->valid = playback_settings->valid;
+    ack->nchannels = playback_settings->nchannels;
+    ack->version = client->version;
+
+    ret = openxt_argo_send(conn, packet);
+    openxt_assert_ret((unsigned int)ret == PLAYBACK_INIT_ACK_PACKET_LENGTH(client->version), ret, ret);
+
+    return 0;
+}
+
+static int openxt_multi_playback_get_available(VmAudioClient *client)
+{
+    int ret;
+    ArgoPacket *packet;
+    OpenXTPlaybackGetAvailableAckPacket *ack;
+
+    ack = openxt_argo_build(&pool, &packet, OPENXT_PLAYBACK_GET_AVAILABLE_ACK, sizeof(OpenXTPlaybackGetAvailableAckPacket));
+    openxt_checkp(ack, -EINVAL);
+
+    ack->available = openxt_mix_channel_free(&client->mix);
+
+    ret = openxt_argo_send(conn, packet);
+    openxt_assert_ret(ret == sizeof(OpenXTPlaybackGetAvailableAckPacket), ret, ret);
+
+    return 0;
+}
+
+static int openxt_multi_playback_vector(VmAudioClient *client)
+{
+    int32_t num_samples;
+
+    num_samples = openxt_playback_vector_samples();
+    openxt_assert_ret(num_samples >= 0, num_samples, num_samples);
+
+    return openxt_multi_playback(client, playback_vector_packet->samples, num_samples,
+                                 sizeof(playback_vector_packet->samples), OPENXT_PLAYBACK_WRITE_AVAILABLE_ACK);
+}
+
+///
+/// Processes one packet from a guest. Capture goes through the same code
+/// as in single-client mode, on the guest's own PCM.
+///
+/// @param client the guest the packet came from
+/// @param opcode the packet's opcode
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_multi_dispatch(VmAudioClient *client, int32_t opcode)
+{
+    capture_settings = client->capture_settings;
+    protocol_version = client->version;
+
+    switch(opcode) {
+
+        case OPENXT_FINI:
+            openxt_multi_client_remove(client);
+            return openxt_multi_pump();
+
+        case OPENXT_PLAYBACK:
+            return openxt_multi_playback_packet(client, 0);
+
+        case OPENXT_PLAYBACK_INIT:
+            return openxt_multi_playback_init(client);
+
+        case OPENXT_PLAYBACK_FINI:
+        case OPENXT_PLAYBACK_DISABLE_VOICE:
+            client->playing = false;
+            openxt_mix_channel_reset(&client->mix);
+            return openxt_multi_pump();
+
+        case OPENXT_PLAYBACK_ENABLE_VOICE:
+            client->playing = true;
+            openxt_mix_channel_reset(&client->mix);
+            return 0;
+
+        case OPENXT_PLAYBACK_SET_VOLUME:
+            openxt_mix_channel_set_gain(&client->mix, playback_set_volume_packet->vol, playback_set_volume_packet->enabled);
+            return 0;
+
+        case OPENXT_PLAYBACK_GET_AVAILABLE:
+            return openxt_multi_playback_get_available(client);
+
+        case OPENXT_PLAYBACK_WRITE_AVAILABLE:
+            openxt_assert(client->version >= OPENXT_PROTOCOL_VERSION_2, -EPROTO);
+            return openxt_multi_playback_packet(client, OPENXT_PLAYBACK_WRITE_AVAILABLE_ACK);
+
+        case OPENXT_PLAYBACK_VECTOR:
+            openxt_assert(client->version >= OPENXT_PROTOCOL_VERSION_2, -EPROTO);
+            return openxt_multi_playback_vector(client);
+
+        case OPENXT_CAPTURE:
+            return openxt_process_capture();
+
+        case OPENXT_CAPTURE_INIT:
+            return openxt_process_capture_init();
+
+        case OPENXT_CAPTURE_FINI:
+            return openxt_process_capture_fini();
+
+        case OPENXT_CAPTURE_ENABLE_VOICE:
+            return openxt_process_capture_enable_voice();
+
+        case OPENXT_CAPTURE_DISABLE_VOICE:
+            return openxt_process_capture_disable_voice();
+
+        default:
+            openxt_warn("unknown packet opcode from domid %d: %d\n", client->domid, opcode);
+            return -EPROTO;
+    }
+}
+
+///
+/// (Re)opens the Argo connection that every guest talks to. Argo closes it
+/// when a send fails, which happens when a guest goes away without saying
+/// goodbye; the other guests should not notice.
+///
+/// @return negative error code on failure
+///         0 on success
+///
+static int openxt_multi_argo_open(void)
+{
+    struct epoll_event ev;
+
+    if (conn != NULL)
+        openxt_argo_close(conn);
+
+    conn = openxt_argo_open(OPENXT_AUDIO_PORT, XEN_ARGO_DOMID_ANY, XEN_ARGO_PORT_NONE, XEN_ARGO_DOMID_ANY);
+    openxt_assert_ret(conn != NULL, -errno, -errno);
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u64 = (uint64_t)OPENXT_EVENT_ARGO << 32;
+    openxt_assert_ret(epoll_ctl(epfd, EPOLL_CTL_ADD, conn->fd, &ev) == 0, -errno, -errno);
+
+    return 0;
+}
+
+///
+/// Serves every guest from this process, until it is killed.
+///
+/// audio_helper multi <stubdomid>[,<stubdomid>...] [playback pcm] [capture pcm]
+///
+/// Only the listed stubdomains are served; packets from any other domain
+/// are dropped before a client slot is taken for it.
+///
+int openxt_vmaudio_multi(int argc, char *argv[])
+{
+    int i;
+    int ret;
+    int revents;
+    int nevents;
+    bool packet;
+    int32_t domid;
+    int32_t rejected = -1;
+    VmAudioClient *client;
+    struct epoll_event events[OPENXT_MAX_POLL_FDS];
+
+    if (argc < 2 || openxt_multi_parse_domids(argv[1]) != 0) {
+        openxt_info("wrong syntax: expecting %s <stubdomid>[,<stubdomid>...] [pcm] [capture]\n", argv[0]);
+        return -EINVAL;
+    }
+
+    ret = openxt_alsa_create(&playback_settings);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    // The mixer never blocks: it writes what the PCM has room for, and the
+    // PCM's poll descriptors say when there is more.
+    openxt_vmaudio_playback_settings(playback_settings, (argc > 2) ? argv[2] : "plughw:0");
+    playback_settings->mode = SND_PCM_NONBLOCK;
+    snprintf(multi_capture_pcm, MAX_NAME_LENGTH, "%s", (argc > 3) ? argv[3] : "dsnoop0");
+
+    ret = openxt_vmaudio_packets_init();
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    ret = openxt_alsa_init(playback_settings);
+    openxt_assert_ret(ret == 0, ret, ret);
+    ret = openxt_alsa_prepare(playback_settings);
+    openxt_assert_ret(ret == 0, ret, ret);
+    playback_settings->valid = 1;
+
+    epfd = epoll_create1(EPOLL_CLOEXEC);
+    openxt_assert_ret(epfd >= 0, -errno, -errno);
+
+    ret = openxt_poll_open(&playback_poll, playback_settings);
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    ret = openxt_multi_argo_open();
+    openxt_assert_ret(ret == 0, ret, ret);
+
+    while (1) {
+
+        nevents = epoll_wait(epfd, events, OPENXT_MAX_POLL_FDS, -1);
+        if (nevents < 0 && errno == EINTR)
+            continue;
+        openxt_assert_ret(nevents >= 0, -errno, -errno);
+
+        packet = false;
+        for (i = 0; i < nevents; i++) {
+
+            uint32_t tag = events[i].data.u64 >> 32;
+            uint32_t index = (uint32_t)events[i].data.u64;
+
+            if (tag == OPENXT_EVENT_ARGO)
+                packet = true;
+            if (tag == OPENXT_EVENT_PLAYBACK && index < (uint32_t)playback_poll.npfds)
+                playback_poll.pfds[index].revents = events[i].events;
+        }
+
+        if (playback_poll.watching == true) {
+
+            revents = openxt_alsa_poll_revents(playback_settings, playback_poll.pfds, playback_poll.npfds);
+            openxt_assert_ret(revents >= 0, revents, revents);
+
+            for (i = 0; i < playback_poll.npfds; i++)
+                playback_poll.pfds[i].revents = 0;
+
+            if (revents & (POLLOUT | POLLERR)) {
+                ret = openxt_multi_pump();
+                openxt_assert_ret(ret == 0, ret, ret);
+            }
+        }
+
+        if (packet == false)
+            continue;
+
+        ret = openxt_argo_recv(conn, &rcv_packet);
+        if (ret < 0) {
+            ret = openxt_multi_argo_open();
+            openxt_assert_ret(ret == 0, ret, ret);
+            continue;
+        }
+
+        // Strangers get nothing, not even a slot. Only warn once in a row
+        // per domain, so a chatty one cannot flood the log.
+        domid = conn->remote_addr.domain_id;
+        if (openxt_multi_allowed(domid) == false) {
+            if (domid != rejected)
+                openxt_warn("dropping audio packets from unlisted domid %d\n", domid);
+            rejected = domid;
+            continue;
+        }
+
+        // A guest that cannot be served is dropped; the others carry on.
+        client = openxt_multi_client(domid, true);
+        if (client == NULL) {
+            openxt_warn("no room for audio client domid %d\n", domid);
+            continue;
+        }
+
+        ret = openxt_multi_dispatch(client, openxt_argo_get_opcode(&rcv_packet));
+        if (ret != 0)
+            openxt_multi_client_remove(client);
+
+        if (openxt_argo_isconnected(conn) == false) {
+            ret = openxt_multi_argo_open();
+            openxt_assert_ret(ret == 0, ret, ret);
+        }
+    }
+
+    return 0;
+}
+
@@ -23,6 +23,10 @@
 #ifndef OPENXT_VMAUDIO_H
 #define OPENXT_VMAUDIO_H
 
+#include "openxtargo.h"
+
 int openxt_vmaudio(int argc, char *argv[]);
+int openxt_vmaudio_loopback(ArgoConnection *argo, const char *pcm_name);
+int openxt_vmaudio_multi(int argc, char *argv[]);
 
 #endif // OPENXT_VMAUDIO_H
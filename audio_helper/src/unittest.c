@@ -25,6 +25,15 @@
 #include "openxtargo.h"
 #include "openxtalsa.h"
 #include "openxtdebug.h"
+#include "openxtmix.h"
+#include "openxtpackets.h"
+#include "openxtpacing.h"
+#include "openxtring.h"
+#include "openxtvmaudio.h"
+
+#include <time.h>
+#include <signal.h>
+#include <sys/wait.h>
 
 ////////////////////////////////////////////////////////////////////////////////
 // Global Variables                                                           //
@@ -167,7 +176,292 @@ void test_argo(void)
         // Validate the result
         UT_CHECK(rcv_packet_body->data1 == 1);
         UT_CHECK(rcv_packet_body->data2 == 2);
+
+        // The loopback pair behaves the same, without Argo
+        {
+            ArgoConnection *end1 = NULL;
+            ArgoConnection *end2 = NULL;
+
+            UT_CHECK(openxt_argo_open_loopback(NULL, &end2) == -EINVAL);
+            UT_CHECK(openxt_argo_open_loopback(&end1, &end2) == 0);
+            UT_CHECK(openxt_argo_isconnected(end1) == true);
+            UT_CHECK(openxt_argo_isconnected(end2) == true);
+
+            snd_packet_body->data1 = 5;
+            UT_CHECK(openxt_argo_set_opcode(&snd_packet, 7) == 0);
+            UT_CHECK(openxt_argo_send(end1, &snd_packet) == sizeof(TestPacket));
+            UT_CHECK(openxt_argo_recv(end2, &rcv_packet) == sizeof(TestPacket));
+            UT_CHECK(openxt_argo_get_opcode(&rcv_packet) == 7);
+            UT_CHECK(rcv_packet_body->data1 == 5);
+
+            UT_CHECK(openxt_argo_close(end1) == 0);
+            UT_CHECK(openxt_argo_close(end2) == 0);
+        }
+    }
+}
+
+void test_packets(void)
+{
+    ArgoPacketPool pool;
+    ArgoPacket *first = NULL;
+    ArgoPacket *packet = NULL;
+    TestPacket *body = NULL;
+    OpenXTPlaybackVectorPacket vector;
+
+    // Make sure that we hit the correct errors
+    UT_CHECK(openxt_argo_pool_init(NULL, 1) == -EINVAL);
+    UT_CHECK(openxt_argo_pool_init(&pool, 0) == -EINVAL);
+    UT_CHECK(openxt_argo_pool_fini(NULL) == -EINVAL);
+
+    // Builders fill in the header, and hand out the packets in turn
+    UT_CHECK(openxt_argo_pool_init(&pool, 2) == 0);
+    UT_CHECK(openxt_argo_build(&pool, &packet, 7, ARGO_MAX_PACKET_BODY_SIZE + 1) == NULL);
+    UT_CHECK((body = openxt_argo_build(&pool, &first, 7, sizeof(TestPacket))) != NULL);
+    UT_CHECK(body == openxt_argo_get_body(first));
+    UT_CHECK(openxt_argo_get_opcode(first) == 7);
+    UT_CHECK(openxt_argo_get_length(first) == sizeof(TestPacket));
+    UT_CHECK(openxt_argo_build(&pool, &packet, 8, 0) != NULL && packet != first);
+    UT_CHECK(openxt_argo_build(&pool, &packet, 9, 0) != NULL && packet == first);
+    UT_CHECK(openxt_argo_pool_fini(&pool) == 0);
+
+    // Every packet has to fit in a Argo packet body
+    UT_CHECK(openxt_argo_validate(sizeof(OpenXTPlaybackInitPacket)) == true);
+    UT_CHECK(openxt_argo_validate(sizeof(OpenXTPlaybackVectorPacket)) == true);
+    UT_CHECK(openxt_argo_validate(sizeof(OpenXTPlaybackWriteAvailableAckPacket)) == true);
+
+    // Version 1 peers must get the init ack they always got
+    UT_CHECK(PLAYBACK_INIT_ACK_PACKET_LENGTH(OPENXT_PROTOCOL_VERSION_1) == sizeof(int32_t) * 4);
+    UT_CHECK(PLAYBACK_INIT_ACK_PACKET_LENGTH(OPENXT_PROTOCOL_VERSION_2) == sizeof(OpenXTPlaybackInitAckPacket));
+
+    // A full vector packet is exactly a full Argo packet body, and holds
+    // whole samples only
+    UT_CHECK(PLAYBACK_VECTOR_PACKET_LENGTH(sizeof(vector.samples) / sizeof(uint32_t)) == ARGO_MAX_PACKET_BODY_SIZE);
+    UT_CHECK(sizeof(vector.samples) % sizeof(uint32_t) == 0);
+    UT_CHECK(sizeof(vector.samples) >= 2 * MAX_PCM_BUFFER_SIZE - 64);
+
+    // Version 3 packets carry indices only
+    UT_CHECK(openxt_argo_validate(sizeof(OpenXTRingInitAckPacket)) == true);
+    UT_CHECK(sizeof(OpenXTPlaybackDoorbellPacket) == sizeof(uint32_t));
+    UT_CHECK(sizeof(OpenXTCaptureDoorbellPacket) == sizeof(uint32_t) * 2);
+}
+
+void test_ring(void)
+{
+    uint32_t i;
+    uint32_t len;
+    uint32_t *span;
+    SampleRing *producer = NULL;
+    SampleRing *consumer = NULL;
+    const char *name = "/openxt-audio-unittest";
+
+    // Invalid arguments
+    UT_CHECK(openxt_ring_create(NULL, 64, 4) == NULL);
+    UT_CHECK(openxt_ring_create(name, 48, 4) == NULL);
+    UT_CHECK(openxt_ring_create(name, 64, 3) == NULL);
+    UT_CHECK(openxt_ring_destroy(NULL) == -EINVAL);
+
+    // Both sides map the same samples
+    UT_CHECK((producer = openxt_ring_create(name, 64, sizeof(uint32_t))) != NULL);
+    UT_CHECK((consumer = openxt_ring_attach(name)) != NULL);
+    if (producer == NULL || consumer == NULL)
+        goto done;
+
+    UT_CHECK(openxt_ring_used(producer) == 0);
+    UT_CHECK(openxt_ring_free(producer) == 64);
+
+    // Move both sides to near the end, so the next write wraps
+    UT_CHECK(openxt_ring_set_prod(producer, 56) == 0);
+    UT_CHECK(openxt_ring_set_cons(producer, 56) == 0);
+    UT_CHECK(openxt_ring_set_prod(consumer, 56) == 0);
+    UT_CHECK(openxt_ring_set_cons(consumer, 56) == 0);
+
+    // Write 6 samples, which takes two spans
+    span = openxt_ring_write_span(producer, &len);
+    UT_CHECK(len == 8);
+    span[0] = 0; span[1] = 1;
+    UT_CHECK(openxt_ring_set_prod(producer, 64) == 0);
+    span = openxt_ring_write_span(producer, &len);
+    UT_CHECK(len == 56);
+    for (i = 0; i < 4; i++) span[i] = i + 2;
+    UT_CHECK(openxt_ring_set_prod(producer, 80) == 0);
+
+    // The doorbell carries the index to the consumer, who reads them back
+    UT_CHECK(openxt_ring_set_prod(consumer, producer->prod) == 0);
+    UT_CHECK(openxt_ring_used(consumer) == 24);
+    span = openxt_ring_read_span(consumer, &len);
+    UT_CHECK(len == 8 && span[0] == 0 && span[1] == 1);
+    UT_CHECK(openxt_ring_set_cons(consumer, 64) == 0);
+    span = openxt_ring_read_span(consumer, &len);
+    UT_CHECK(len == 16 && span[0] == 2 && span[3] == 5);
+    UT_CHECK(openxt_ring_set_cons(consumer, 80) == 0);
+    UT_CHECK(openxt_ring_used(consumer) == 0);
+
+    // Bogus indices from the peer are refused
+    UT_CHECK(openxt_ring_set_prod(consumer, 82) == -EINVAL);
+    UT_CHECK(openxt_ring_set_prod(consumer, 80 + 68) == -EINVAL);
+    UT_CHECK(openxt_ring_set_prod(consumer, 76) == -EINVAL);
+    UT_CHECK(openxt_ring_set_cons(consumer, 84) == -EINVAL);
+
+    // Rewriting the shared header after the attach changes nothing
+    producer->header->size = 1 << 30;
+    producer->header->sample_size = 1;
+    UT_CHECK(openxt_ring_free(consumer) == 64);
+    UT_CHECK(openxt_ring_set_prod(consumer, 80 + 68) == -EINVAL);
+    UT_CHECK(openxt_ring_set_prod(consumer, 82) == -EINVAL);
+
+done:
+
+    if (consumer != NULL)
+        UT_CHECK(openxt_ring_destroy(consumer) == 0);
+    if (producer != NULL)
+        UT_CHECK(openxt_ring_destroy(producer) == 0);
+
+    // The owner removes the object
+    UT_CHECK(openxt_ring_attach(name) == NULL);
+}
+
+void test_pacing(void)
+{
+    int32_t i;
+    int32_t adjust;
+    int32_t dropped = 0;
+    int64_t corrected;
+    double owed;
+    Pacer pacer;
+    double now = 0;
+    double queued = 4096;
+    double period = 1024.0 / 44100.0 / (1 + 500e-6);
+
+    // Nothing happens until the delay has settled
+    openxt_pacing_reset(&pacer, 44100);
+    openxt_pacing_update(&pacer, 4096, 0);
+    UT_CHECK(openxt_pacing_adjust(&pacer, 1024) == 0);
+
+    // A guest that runs 500 ppm fast, writing 1024 frames at a time, for
+    // two minutes. The card's delay is only known to 256 frames.
+    openxt_pacing_reset(&pacer, 44100);
+    for (i = 0; i < (int32_t)(120 / period); i++) {
+
+        now += period;
+        queued -= period * 44100;
+
+        openxt_pacing_update(&pacer, ((int32_t)queued) & ~255, (uint64_t)(now * 1e9));
+        adjust = openxt_pacing_adjust(&pacer, 1024);
+        openxt_pacing_applied(&pacer, adjust, adjust);
+
+        dropped += adjust;
+        queued += 1024 - adjust;
     }
+
+    // The drift is found, and the delay does not run away
+    UT_CHECK(openxt_pacing_drift(&pacer) > 450 && openxt_pacing_drift(&pacer) < 550);
+    UT_CHECK(dropped > 2000 && dropped < 3000);
+    UT_CHECK(queued < 4096 + 1024);
+
+    // A correction the card had no room for is not counted, and is owed
+    // again
+    corrected = pacer.corrected;
+    owed = pacer.owed;
+    openxt_pacing_applied(&pacer, -3, -1);
+    UT_CHECK(pacer.corrected == corrected - 1);
+    UT_CHECK(pacer.owed == owed - 2);
+}
+
+void test_mix(void)
+{
+    int i;
+    int16_t in[8 * 2];
+    int16_t out[8 * 2];
+    MixChannel a;
+    MixChannel b;
+    MixChannel *both[2] = { &a, &b };
+
+    // Sizes must be powers of two
+    UT_CHECK(openxt_mix_channel_init(NULL, 8, 2) == -EINVAL);
+    UT_CHECK(openxt_mix_channel_init(&a, 6, 2) == -EINVAL);
+    UT_CHECK(openxt_mix_channel_init(&a, 8, 2) == 0);
+    UT_CHECK(openxt_mix_channel_init(&b, 8, 2) == 0);
+
+    UT_CHECK(openxt_mix_channel_used(&a) == 0);
+    UT_CHECK(openxt_mix_channel_free(&a) == 8);
+    UT_CHECK(openxt_mix_pending(both, 2) == 0);
+    UT_CHECK(openxt_mix_render(both, 2, out, 8) == 0);
+
+    for (i = 0; i < 8 * 2; i++)
+        in[i] = 1000 + i;
+
+    // Only what fits is taken
+    UT_CHECK(openxt_mix_channel_write(&a, in, 6) == 6);
+    UT_CHECK(openxt_mix_channel_write(&a, in, 6) == 2);
+    UT_CHECK(openxt_mix_channel_free(&a) == 0);
+
+    // A single channel at unity gain comes out as it went in
+    UT_CHECK(openxt_mix_render(both, 1, out, 4) == 4);
+    UT_CHECK(out[0] == 1000 && out[7] == 1007);
+    UT_CHECK(openxt_mix_channel_used(&a) == 4);
+
+    // Writing across the end of the channel
+    UT_CHECK(openxt_mix_channel_write(&a, in, 4) == 4);
+    UT_CHECK(openxt_mix_render(both, 1, out, 8) == 8);
+    UT_CHECK(out[0] == 1008 && out[3] == 1011);
+    UT_CHECK(out[4] == 1000 && out[5] == 1001);
+    UT_CHECK(out[8] == 1000 && out[15] == 1007);
+
+    // Two channels add up, each with its own gain, as far as the shorter
+    // one goes
+    openxt_mix_channel_set_gain(&a, 50, 1);
+    openxt_mix_channel_set_gain(&b, 100, 1);
+    UT_CHECK(openxt_mix_channel_write(&a, in, 2) == 2);
+    UT_CHECK(openxt_mix_channel_write(&b, in, 1) == 1);
+    UT_CHECK(openxt_mix_pending(both, 2) == 1);
+    UT_CHECK(openxt_mix_render(both, 2, out, 8) == 1);
+    UT_CHECK(out[0] == 500 + 1000);
+
+    // The emptied channel holds the other back until it catches up
+    UT_CHECK(openxt_mix_pending(both, 2) == 0);
+    UT_CHECK(openxt_mix_render(both, 2, out, 8) == 0);
+    UT_CHECK(openxt_mix_channel_write(&b, in, 1) == 1);
+    UT_CHECK(openxt_mix_render(both, 2, out, 8) == 1);
+    UT_CHECK(out[0] == 501 + 1000);
+
+    // Muted channels are silent, and the sum is clipped
+    openxt_mix_channel_set_gain(&a, 100, 0);
+    UT_CHECK(openxt_mix_channel_write(&a, in, 1) == 1);
+    UT_CHECK(openxt_mix_channel_write(&b, in, 1) == 1);
+    UT_CHECK(openxt_mix_render(both, 2, out, 8) == 1);
+    UT_CHECK(out[0] == 1000);
+
+    openxt_mix_channel_set_gain(&a, 100, 1);
+    in[0] = 30000;
+    UT_CHECK(openxt_mix_channel_write(&a, in, 1) == 1);
+    UT_CHECK(openxt_mix_channel_write(&b, in, 1) == 1);
+    UT_CHECK(openxt_mix_render(both, 2, out, 8) == 1);
+    UT_CHECK(out[0] == INT16_MAX);
+
+    UT_CHECK(openxt_mix_channel_fini(&a) == 0);
+    UT_CHECK(openxt_mix_channel_fini(&b) == 0);
+
+    // A channel that stays empty while the other queues a whole period has
+    // underrun, and is padded with silence
+    UT_CHECK(openxt_mix_channel_init(&a, OPENXT_MIX_PERIOD * 2, 2) == 0);
+    UT_CHECK(openxt_mix_channel_init(&b, OPENXT_MIX_PERIOD * 2, 2) == 0);
+
+    for (i = 0; i < OPENXT_MIX_PERIOD - 8; i += 8)
+        UT_CHECK(openxt_mix_channel_write(&a, in, 8) == 8);
+
+    UT_CHECK(openxt_mix_channel_write(&a, in, 7) == 7);
+    UT_CHECK(openxt_mix_pending(both, 2) == 0);
+    UT_CHECK(openxt_mix_channel_write(&a, in, 1) == 1);
+    UT_CHECK(openxt_mix_pending(both, 2) == OPENXT_MIX_PERIOD);
+    UT_CHECK(openxt_mix_render(both, 2, out, 8) == 8);
+    UT_CHECK(out[0] == 30000 && out[2] == 1002);
+
+    // Once it has something queued again, it is mixed again
+    UT_CHECK(openxt_mix_channel_write(&b, in, 2) == 2);
+    UT_CHECK(openxt_mix_pending(both, 2) == 2);
+
+    UT_CHECK(openxt_mix_channel_fini(&a) == 0);
+    UT_CHECK(openxt_mix_channel_fini(&b) == 0);
 }
 
 void test_alsa(void)
@@ -485,6 +779,25 @@ void test_alsa(void)
     ret = openxt_alsa_mixer_sset_switch(playback_settings, 1);
     UT_CHECK(ret == 0);
 
+    // The element is cached, and looking it up again finds the same one
+    {
+        snd_mixer_elem_t *elem = playback_settings->elem;
+
+        ret = openxt_alsa_mixer_sget(playback_settings);
+        UT_CHECK(ret == 0);
+        UT_CHECK(playback_settings->elem == elem);
+        UT_CHECK(playback_settings->elem_cached == true);
+    }
+
+    // Setting what is already set is free, and remembered
+    ret = openxt_alsa_mixer_sset_volume(playback_settings, 100);
+    UT_CHECK(ret == 0);
+    UT_CHECK(playback_settings->volume_type == 0 || playback_settings->last_vol == 100);
+
+    // Pending mixer events are delivered without error
+    ret = openxt_alsa_mixer_handle_events(playback_settings);
+    UT_CHECK(ret == 0);
+
     // Validate improper use of the mixer API
     ret = openxt_alsa_percentage(playback_settings, 10);
     UT_CHECK(ret >= 0);
@@ -496,6 +809,7 @@ void test_alsa(void)
     // Close the mixer
     ret = openxt_alsa_mixer_fini(playback_settings);
     UT_CHECK(ret == 0);
+    UT_CHECK(playback_settings->elem_cached == false);
 
     // Done with ALSA
     ret = openxt_alsa_fini(playback_settings);
@@ -645,6 +959,291 @@ void test_playback(void)
     }
 }
 
+///
+/// Plays with protocol version 1, stops feeding the helper for long enough
+/// that the PCM runs dry, and then plays again. Version 1 has no ack to
+/// report a short write with, so the helper has to drop what ALSA could not
+/// take and keep answering, rather than give up on the guest.
+///
+/// ALSA_DEVICE="hw:1" ./audio_helper unittest test_xrun
+///
+void test_xrun(void)
+{
+    int i;
+    int n;
+    int ret;
+    int status;
+    pid_t pid;
+    const char *device = getenv("ALSA_DEVICE");
+    ArgoConnection *guest = NULL;
+    ArgoConnection *helper = NULL;
+    ArgoPacket snd_packet;
+    ArgoPacket rcv_packet;
+    OpenXTPlaybackPacket *period;
+
+    memset(&snd_packet, 0, sizeof(snd_packet));
+    memset(&rcv_packet, 0, sizeof(rcv_packet));
+
+    if (device == NULL)
+        device = "null";
+
+    ret = openxt_argo_open_loopback(&guest, &helper);
+    UT_CHECK(ret == 0);
+    if (ret != 0)
+        return;
+
+    pid = fork();
+    if (pid == 0) {
+        openxt_argo_close(guest);
+        _exit(openxt_vmaudio_loopback(helper, device) == 0 ? 0 : 1);
+    }
+    openxt_argo_close(helper);
+    UT_CHECK(pid > 0);
+    if (pid < 0)
+        goto done;
+
+    // Open playback without a version, which is how a version 1 guest
+    // asks for it.
+    openxt_argo_set_opcode(&snd_packet, OPENXT_PLAYBACK_INIT);
+    openxt_argo_set_length(&snd_packet, 0);
+    UT_CHECK(openxt_argo_send(guest, &snd_packet) == 0);
+    UT_CHECK(openxt_argo_recv(guest, &rcv_packet) >= 0);
+    UT_CHECK(openxt_argo_get_opcode(&rcv_packet) == OPENXT_PLAYBACK_INIT_ACK);
+
+    openxt_argo_set_opcode(&snd_packet, OPENXT_PLAYBACK_ENABLE_VOICE);
+    openxt_argo_set_length(&snd_packet, 0);
+    UT_CHECK(openxt_argo_send(guest, &snd_packet) == 0);
+
+    period = openxt_argo_get_body(&snd_packet);
+    memset(period->samples, 0, sizeof(period->samples));
+    period->num_samples = 1024;
+
+    for (i = 0; i < 3; i++) {
+
+        // Fill the buffer, then starve it for far longer than it holds, so
+        // that the next period lands on an xrun.
+        for (n = 0; n < 8; n++) {
+            openxt_argo_set_opcode(&snd_packet, OPENXT_PLAYBACK);
+            openxt_argo_set_length(&snd_packet, PLAYBACK_PACKET_LENGTH(1024));
+            UT_CHECK(openxt_argo_send(guest, &snd_packet) == 0);
+        }
+
+        usleep(500000);
+
+        // The helper must still be there to answer.
+        openxt_argo_set_opcode(&snd_packet, OPENXT_PLAYBACK_GET_AVAILABLE);
+        openxt_argo_set_length(&snd_packet, 0);
+        UT_CHECK(openxt_argo_send(guest, &snd_packet) == 0);
+        UT_CHECK(openxt_argo_recv(guest, &rcv_packet) >= 0);
+        UT_CHECK(openxt_argo_get_opcode(&rcv_packet) == OPENXT_PLAYBACK_GET_AVAILABLE_ACK);
+    }
+
+    openxt_argo_set_opcode(&snd_packet, OPENXT_PLAYBACK_FINI);
+    openxt_argo_set_length(&snd_packet, 0);
+    UT_CHECK(openxt_argo_send(guest, &snd_packet) == 0);
+
+    // Stop the helper
+    openxt_argo_set_opcode(&snd_packet, OPENXT_FINI);
+    openxt_argo_set_length(&snd_packet, 0);
+    if (openxt_argo_send(guest, &snd_packet) != 0)
+        kill(pid, SIGTERM);
+
+    UT_CHECK(waitpid(pid, &status, 0) == pid);
+    UT_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+done:
+
+    openxt_argo_close(guest);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmarks                                                                 //
+////////////////////////////////////////////////////////////////////////////////
+
+// Periods sent for each packet size
+#define BENCH_PERIODS 2000
+
+static uint64_t bench_now(clockid_t clock)
+{
+    struct timespec ts;
+
+    if (clock_gettime(clock, &ts) != 0)
+        return 0;
+
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+///
+/// Sends one packet to the helper, and waits for the reply to come back.
+///
+/// @return the reply's opcode, or a negative error code on failure
+///
+static int bench_round_trip(ArgoConnection *guest, ArgoPacket *snd_packet, ArgoPacket *rcv_packet)
+{
+    int ret;
+
+    ret = openxt_argo_send(guest, snd_packet);
+    if (ret < 0)
+        return ret;
+
+    ret = openxt_argo_recv(guest, rcv_packet);
+    if (ret < 0)
+        return ret;
+
+    return openxt_argo_get_opcode(rcv_packet);
+}
+
+///
+/// Runs the real helper event loop in a child process, with a loopback
+/// connection standing in for Argo, and plays to ALSA's null device (or
+/// ALSA_DEVICE if set). For each packet size, this reports how many packets
+/// the helper turns around per second, the percentiles of a period's round
+/// trip, and how much CPU the helper spends per period.
+///
+/// ./audio_helper unittest bench_playback
+///
+void bench_playback(void)
+{
+    int i;
+    int ret;
+    int status;
+    pid_t pid;
+    clockid_t helper_clock;
+    const char *device = getenv("ALSA_DEVICE");
+    ArgoConnection *guest = NULL;
+    ArgoConnection *helper = NULL;
+    ArgoPacket snd_packet;
+    ArgoPacket rcv_packet;
+    OpenXTPlaybackInitPacket *init;
+    OpenXTPlaybackInitAckPacket *init_ack;
+    OpenXTPlaybackPacket *period;
+    uint64_t *latency;
+    const int32_t sizes[] = { 64, 256, 512, 1024 };
+
+    memset(&snd_packet, 0, sizeof(snd_packet));
+    memset(&rcv_packet, 0, sizeof(rcv_packet));
+
+    if (device == NULL)
+        device = "null";
+
+    openxt_checkp(latency = calloc(BENCH_PERIODS, sizeof(uint64_t)));
+
+    ret = openxt_argo_open_loopback(&guest, &helper);
+    UT_CHECK(ret == 0);
+    if (ret != 0)
+        goto done;
+
+    // The helper runs in its own process, so that its CPU time can be told
+    // apart from ours.
+    pid = fork();
+    if (pid == 0) {
+        openxt_argo_close(guest);
+        _exit(openxt_vmaudio_loopback(helper, device) == 0 ? 0 : 1);
+    }
+    openxt_argo_close(helper);
+    UT_CHECK(pid > 0);
+    if (pid < 0)
+        goto done;
+
+    UT_CHECK(clock_getcpuclockid(pid, &helper_clock) == 0);
+
+    // Open playback, asking for protocol version 2, so that every period is
+    // acked with the room left.
+    init = openxt_argo_get_body(&snd_packet);
+    init->version = OPENXT_PROTOCOL_VERSION_2;
+    openxt_argo_set_opcode(&snd_packet, OPENXT_PLAYBACK_INIT);
+    openxt_argo_set_length(&snd_packet, sizeof(OpenXTPlaybackInitPacket));
+    UT_CHECK(bench_round_trip(guest, &snd_packet, &rcv_packet) == OPENXT_PLAYBACK_INIT_ACK);
+
+    init_ack = openxt_argo_get_body(&rcv_packet);
+    UT_CHECK(init_ack->valid == 1);
+    UT_CHECK(init_ack->version >= OPENXT_PROTOCOL_VERSION_2);
+    if (init_ack->valid != 1 || init_ack->version < OPENXT_PROTOCOL_VERSION_2)
+        goto fini;
+
+    openxt_argo_set_opcode(&snd_packet, OPENXT_PLAYBACK_ENABLE_VOICE);
+    openxt_argo_set_length(&snd_packet, 0);
+    UT_CHECK(openxt_argo_send(guest, &snd_packet) == 0);
+
+    openxt_debug("\nPlayback Benchmark (%s, %d periods each):\n", device, BENCH_PERIODS);
+    openxt_debug("%8s %10s %10s %10s %10s %10s %12s\n",
+                 "samples", "packets/s", "p50 (us)", "p90 (us)", "p99 (us)", "max (us)", "cpu/period");
+
+    for (i = 0; i < (int)(sizeof(sizes) / sizeof(sizes[0])); i++) {
+
+        int n;
+        bool ok = true;
+        uint64_t wall;
+        uint64_t helper_cpu;
+
+        period = openxt_argo_get_body(&snd_packet);
+        memset(period->samples, 0, sizeof(period->samples));
+        period->num_samples = sizes[i];
+        openxt_argo_set_opcode(&snd_packet, OPENXT_PLAYBACK_WRITE_AVAILABLE);
+        openxt_argo_set_length(&snd_packet, PLAYBACK_PACKET_LENGTH(sizes[i]));
+
+        wall = bench_now(CLOCK_MONOTONIC);
+        helper_cpu = bench_now(helper_clock);
+
+        for (n = 0; n < BENCH_PERIODS && ok == true; n++) {
+
+            uint64_t start = bench_now(CLOCK_MONOTONIC);
+
+            ok = bench_round_trip(guest, &snd_packet, &rcv_packet) == OPENXT_PLAYBACK_WRITE_AVAILABLE_ACK;
+            latency[n] = bench_now(CLOCK_MONOTONIC) - start;
+        }
+
+        wall = bench_now(CLOCK_MONOTONIC) - wall;
+        helper_cpu = bench_now(helper_clock) - helper_cpu;
+
+        UT_CHECK(ok == true);
+        if (ok == false)
+            break;
+
+        qsort(latency, BENCH_PERIODS, sizeof(uint64_t), bench_compare);
+
+        openxt_debug("%8d %10.0f %10.1f %10.1f %10.1f %10.1f %9.1f us\n",
+                     sizes[i],
+                     BENCH_PERIODS / (wall / 1e9),
+                     latency[BENCH_PERIODS * 50 / 100] / 1e3,
+                     latency[BENCH_PERIODS * 90 / 100] / 1e3,
+                     latency[BENCH_PERIODS * 99 / 100] / 1e3,
+                     latency[BENCH_PERIODS - 1] / 1e3,
+                     helper_cpu / 1e3 / BENCH_PERIODS);
+    }
+
+    openxt_debug("\n");
+
+    openxt_argo_set_opcode(&snd_packet, OPENXT_PLAYBACK_FINI);
+    openxt_argo_set_length(&snd_packet, 0);
+    UT_CHECK(openxt_argo_send(guest, &snd_packet) == 0);
+
+fini:
+
+    // Stop the helper
+    openxt_argo_set_opcode(&snd_packet, OPENXT_FINI);
+    openxt_argo_set_length(&snd_packet, 0);
+    if (openxt_argo_send(guest, &snd_packet) != 0)
+        kill(pid, SIGTERM);
+
+    UT_CHECK(waitpid(pid, &status, 0) == pid);
+    UT_CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+done:
+
+    if (guest != NULL)
+        openxt_argo_close(guest);
+    free(latency);
+}
+
 ////////////////////////////////////////////////////////////////////////////////
 // Support                                                                    //
 ////////////////////////////////////////////////////////////////////////////////
@@ -658,9 +1257,15 @@ int openxt_unittest(int argc, char *argv[])
         openxt_info("wrong syntax: expecting ALSA_DEVICE=\"hw:<#>\" %s unittest [tests]\n", argv[0]);
         openxt_info("available tests:\n");
         openxt_info("    - test_argo\n");
+        openxt_info("    - test_packets\n");
+        openxt_info("    - test_ring\n");
+        openxt_info("    - test_pacing\n");
+        openxt_info("    - test_mix\n");
         openxt_info("    - test_alsa\n");
         openxt_info("    - test_capture\n");
         openxt_info("    - test_playback\n");
+        openxt_info("    - test_xrun\n");
+        openxt_info("    - bench_playback\n");
         return -EINVAL;
     }
 
@@ -675,9 +1280,15 @@ int openxt_unittest(int argc, char *argv[])
     // Tests
     for (i = 2; i < argc; i++) {
         if (strcmp(argv[i], "test_argo") == 0) test_argo();
+        if (strcmp(argv[i], "test_packets") == 0) test_packets();
+        if (strcmp(argv[i], "test_ring") == 0) test_ring();
+        if (strcmp(argv[i], "test_pacing") == 0) test_pacing();
+        if (strcmp(argv[i], "test_mix") == 0) test_mix();
         if (strcmp(argv[i], "test_alsa") == 0) test_alsa();
         if (strcmp(argv[i], "test_capture") == 0) test_capture();
         if (strcmp(argv[i], "test_playback") == 0) test_playback();
+        if (strcmp(argv[i], "test_xrun") == 0) test_xrun();
+        if (strcmp(argv[i], "bench_playback") == 0) bench_playback();
     }
 
     // Footer
@@ -612,11 +612,12 @@ int acpi_events_initialize(void) {
     }
 
 
-    //Set up battery polling.
-    //Ideally, we'd use battery status notifications, but several platforms emit
-    //notifications before data is ready on a hardware level. If a quirk is added
-    //to the battery driver for these platforms, we can move to an event-driven
-    //model.
+    //Set up battery refreshes. Batteries are refreshed on power_supply
+    //uevents; several platforms emit notifications before data is ready on a
+    //hardware level, so uevents only schedule a refresh after a settle delay,
+    //and a slow backstop timer catches anything they miss. Batteries are only
+    //polled if the udev monitor can't be set up.
+    battery_monitor_initialize();
     event_set(&refresh_battery_event, -1, EV_TIMEOUT | EV_PERSIST, wrapper_refresh_battery_event,
 			  acpi_event_table);
     wrapper_refresh_battery_event(0, 0, acpi_event_table);
@@ -633,6 +634,10 @@ void acpi_events_cleanup(void) {
 
     xcpmd_log(LOG_DEBUG, "ACPI events cleanup\n");
 
+    battery_monitor_cleanup();
+    battery_sampler_cleanup();
+    battery_xenstore_cleanup();
+
     if (acpi_events_fd != -1)
         close(acpi_events_fd);
 
@@ -30,7 +30,12 @@
 #include "battery.h"
 #include "modules.h"
 #include "acpi-module.h"
+#include "list.h"
 #include <stdlib.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <libudev.h>
 
 
 //Battery info for consumption by dbus and others
@@ -41,10 +46,118 @@ unsigned int num_battery_structs_allocd = 0;
 //Event struct for libevent
 struct event refresh_battery_event;
 
+//udev monitor for power_supply uevents, and its libevent struct. The monitor
+//is null when batteries are being polled instead.
+static struct udev * battery_udev = NULL;
+static struct udev_monitor * battery_monitor = NULL;
+static struct event battery_uevent_event;
+
+//Whether a uevent has already brought the next refresh forward. Later uevents
+//leave it alone, so a steady stream of them can't keep postponing it.
+static bool battery_uevent_refresh_pending = false;
+
+//Seconds until the next refresh when polling; adapted in
+//wrapper_refresh_battery_event().
+static time_t battery_poll_interval = BATTERY_POLL_MIN_INTERVAL;
+
+//How the value of a sysfs battery attribute is parsed, and into which struct.
+enum battery_attribute_kind {
+    ATTR_STATUS_MILLI,      //unsigned long in battery_status, scaled down by 1000
+    ATTR_INFO_MILLI,        //unsigned long in battery_info, scaled down by 1000
+    ATTR_INFO_STRING,       //char array in battery_info
+    ATTR_STATE,             //"status": charging/discharging bits of battery_status.state
+    ATTR_CAPACITY_LEVEL,    //"capacity_level": critical bit of battery_status.state
+    ATTR_PRESENT,           //"present": present member of both structs
+    ATTR_TECHNOLOGY         //"technology": battery_info.battery_type and technology
+};
+
+
+//A sysfs battery attribute, and the struct member it maps to.
+struct battery_attribute {
+    const char * name;
+    enum battery_attribute_kind kind;
+    size_t offset;
+    size_t size;
+};
+
+#define STATUS_MILLI(name, member) { name, ATTR_STATUS_MILLI, offsetof(struct battery_status, member), 0 }
+#define INFO_MILLI(name, member)   { name, ATTR_INFO_MILLI, offsetof(struct battery_info, member), 0 }
+#define INFO_STRING(name, member)  { name, ATTR_INFO_STRING, offsetof(struct battery_info, member), \
+                                     sizeof(((struct battery_info *)0)->member) }
+
+//The sysfs attributes that are sampled for each battery.
+static const struct battery_attribute battery_attributes[] = {
+    { "present",        ATTR_PRESENT,        0, 0 },
+    { "status",         ATTR_STATE,          0, 0 },
+    { "capacity_level", ATTR_CAPACITY_LEVEL, 0, 0 },
+    { "technology",     ATTR_TECHNOLOGY,     0, 0 },
+    STATUS_MILLI("current_now",        current_now),
+    STATUS_MILLI("charge_now",         charge_now),
+    STATUS_MILLI("power_now",          power_now),
+    STATUS_MILLI("energy_now",         energy_now),
+    STATUS_MILLI("voltage_now",        present_voltage),
+    INFO_MILLI("charge_full_design",   charge_full_design),
+    INFO_MILLI("charge_full",          charge_full),
+    INFO_MILLI("energy_full_design",   energy_full_design),
+    INFO_MILLI("energy_full",          energy_full),
+    INFO_MILLI("voltage_min_design",   design_voltage),
+    INFO_STRING("model_name",          model_number),
+    INFO_STRING("serial_number",       serial_number),
+    INFO_STRING("manufacturer",        oem_info)
+};
+
+#define NUM_BATTERY_ATTRIBUTES (sizeof(battery_attributes) / sizeof(battery_attributes[0]))
+
+//Index of "present" in battery_attributes; its fd doubles as a liveness check.
+#define PRESENT_ATTRIBUTE 0
+
+
+//Open sysfs attribute files of a battery slot, indexed like battery_attributes.
+//An fd is -1 if the battery doesn't have that attribute.
+struct battery_sampler {
+    bool is_open;
+    int fds[NUM_BATTERY_ATTRIBUTES];
+};
+
+static struct battery_sampler * battery_samplers = NULL;
+static unsigned int num_battery_samplers = 0;
+
+//A xenstore path, and the value xcpmd has published there. A null value means
+//the path has been removed. Paths that aren't shadowed are in an unknown state.
+struct xs_shadow {
+    struct list_head list;
+    char * path;
+    char * value;
+};
+
+
+//A staged xenstore operation.
+enum xs_op_type { XS_OP_WRITE, XS_OP_RM, XS_OP_MKDIR };
+
+struct xs_op {
+    struct list_head list;
+    enum xs_op_type type;
+    char * path;
+    char * value;
+};
+
+//Battery xenstore state, as last published, and the operations staged since.
+//Staged operations are published together by commit_xenstore_ops().
+static struct list_head xs_shadows = LIST_HEAD_INIT(xs_shadows);
+static struct list_head xs_ops = LIST_HEAD_INIT(xs_ops);
+static struct xs_handle * battery_xsh = NULL;
+
+//How many times a transaction is retried when another writer races with it.
+#define XS_TRANSACTION_ATTEMPTS 5
+
+static void stage_xenstore_write(const char * value, const char * format, ...) __attribute__ ((format (printf, 2, 3)));
+static void stage_xenstore_rm(const char * format, ...) __attribute__ ((format (printf, 1, 2)));
+static void commit_xenstore_ops(void);
 static void cleanup_removed_battery(unsigned int battery_index);
-static DIR * get_battery_dir(unsigned int battery_index);
-static void set_battery_status_attribute(char * attrib_name, char * attrib_value, struct battery_status * status);
-static void set_battery_info_attribute(char *attrib_name, char *attrib_value, struct battery_info *info);
+static struct battery_sampler * get_battery_sampler(unsigned int battery_index);
+static bool open_battery_sampler(struct battery_sampler * sampler, unsigned int battery_index);
+static void close_battery_sampler(struct battery_sampler * sampler);
+static void set_battery_attribute(const struct battery_attribute * attrib, char * attrib_value, struct battery_status * status, struct battery_info * info);
 static int get_max_battery_index(void);
 static unsigned long get_total_charge(void);
 static unsigned long get_total_max_charge(void);
@@ -338,49 +451,254 @@ int get_battery_percentage(unsigned int battery_index) {
 }
 
 
+//Finds the shadow of a xenstore path, or returns null if it isn't shadowed.
+static struct xs_shadow * find_xenstore_shadow(const char * path) {
+
+    struct xs_shadow * shadow;
+
+    list_for_each_entry(shadow, &xs_shadows, list) {
+        if (strcmp(shadow->path, path) == 0)
+            return shadow;
+    }
+
+    return NULL;
+}
+
+
+//Forgets everything that has been published, so that every path is written
+//again the next time it's staged.
+static void forget_xenstore_shadows(void) {
+
+    struct xs_shadow * shadow, * tmp;
+
+    list_for_each_entry_safe(shadow, tmp, &xs_shadows, list) {
+        list_del(&shadow->list);
+        free(shadow->path);
+        free(shadow->value);
+        free(shadow);
+    }
+}
+
+
+//Allocates memory!
+//Records that a path will hold a value (null if removed) once staged
+//operations are committed. Returns false if the path already held it, in
+//which case there is nothing to stage.
+static bool shadow_xenstore_path(const char * path, const char * value) {
+
+    struct xs_shadow * shadow = find_xenstore_shadow(path);
+
+    if (shadow != NULL) {
+        if (shadow->value == NULL && value == NULL)
+            return false;
+        if (shadow->value != NULL && value != NULL && strcmp(shadow->value, value) == 0)
+            return false;
+        free(shadow->value);
+    }
+    else {
+        shadow = (struct xs_shadow *)malloc(sizeof(struct xs_shadow));
+        if (shadow == NULL) {
+            xcpmd_log(LOG_ERR, "Failed to allocate memory\n");
+            return true;
+        }
+        shadow->path = clone_string((char *)path);
+        list_add_tail(&shadow->list, &xs_shadows);
+    }
+
+    shadow->value = (value != NULL) ? clone_string((char *)value) : NULL;
+
+    return true;
+}
+
+
+//Allocates memory!
+//Queues an operation for the next commit_xenstore_ops().
+static void stage_xenstore_op(enum xs_op_type type, const char * path, const char * value) {
+
+    struct xs_op * op = (struct xs_op *)malloc(sizeof(struct xs_op));
+    if (op == NULL) {
+        xcpmd_log(LOG_ERR, "Failed to allocate memory\n");
+        return;
+    }
+
+    op->type = type;
+    op->path = clone_string((char *)path);
+    op->value = (value != NULL) ? clone_string((char *)value) : NULL;
+    list_add_tail(&op->list, &xs_ops);
+}
+
+
+//Stages a write of a value to a xenstore path, unless that value has already
+//been published there.
+static void stage_xenstore_write(const char * value, const char * format, ...) {
+
+    char path[256];
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(path, sizeof(path), format, args);
+    va_end(args);
+
+    if (shadow_xenstore_path(path, value))
+        stage_xenstore_op(XS_OP_WRITE, path, value);
+}
+
+
+//Stages the removal of a xenstore path and everything under it, unless it has
+//already been removed.
+static void stage_xenstore_rm(const char * format, ...) {
+
+    char path[256];
+    size_t len;
+    struct xs_shadow * shadow, * tmp;
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(path, sizeof(path), format, args);
+    va_end(args);
+
+    //Anything published under this path goes with it.
+    len = strlen(path);
+    list_for_each_entry_safe(shadow, tmp, &xs_shadows, list) {
+        if (strncmp(shadow->path, path, len) == 0 && shadow->path[len] == '/') {
+            list_del(&shadow->list);
+            free(shadow->path);
+            free(shadow->value);
+            free(shadow);
+        }
+    }
+
+    if (shadow_xenstore_path(path, NULL))
+        stage_xenstore_op(XS_OP_RM, path, NULL);
+}
+
+
 //Creates a xenstore battery dir with the specified index if it doesn't already exist.
 static void make_xenstore_battery_dir(unsigned int battery_index) {
 
-    char xenstore_path[256];
-    char ** dir_entries;
-    unsigned int num_entries, i;
-    bool flag;
+    char path[256];
 
-    dir_entries = xenstore_ls(&num_entries, "/pm");
-    if (!dir_entries) {
-        xcpmd_log(LOG_WARNING,
-            "Listing directory /pm failed with error `%s'\n", strerror(errno));
-        return;
+    snprintf(path, sizeof(path), "%s%i", XS_BATTERY_PATH, battery_index);
+
+    //A directory is shadowed with an empty value.
+    if (shadow_xenstore_path(path, ""))
+        stage_xenstore_op(XS_OP_MKDIR, path, NULL);
+}
+
+
+//Applies one staged operation, inside a transaction if there is one. Returns
+//false if it failed; removing a path that doesn't exist isn't a failure.
+static bool apply_xenstore_op(struct xs_op * op, xs_transaction_t t) {
+
+    if (battery_xsh == NULL) {
+        switch (op->type) {
+            case XS_OP_WRITE:
+                return xenstore_write(op->value, "%s", op->path);
+            case XS_OP_RM:
+                return xenstore_rm("%s", op->path) || errno == ENOENT;
+            case XS_OP_MKDIR:
+                return xenstore_mkdir("%s", op->path);
+        }
+        return false;
+    }
+
+    switch (op->type) {
+        case XS_OP_WRITE:
+            return xs_write(battery_xsh, t, op->path, op->value, strlen(op->value));
+        case XS_OP_RM:
+            return xs_rm(battery_xsh, t, op->path) || errno == ENOENT;
+        case XS_OP_MKDIR:
+            return xs_mkdir(battery_xsh, t, op->path);
     }
 
-    snprintf(xenstore_path, 255, "%s%i", XS_BATTERY_PATH, battery_index);
+    return false;
+}
+
+
+//Publishes all staged operations in a single xenstore transaction, so guests
+//watching /pm see one consistent update. If the transaction can't be used,
+//the operations are applied one by one instead. On failure, the shadow is
+//dropped so that everything is rewritten on the next update.
+static void commit_xenstore_ops(void) {
+
+    struct xs_op * op, * tmp;
+    xs_transaction_t t = XBT_NULL;
+    unsigned int attempt;
+    bool ok = false;
+
+    if (list_empty(&xs_ops))
+        return;
+
+    if (battery_xsh == NULL)
+        battery_xsh = xs_open(0);
+
+    for (attempt = 0; battery_xsh != NULL && attempt < XS_TRANSACTION_ATTEMPTS; ++attempt) {
+
+        t = xs_transaction_start(battery_xsh);
+        if (t == XBT_NULL)
+            break;
+
+        ok = true;
+        list_for_each_entry(op, &xs_ops, list) {
+            if (!apply_xenstore_op(op, t))
+                ok = false;
+        }
 
-    flag = false;
-    for (i = 0; i < num_entries; ++i) {
-        if ((dir_entries[i] != NULL) && !strcmp(dir_entries[i], xenstore_path)) {
-            flag = true;
+        if (!ok) {
+            xs_transaction_end(battery_xsh, t, true);
             break;
         }
+
+        if (xs_transaction_end(battery_xsh, t, false))
+            break;
+
+        //Only retry if another writer raced with this transaction.
+        ok = false;
+        if (errno != EAGAIN)
+            break;
     }
-    if (!flag)
-        xenstore_mkdir("%s", xenstore_path);
 
-    //xenstore_ls() calls malloc(), so be sure to free().
-    free(dir_entries);
+    //Without a transaction, fall back to separate writes.
+    if (t == XBT_NULL) {
+        ok = true;
+        list_for_each_entry(op, &xs_ops, list) {
+            if (!apply_xenstore_op(op, XBT_NULL))
+                ok = false;
+        }
+    }
+
+    if (!ok) {
+        xcpmd_log(LOG_WARNING, "Failed to publish battery state to xenstore.\n");
+        forget_xenstore_shadows();
+    }
 
+    list_for_each_entry_safe(op, tmp, &xs_ops, list) {
+        list_del(&op->list);
+        free(op->path);
+        free(op->value);
+        free(op);
+    }
 }
 
 
-//Returns the directory of a battery at a particular index.
-static DIR * get_battery_dir(unsigned int battery_index) {
+//Releases the xenstore connection and everything staged or shadowed.
+void battery_xenstore_cleanup(void) {
 
-    DIR *dir = NULL;
-    char path[256];
+    struct xs_op * op, * tmp;
 
-    snprintf(path, 255, "%s/BAT%i", BATTERY_DIR_PATH, battery_index);
-    dir = opendir(path);
+    list_for_each_entry_safe(op, tmp, &xs_ops, list) {
+        list_del(&op->list);
+        free(op->path);
+        free(op->value);
+        free(op);
+    }
 
-    return dir;
+    forget_xenstore_shadows();
+
+    if (battery_xsh != NULL) {
+        xs_close(battery_xsh);
+        battery_xsh = NULL;
+    }
 }
 
 
@@ -402,81 +720,121 @@ int battery_is_present(unsigned int battery_index) {
 }
 
 
-//Given an attribute name and value, sets the appropriate member of a battery_status struct.
-static void set_battery_status_attribute(char * attrib_name, char * attrib_value, struct battery_status * status) {
+//Gets the sampler for a battery slot, growing the sampler array as needed.
+static struct battery_sampler * get_battery_sampler(unsigned int battery_index) {
 
-    if (!strcmp(attrib_name, "status")) {
-        //The spec says bit 0 and bit 1 are mutually exclusive
-        if ( strstr(attrib_value, "Discharging") )
-            status->state |= 0x1;
-        else if ( strstr(attrib_value, "Charging") )
-            status->state |= 0x2;
-    }
-    else if (!strcmp(attrib_name, "capacity_level")) {
-        if (strstr(attrib_value, "critical"))
-            status->state |= 4;
-    }
-    else if (!strcmp(attrib_name, "current_now")) {
-        status->current_now = strtoull(attrib_value, NULL, 10) / 1000;
-    }
-    else if (!strcmp(attrib_name, "charge_now")) {
-        status->charge_now = strtoull(attrib_value, NULL, 10) / 1000;
-    }
-    else if (!strcmp(attrib_name, "power_now")) {
-        status->power_now = strtoull(attrib_value, NULL, 10) / 1000;
-    }
-    else if (!strcmp(attrib_name, "energy_now")) {
-        status->energy_now = strtoull(attrib_value, NULL, 10) / 1000;
-    }
-    else if (!strcmp(attrib_name, "voltage_now")) {
-        status->present_voltage = strtoull(attrib_value, NULL, 10) / 1000;
-    }
-    else if (!strcmp(attrib_name, "present")) {
-        if (strstr(attrib_value, "1"))
-            status->present = YES;
+    struct battery_sampler * samplers;
+    unsigned int i;
+
+    if (battery_index >= num_battery_samplers) {
+        samplers = (struct battery_sampler *)realloc(battery_samplers, (battery_index + 1) * sizeof(struct battery_sampler));
+        if (samplers == NULL) {
+            xcpmd_log(LOG_ERR, "Failed to allocate memory\n");
+            return NULL;
+        }
+
+        for (i = num_battery_samplers; i <= battery_index; ++i)
+            samplers[i].is_open = false;
+
+        battery_samplers = samplers;
+        num_battery_samplers = battery_index + 1;
     }
+
+    return &battery_samplers[battery_index];
 }
 
 
-//Given an attribute name and value, sets the appropriate member of a battery_info struct.
-static void set_battery_info_attribute(char *attrib_name, char *attrib_value, struct battery_info *info) {
+//Opens every known attribute of a battery slot. Attributes the battery
+//doesn't have are skipped. Returns false if the slot doesn't exist.
+static bool open_battery_sampler(struct battery_sampler * sampler, unsigned int battery_index) {
 
-    if (!strcmp(attrib_name, "present")) {
-        if (strstr(attrib_value, "1"))
-            info->present = YES;
-    }
-    else if (!strcmp(attrib_name, "charge_full_design")) {
-        info->charge_full_design = strtoull(attrib_value, NULL, 10) / 1000;
-    }
-    else if (!strcmp(attrib_name, "charge_full")) {
-        info->charge_full = strtoull(attrib_value, NULL, 10) / 1000;
-    }
-    else if (!strcmp(attrib_name, "energy_full_design")) {
-        info->energy_full_design = strtoull(attrib_value, NULL, 10) / 1000;
-    }
-    else if (!strcmp(attrib_name, "energy_full")) {
-        info->energy_full = strtoull(attrib_value, NULL, 10) / 1000;
-    }
-    else if (!strcmp(attrib_name, "voltage_min_design")) {
-        info->design_voltage = strtoull(attrib_value, NULL, 10) / 1000;
-    }
-    else if (!strcmp(attrib_name, "model_name")) {
-        pstrcpy(info->model_number, sizeof (info->model_number), attrib_value);
-    }
-    else if (!strcmp(attrib_name, "serial_number")) {
-        pstrcpy(info->serial_number, sizeof (info->serial_number), attrib_value);
+    char filename[256];
+    unsigned int i;
+
+    if (battery_slot_exists(battery_index) == NO)
+        return false;
+
+    for (i = 0; i < NUM_BATTERY_ATTRIBUTES; ++i) {
+        snprintf(filename, sizeof(filename), "%s/BAT%u/%s", BATTERY_DIR_PATH, battery_index, battery_attributes[i].name);
+        sampler->fds[i] = open(filename, O_RDONLY | O_CLOEXEC);
     }
-    else if (!strcmp(attrib_name, "technology")) {
-        if (strstr(attrib_value, "Li-ion"))
-            pstrcpy(info->battery_type, sizeof (info->battery_type), "LION\n");
-        else if (strstr(attrib_value, "Li-poly"))
-            pstrcpy(info->battery_type, sizeof (info->battery_type), "LiP\n");
-        else
-            pstrcpy(info->battery_type, sizeof (info->battery_type), attrib_value);
-        info->battery_technology = RECHARGEABLE;
+
+    sampler->is_open = true;
+
+    return true;
+}
+
+
+//Closes all of a battery slot's attribute files.
+static void close_battery_sampler(struct battery_sampler * sampler) {
+
+    unsigned int i;
+
+    if (!sampler->is_open)
+        return;
+
+    for (i = 0; i < NUM_BATTERY_ATTRIBUTES; ++i) {
+        if (sampler->fds[i] != -1)
+            close(sampler->fds[i]);
     }
-    else if (!strcmp(attrib_name, "manufacturer")) {
-      pstrcpy(info->oem_info, sizeof (info->oem_info), attrib_value);
+
+    sampler->is_open = false;
+}
+
+
+//Closes the attribute files of all battery slots.
+void battery_sampler_cleanup(void) {
+
+    unsigned int i;
+
+    for (i = 0; i < num_battery_samplers; ++i)
+        close_battery_sampler(&battery_samplers[i]);
+
+    free(battery_samplers);
+    battery_samplers = NULL;
+    num_battery_samplers = 0;
+}
+
+
+//Given an attribute and its value, sets the appropriate member of a battery_status or battery_info struct.
+static void set_battery_attribute(const struct battery_attribute * attrib, char * attrib_value, struct battery_status * status, struct battery_info * info) {
+
+    switch (attrib->kind) {
+        case ATTR_STATUS_MILLI:
+            *(unsigned long *)((char *)status + attrib->offset) = strtoull(attrib_value, NULL, 10) / 1000;
+            break;
+        case ATTR_INFO_MILLI:
+            *(unsigned long *)((char *)info + attrib->offset) = strtoull(attrib_value, NULL, 10) / 1000;
+            break;
+        case ATTR_INFO_STRING:
+            pstrcpy((char *)info + attrib->offset, attrib->size, attrib_value);
+            break;
+        case ATTR_STATE:
+            //The spec says bit 0 and bit 1 are mutually exclusive
+            if ( strstr(attrib_value, "Discharging") )
+                status->state |= 0x1;
+            else if ( strstr(attrib_value, "Charging") )
+                status->state |= 0x2;
+            break;
+        case ATTR_CAPACITY_LEVEL:
+            if (strstr(attrib_value, "critical"))
+                status->state |= 4;
+            break;
+        case ATTR_PRESENT:
+            if (strstr(attrib_value, "1")) {
+                status->present = YES;
+                info->present = YES;
+            }
+            break;
+        case ATTR_TECHNOLOGY:
+            if (strstr(attrib_value, "Li-ion"))
+                pstrcpy(info->battery_type, sizeof (info->battery_type), "LION\n");
+            else if (strstr(attrib_value, "Li-poly"))
+                pstrcpy(info->battery_type, sizeof (info->battery_type), "LiP\n");
+            else
+                pstrcpy(info->battery_type, sizeof (info->battery_type), attrib_value);
+            info->battery_technology = RECHARGEABLE;
+            break;
     }
 }
 
@@ -484,12 +842,12 @@ static void set_battery_info_attribute(char *attrib_name, char *attrib_value, st
 //Gets a battery's status from the sysfs and stores it in last_status.
 int update_battery_status(unsigned int battery_index) {
 
-    DIR *battery_dir;
-    struct dirent * dp;
-    FILE *file;
-    char filename[295];
+    struct battery_sampler * sampler;
     char data[128];
     char *ptr;
+    ssize_t len;
+    unsigned int i;
+    bool reopened = false;
 
     struct battery_status status;
     struct battery_info info;
@@ -499,63 +857,58 @@ int update_battery_status(unsigned int battery_index) {
     if (battery_index >= num_battery_structs_allocd)
         return -1;
 
-    if (battery_slot_exists(battery_index) == NO) {
+    sampler = get_battery_sampler(battery_index);
+    if (sampler == NULL)
+        return 0;
+
+    //Without a "present" attribute, fall back to checking the slot each time.
+    if (sampler->is_open && sampler->fds[PRESENT_ATTRIBUTE] == -1 &&
+        battery_slot_exists(battery_index) == NO) {
+        close_battery_sampler(sampler);
+    }
+
+reopen:
+    //The slot doesn't exist--this normally occurs when a battery slot is removed
+    if (!sampler->is_open && !open_battery_sampler(sampler, battery_index)) {
         status.present = NO;
         memcpy(&last_status[battery_index], &status, sizeof(struct battery_status));
         return 1;
     }
 
-    battery_dir = get_battery_dir(battery_index);
-    if (!battery_dir) {
-        //Battery directory does not exist--this normally occurs when a battery slot is removed
-        if (errno == ENOENT) {
-            status.present = NO;
-            memcpy(&last_status[battery_index], &status, sizeof(struct battery_status));
-            return 1;
-        }
-        else {
-            xcpmd_log(LOG_ERR, "opendir in update_battery_status for directory %s/BAT%d failed with error %d\n", BATTERY_DIR_PATH, battery_index, errno);
-            return 0;
-        }
-    }
-
-    //Loop over the files in the directory.
-    while ((dp = readdir(battery_dir)) != NULL) {
-
-        //Convert from dirent to file and read out the data.
-        if (dp->d_type == DT_REG) {
-
-            snprintf(filename, sizeof (filename), "%s/BAT%u/%s", BATTERY_DIR_PATH, battery_index, dp->d_name);
+    //Re-read each attribute in place.
+    for (i = 0; i < NUM_BATTERY_ATTRIBUTES; ++i) {
 
-            file = fopen(filename, "r");
-            if (file == NULL)
-                continue;
+        if (sampler->fds[i] == -1)
+            continue;
 
-            memset(data, 0, sizeof(data));
-            if (fgets(data, sizeof(data), file) == NULL) {
-                if (errno != ENODEV) {
-                    // ACPI batteries can return ENODEV for current_now.
-                    // skip that so we don't spam the log.
-                    xcpmd_log(LOG_ERR, "Failed to read %s errno %d", filename,
-                              errno);
-                }
-                fclose(file);
-                continue;
+        len = pread(sampler->fds[i], data, sizeof(data) - 1, 0);
+        if (len < 0) {
+            //A removed battery slot leaves its open attribute files
+            //unreadable. "present" is read first, so reopen the slot in case
+            //it has been added back.
+            if (i == PRESENT_ATTRIBUTE && !reopened) {
+                close_battery_sampler(sampler);
+                reopened = true;
+                goto reopen;
             }
 
-            fclose(file);
-
-            //Trim off leading spaces.
-            ptr = data;
-            while(*ptr == ' ')
-                ptr += sizeof(char);
+            if (errno != ENODEV) {
+                // ACPI batteries can return ENODEV for current_now.
+                // skip that so we don't spam the log.
+                xcpmd_log(LOG_ERR, "Failed to read %s/BAT%u/%s errno %d", BATTERY_DIR_PATH,
+                          battery_index, battery_attributes[i].name, errno);
+            }
+            continue;
+        }
+        data[len] = '\0';
 
-            //Set the attribute represented by this file.
-            set_battery_status_attribute(dp->d_name, ptr, &status);
+        //Trim off leading spaces.
+        ptr = data;
+        while(*ptr == ' ')
+            ptr += sizeof(char);
 
-            //Set the attribute represented by this file.
-            set_battery_info_attribute(dp->d_name, ptr, &info);
-        }
+        //Set the attribute represented by this file.
+        set_battery_attribute(&battery_attributes[i], ptr, &status, &info);
     }
 
     // This check handles both cases for mA batteries: if are not charging
@@ -602,14 +955,13 @@ int update_battery_status(unsigned int battery_index) {
     info.capacity_granularity_1 = 1;
     info.capacity_granularity_2 = 1;
 
-    closedir(battery_dir);
     memcpy(&last_info[battery_index], &info, sizeof(struct battery_info));
 
     return 1;
 }
 
 
-//Exactly what it says on the tin.
+//Stages a battery's info leaves; update_batteries() publishes them.
 void write_battery_info_to_xenstore(unsigned int battery_index) {
 
     if (battery_slot_exists(battery_index) == NO || battery_index >= num_battery_structs_allocd) {
@@ -653,23 +1005,24 @@ void write_battery_info_to_xenstore(unsigned int battery_index) {
     make_xenstore_battery_dir(battery_index);
 
     //Now write the leaves.
-    xenstore_write(bif, "%s%i/%s", XS_BATTERY_PATH, battery_index, XS_BIF_LEAF);
+    stage_xenstore_write(bif, "%s%i/%s", XS_BATTERY_PATH, battery_index, XS_BIF_LEAF);
 
 
     //Here for compatibility--will be removed eventually
     if (battery_index == 0)
-        xenstore_write(bif, XS_BIF);
+        stage_xenstore_write(bif, XS_BIF);
     else
-        xenstore_write(bif, XS_BIF1);
+        stage_xenstore_write(bif, XS_BIF1);
 }
 
 
-//Exactly what it says on the tin.
+//Stages a battery's status leaves; update_batteries() publishes them.
 void write_battery_status_to_xenstore(unsigned int battery_index) {
 
     struct battery_status * status;
     char bst[35];
     int num_batteries, current_battery_level;
+    char level[16];
 
     if (battery_index >= num_battery_structs_allocd) {
         cleanup_removed_battery(battery_index);
@@ -677,11 +1030,11 @@ void write_battery_status_to_xenstore(unsigned int battery_index) {
 
     num_batteries = get_num_batteries_present();
     if (num_batteries == 0) {
-        xenstore_write("0", XS_BATTERY_PRESENT);
+        stage_xenstore_write("0", XS_BATTERY_PRESENT);
         return;
     }
     else {
-        xenstore_write("1", XS_BATTERY_PRESENT);
+        stage_xenstore_write("1", XS_BATTERY_PRESENT);
     }
 
     status = &last_status[battery_index];
@@ -689,9 +1042,9 @@ void write_battery_status_to_xenstore(unsigned int battery_index) {
     //Delete the BST and reset the "present" flag if the battery is not currently present.
     if (status->present != YES) {
 
-        xenstore_rm("%s%i/%s", XS_BATTERY_PATH, battery_index, XS_BST_LEAF);
+        stage_xenstore_rm("%s%i/%s", XS_BATTERY_PATH, battery_index, XS_BST_LEAF);
 
-        xenstore_write("0", "%s%i/%s", XS_BATTERY_PATH, battery_index, XS_BATTERY_PRESENT_LEAF);
+        stage_xenstore_write("0", "%s%i/%s", XS_BATTERY_PATH, battery_index, XS_BATTERY_PRESENT_LEAF);
         return;
     }
 
@@ -707,21 +1060,22 @@ void write_battery_status_to_xenstore(unsigned int battery_index) {
     make_xenstore_battery_dir(battery_index);
 
     //Now write the leaves.
-    xenstore_write(bst, XS_BATTERY_PATH "%i/" XS_BST_LEAF, battery_index);
+    stage_xenstore_write(bst, XS_BATTERY_PATH "%i/" XS_BST_LEAF, battery_index);
 
-    xenstore_write("1", "%s%i/%s", XS_BATTERY_PATH, battery_index, XS_BATTERY_PRESENT_LEAF);
+    stage_xenstore_write("1", "%s%i/%s", XS_BATTERY_PATH, battery_index, XS_BATTERY_PRESENT_LEAF);
 
     //Here for compatibility--will be removed eventually
     if (battery_index == 0)
-        xenstore_write(bst, XS_BST);
+        stage_xenstore_write(bst, XS_BST);
     else
-        xenstore_write(bst, XS_BST1);
+        stage_xenstore_write(bst, XS_BST1);
 
     current_battery_level = get_current_battery_level();
     if (current_battery_level == NORMAL || get_ac_adapter_status() == ON_AC)
-        xenstore_rm(XS_CURRENT_BATTERY_LEVEL);
+        stage_xenstore_rm(XS_CURRENT_BATTERY_LEVEL);
     else {
-        xenstore_write_int(current_battery_level, XS_CURRENT_BATTERY_LEVEL);
+        snprintf(level, sizeof(level), "%d", current_battery_level);
+        stage_xenstore_write(level, XS_CURRENT_BATTERY_LEVEL);
         notify_com_citrix_xenclient_xcpmd_battery_level_notification(xcdbus_conn, XCPMD_SERVICE, XCPMD_PATH);
         xcpmd_log(LOG_ALERT, "Battery level below normal - %d!\n", current_battery_level);
     }
@@ -733,7 +1087,8 @@ void write_battery_status_to_xenstore(unsigned int battery_index) {
 
 
 //Updates status and info of all batteries locally and in the xenstore.
-void update_batteries(void) {
+//Returns whether any battery's status or info changed.
+bool update_batteries(void) {
 
     struct battery_status *old_status = NULL;
     struct battery_info *old_info = NULL;
@@ -741,9 +1096,10 @@ void update_batteries(void) {
     unsigned int num_batteries = 0;
     unsigned int i, new_array_size, old_array_size, num_batteries_to_update;
     bool present_batteries_changed = false;
+    bool changed = false;
 
     if ( pm_specs & PM_SPEC_NO_BATTERIES )
-        return;
+        return false;
 
     //Keep a copy of what the battery status/info used to be.
     old_status = (struct battery_status *)malloc(num_battery_structs_allocd * sizeof(struct battery_status));
@@ -787,7 +1143,8 @@ void update_batteries(void) {
         update_battery_status(i);
     }
 
-    //Write back to the xenstore and only send notifications if things have changed.
+    //Write back to the xenstore. Only leaves whose values changed are written,
+    //all in one transaction, before any notifications go out.
     for (i=0; i < num_batteries_to_update; ++i) {
 
         //No need to update status/info in Xenstore if there was no battery to begin with.
@@ -798,6 +1155,11 @@ void update_batteries(void) {
             write_battery_status_to_xenstore(i);
             write_battery_info_to_xenstore(i);
         }
+    }
+    commit_xenstore_ops();
+
+    //Only send notifications if things have changed.
+    for (i=0; i < num_batteries_to_update; ++i) {
 
         if (i < old_array_size && i < new_array_size) {
             if (memcmp(&old_info[i], &last_info[i], sizeof(struct battery_info))) {
@@ -855,11 +1217,13 @@ void update_batteries(void) {
     }
 
     if ((old_array_size != new_array_size) || (memcmp(old_info, last_info, new_array_size * sizeof(struct battery_info)))) {
+        changed = true;
         notify_com_citrix_xenclient_xcpmd_battery_info_changed(xcdbus_conn, XCPMD_SERVICE, XCPMD_PATH);
     }
 
     if ((old_array_size != new_array_size) || (memcmp(old_status, last_status, new_array_size * sizeof(struct battery_status)))) {
         static int previous_percent;
+        changed = true;
         int current_percent = get_overall_battery_percentage();
 
         if (current_percent != previous_percent)  {
@@ -877,6 +1241,8 @@ void update_batteries(void) {
 
     free(old_info);
     free(old_status);
+
+    return changed;
 }
 
 
@@ -984,21 +1350,21 @@ int get_num_batteries_present(void) {
 //Remove a battery's entries from the xenstore.
 static void cleanup_removed_battery(unsigned int battery_index) {
 
-    xenstore_rm("%s%d", XS_BATTERY_PATH, battery_index);
+    stage_xenstore_rm("%s%d", XS_BATTERY_PATH, battery_index);
 
     if (battery_index > 0) {
-        xenstore_rm(XS_BST1);
-        xenstore_rm(XS_BIF1);
+        stage_xenstore_rm(XS_BST1);
+        stage_xenstore_rm(XS_BIF1);
     }
     else {
-        xenstore_rm(XS_BST);
-        xenstore_rm(XS_BIF);
+        stage_xenstore_rm(XS_BST);
+        stage_xenstore_rm(XS_BIF);
     }
 
     if (get_num_batteries_present() == 0)
-        xenstore_write("0", XS_BATTERY_PRESENT);
+        stage_xenstore_write("0", XS_BATTERY_PRESENT);
     else
-        xenstore_write("1", XS_BATTERY_PRESENT);
+        stage_xenstore_write("1", XS_BATTERY_PRESENT);
 }
 
 
@@ -1019,20 +1385,120 @@ int battery_slot_exists(unsigned int battery_index) {
 }
 
 
-//Updates battery info/status and schedules itself to run again in 4 seconds.
+//Updates battery info/status and schedules the next refresh.
+//When power_supply uevents are being monitored, the next refresh is only a
+//backstop for drivers that don't report every change. When polling, the
+//interval starts at BATTERY_POLL_MIN_INTERVAL and doubles every time nothing
+//changed, up to BATTERY_POLL_MAX_INTERVAL.
 void wrapper_refresh_battery_event(int fd, short event, void *opaque) {
 
     struct timeval tv;
     struct ev_wrapper **acpi_event_table = (struct ev_wrapper **)opaque;
     struct ev_wrapper *info_e = acpi_event_table[EVENT_BATT_INFO];
     struct ev_wrapper *status_e = acpi_event_table[EVENT_BATT_STATUS];
+    bool changed;
 
     memset(&tv, 0, sizeof(tv));
+    battery_uevent_refresh_pending = false;
 
-    update_batteries();
+    changed = update_batteries();
     handle_events(info_e);
     handle_events(status_e);
 
-    tv.tv_sec = 4;
+    if (battery_monitor != NULL) {
+        tv.tv_sec = BATTERY_UEVENT_BACKSTOP_INTERVAL;
+    }
+    else {
+        if (changed)
+            battery_poll_interval = BATTERY_POLL_MIN_INTERVAL;
+        else if (battery_poll_interval < BATTERY_POLL_MAX_INTERVAL)
+            battery_poll_interval *= 2;
+
+        if (battery_poll_interval > BATTERY_POLL_MAX_INTERVAL)
+            battery_poll_interval = BATTERY_POLL_MAX_INTERVAL;
+
+        tv.tv_sec = battery_poll_interval;
+    }
+
     evtimer_add(&refresh_battery_event, &tv);
 }
+
+
+//Drains the udev monitor and, if any power_supply device changed, schedules a
+//refresh once the data has had BATTERY_UEVENT_SETTLE_DELAY to settle. Some
+//platforms notify before their batteries report the new data, and a burst of
+//uevents (e.g. from plugging in AC) collapses into a single refresh this way.
+//The delay runs from the first uevent of the burst, not the last.
+static void wrapper_battery_uevent(int fd, short event, void *opaque) {
+
+    struct udev_device * dev;
+    struct timeval tv;
+    bool power_supply_changed = false;
+
+    while ((dev = udev_monitor_receive_device(battery_monitor)) != NULL) {
+        power_supply_changed = true;
+        udev_device_unref(dev);
+    }
+
+    if (!power_supply_changed || battery_uevent_refresh_pending)
+        return;
+
+    memset(&tv, 0, sizeof(tv));
+    tv.tv_sec = BATTERY_UEVENT_SETTLE_DELAY;
+    evtimer_add(&refresh_battery_event, &tv);
+    battery_uevent_refresh_pending = true;
+}
+
+
+//Starts listening for power_supply uevents, so that batteries are refreshed
+//when the kernel reports a change rather than on a fixed timer.
+//Returns 0 on success, or -1 if batteries should be polled instead.
+int battery_monitor_initialize(void) {
+
+    battery_udev = udev_new();
+    if (battery_udev == NULL) {
+        xcpmd_log(LOG_ERR, "Failed to create udev context; polling for battery changes.\n");
+        return -1;
+    }
+
+    //Listen to the kernel directly: udevd's rebroadcast may be missing or
+    //late, and the power_supply uevents carry everything needed.
+    battery_monitor = udev_monitor_new_from_netlink(battery_udev, "kernel");
+    if (battery_monitor == NULL) {
+        xcpmd_log(LOG_ERR, "Failed to create udev monitor; polling for battery changes.\n");
+        battery_monitor_cleanup();
+        return -1;
+    }
+
+    if (udev_monitor_filter_add_match_subsystem_devtype(battery_monitor, "power_supply", NULL) < 0 ||
+        udev_monitor_enable_receiving(battery_monitor) < 0) {
+        xcpmd_log(LOG_ERR, "Failed to listen for power_supply uevents; polling for battery changes.\n");
+        battery_monitor_cleanup();
+        return -1;
+    }
+
+    event_set(&battery_uevent_event, udev_monitor_get_fd(battery_monitor), EV_READ | EV_PERSIST,
+              wrapper_battery_uevent, NULL);
+    event_add(&battery_uevent_event, NULL);
+
+    xcpmd_log(LOG_DEBUG, "Monitoring power_supply uevents.\n");
+
+    return 0;
+}
+
+
+//Stops listening for power_supply uevents.
+void battery_monitor_cleanup(void) {
+
+    if (battery_monitor != NULL) {
+        if (event_initialized(&battery_uevent_event))
+            event_del(&battery_uevent_event);
+        udev_monitor_unref(battery_monitor);
+        battery_monitor = NULL;
+    }
+
+    if (battery_udev != NULL) {
+        udev_unref(battery_udev);
+        battery_udev = NULL;
+    }
+}
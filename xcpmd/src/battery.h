@@ -26,6 +26,7 @@
 
 #include "project.h"
 #include "xcpmd.h"
+#include <stdbool.h>
 
 
 //Battery info for consumption by dbus and others
@@ -40,7 +41,7 @@ int get_battery_charge_state(unsigned int battery_index);
 int battery_slot_exists(unsigned int battery_index);
 int battery_is_present(unsigned int battery_index);
 
-void update_batteries(void);
+bool update_batteries(void);
 int update_battery_status(unsigned int battery_index);
 int update_battery_info(unsigned int battery_index);
 void write_battery_status_to_xenstore(unsigned int battery_index);
@@ -55,6 +56,10 @@ int get_num_batteries_present(void);
 int get_num_batteries(void);
 
 void wrapper_refresh_battery_event(int fd, short event, void *opaque);
+int battery_monitor_initialize(void);
+void battery_monitor_cleanup(void);
+void battery_sampler_cleanup(void);
+void battery_xenstore_cleanup(void);
 
 
 #endif
@@ -74,6 +74,7 @@ static char * rule_to_json(struct rule * rule);
 
 static struct db_var * cache_db_var(char * name, enum arg_type type, union arg_u value);
 static int uncache_db_var(char * name);
+static struct db_var * lookup_cached_var(char * name);
 
 
 //Write a value to the specified DB path.
@@ -283,6 +284,18 @@ void write_db_rules() {
 }
 
 
+//Write the rules added after the specified rule to the DB, leaving the rest
+//alone. If tail is null, all rules are written.
+void write_db_rules_after(struct rule * tail) {
+
+    struct list_head * pos;
+
+    for (pos = (tail ? tail->list.next : rules.list.next); pos != &rules.list; pos = pos->next) {
+        write_db_rule(list_entry(pos, struct rule, list));
+    }
+}
+
+
 //Deletes the specified rule from the DB. Does not modify the internal rule list.
 void delete_db_rule(char * rule_name) {
 
@@ -927,20 +940,34 @@ struct db_var * add_var(char * name, enum arg_type type, union arg_u value, char
 }
 
 
+//Looks up a db_var in the cache only. Returns null if it isn't cached.
+static struct db_var * lookup_cached_var(char * name) {
+
+    struct db_var * tmp_var;
+    unsigned int hash = hash_name(name);
+    struct list_head * bucket = name_hash_bucket(&db_var_hash, hash);
+
+    if (bucket == NULL)
+        return NULL;
+
+    list_for_each_entry(tmp_var, bucket, hash.list) {
+        if (tmp_var->hash.hash == hash && strcmp(tmp_var->name, name) == 0)
+            return tmp_var;
+    }
+
+    return NULL;
+}
+
+
 //Looks up a db_var based on its name, and caches it if it's not already in the
 //cache. Returns null if the search fails.
 struct db_var * lookup_var(char * name) {
 
-    struct db_var * tmp_var, *found_var = NULL;
+    struct db_var * found_var;
     struct arg_node tmp_arg;
 
     //Check if the var is cached.
-    list_for_each_entry(tmp_var, &(db_vars.list), list) {
-        if (strcmp(tmp_var->name, name) == 0) {
-            found_var = tmp_var;
-            break;
-        }
-    }
+    found_var = lookup_cached_var(name);
 
     //If not, look it up in the DB.
     if (found_var == NULL) {
@@ -1019,6 +1046,7 @@ static struct db_var * cache_db_var(char * name, enum arg_type type, union arg_u
     var->ref_count = 0;
 
     list_add_tail(&var->list, &db_vars.list);
+    name_hash_add(&db_var_hash, &var->hash, var->name);
 
     return var;
 }
@@ -1028,14 +1056,7 @@ static struct db_var * cache_db_var(char * name, enum arg_type type, union arg_u
 //Fails if the variable is required by any currently loaded rules.
 static int uncache_db_var(char * name) {
 
-    struct db_var *tmp_var, *found_var = NULL;
-
-    list_for_each_entry(tmp_var, &(db_vars.list), list) {
-        if (strcmp(tmp_var->name, name) == 0) {
-            found_var = tmp_var;
-            break;
-        }
-    }
+    struct db_var *found_var = lookup_cached_var(name);
 
     if (found_var == NULL) {
         return 0;
@@ -1048,6 +1069,7 @@ static int uncache_db_var(char * name) {
     }
 
     list_del(&found_var->list);
+    name_hash_del(&db_var_hash, &found_var->hash);
     if (found_var->value.type == ARG_STR) {
         free(found_var->value.arg.str);
     }
@@ -1067,6 +1089,7 @@ void delete_cached_vars() {
     list_for_each_safe(posi, i, &db_vars.list) {
         tmp_var = list_entry(posi, struct db_var, list);
         list_del(posi);
+        name_hash_del(&db_var_hash, &tmp_var->hash);
         free(tmp_var->name);
         if (tmp_var->value.type == ARG_STR) {
             free(tmp_var->value.arg.str);
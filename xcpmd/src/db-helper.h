@@ -29,6 +29,7 @@ bool parse_db_rules(struct parse_data * data);
 //General use:
 void write_db_rule(struct rule * rule);
 void write_db_rules();
+void write_db_rules_after(struct rule * tail);
 void delete_db_rule(char * rule_name);
 void delete_db_rules();
 
@@ -54,6 +54,55 @@ static char * _module_list[] = {
     MODULE_PATH "vm-events-module.so",
 };
 
+//Scratch space for handle_events(). Each call in progress (actions may raise
+//events of their own) takes a frame of num_rules entries, so the space only
+//grows when rules are added, and delivering an event allocates nothing.
+static struct {
+    struct rule ** rules;
+    bool * was_active;
+    bool * is_active;
+    unsigned int size;
+    unsigned int used;
+} _scratch;
+
+//Numbers handle_events() calls, so that a rule is queued only once per call.
+static unsigned int _dispatch_serial = 0;
+
+
+//Makes sure the scratch space has room for at least size entries.
+//Returns 0 on success, -1 if out of memory.
+static int reserve_scratch(unsigned int size) {
+
+    struct rule ** rules;
+    bool * was_active;
+    bool * is_active;
+
+    if (size <= _scratch.size)
+        return 0;
+
+    rules = (struct rule **)realloc(_scratch.rules, size * sizeof(struct rule *));
+    if (rules == NULL)
+        goto fail;
+    _scratch.rules = rules;
+
+    was_active = (bool *)realloc(_scratch.was_active, size * sizeof(bool));
+    if (was_active == NULL)
+        goto fail;
+    _scratch.was_active = was_active;
+
+    is_active = (bool *)realloc(_scratch.is_active, size * sizeof(bool));
+    if (is_active == NULL)
+        goto fail;
+    _scratch.is_active = is_active;
+
+    _scratch.size = size;
+    return 0;
+
+fail:
+    xcpmd_log(LOG_ERR, "Failed to realloc memory\n");
+    return -1;
+}
+
 
 //Loads all modules in _module_list.
 int init_modules() {
@@ -68,6 +117,11 @@ void uninit_modules() {
 
     unsigned int num_modules = sizeof(_module_list) / sizeof(_module_list[0]);
     unload_modules(_module_list, num_modules);
+
+    free(_scratch.rules);
+    free(_scratch.was_active);
+    free(_scratch.is_active);
+    memset(&_scratch, 0, sizeof(_scratch));
 }
 
 
@@ -138,6 +192,16 @@ void unload_modules(char ** module_list, unsigned int num_modules) {
 }
 
 
+//Runs a condition's check against its event, taking inversion into account,
+//and records the result. Returns true if the condition changed.
+static bool update_condition(struct condition * condition, struct ev_wrapper * event) {
+
+    bool is_true = (condition->type->check(event, &condition->args) != condition->is_inverted); //logical XOR
+
+    return set_condition_state(condition, is_true);
+}
+
+
 //On an event, checks conditions that depend on that event, evaluates any rules
 //that depend on any changed conditions, and performs actions should any rule
 //change from inactive to active or vice-versa.
@@ -145,77 +209,58 @@ void handle_events(struct ev_wrapper * event) {
 
     struct condition_node * node;
     struct condition * condition;
-    struct rule ** checklist;
-    struct rule ** alloc_check;
-    unsigned int nodes_allocd = 8;
-    unsigned int nodes_assigned = 0;
+    struct rule * rule;
+    unsigned int serial = ++_dispatch_serial;
+    unsigned int base, count = 0;
     unsigned int i;
-    bool condition_is_true, condition_was_true;
-    bool *rule_is_true, *rule_was_true;
 
-    checklist = (struct rule **)malloc(nodes_allocd * sizeof(struct rule *));
-    if (checklist == NULL) {
-        xcpmd_log(LOG_ERR, "Failed to allocate memory\n");
+    //Take a frame of the scratch space; a rule is queued at most once, so
+    //num_rules entries are always enough.
+    if (reserve_scratch(_scratch.used + num_rules) != 0)
         return;
-    }
+
+    base = _scratch.used;
+    _scratch.used += num_rules;
 
     //Evaluate each condition that depends on this event.
     list_for_each_entry(node, &(event->listeners.list), list) {
         condition = node->condition;
-        condition_was_true = condition->is_true;
-        condition_is_true = (condition->type->check(event, &condition->args) != condition->is_inverted); //logical XOR
-
-        //If this condition has changed, add its rule to a rundown list.
-        if (condition_was_true != condition_is_true) {
-
-            //The rundown list is stored in a dynamic array that may need to be reallocated.
-            if (nodes_assigned >= nodes_allocd) {
-                alloc_check = (struct rule **)realloc(checklist, nodes_allocd * 2 * sizeof(struct rule *));
-                if (alloc_check == NULL) {
-                    xcpmd_log(LOG_ERR, "Failed to realloc memory\n");
-                    free(checklist);
-                    return;
-                }
-                checklist = alloc_check;
-                nodes_allocd *= 2;
-            }
-
-            checklist[nodes_assigned] = condition->rule;
-            ++nodes_assigned;
+        rule = condition->rule;
+
+        //If this condition has changed, add its rule to a rundown list, unless
+        //another of its conditions already did.
+        if (update_condition(condition, event) && rule != NULL && rule->queued_in != serial && count < num_rules) {
+            rule->queued_in = serial;
+            _scratch.rules[base + count] = rule;
+            ++count;
         }
-
-        condition->is_true = condition_is_true;
     }
 
-    //Evaluate each rule depending on those conditions.
-    rule_is_true = (bool *)malloc(nodes_assigned * sizeof(bool));
-    rule_was_true = (bool *)malloc(nodes_assigned * sizeof(bool));
-    if (rule_is_true == NULL || rule_was_true == NULL) {
-        xcpmd_log(LOG_ERR, "Failed to alloc memory");
-        free(checklist);
-        return;
-    }
+    //Evaluate each rule depending on those conditions. The scratch space may
+    //move if an action raises another event, so it is always indexed afresh.
+    for (i=0; i < count; ++i) {
 
-    for (i=0; i < nodes_assigned; ++i) {
-
-        rule_was_true[i] = checklist[i]->is_active;
-        rule_is_true[i] = evaluate_rule(checklist[i]);
+        rule = _scratch.rules[base + i];
+        _scratch.was_active[base + i] = rule->is_active;
+        _scratch.is_active[base + i] = evaluate_rule(rule);
 
         //Perform all undos first.
-        if (rule_was_true[i] && !rule_is_true[i])
-            do_undos(checklist[i]);
+        if (_scratch.was_active[base + i] && !_scratch.is_active[base + i])
+            do_undos(rule);
     }
 
-    for (i=0; i < nodes_assigned; ++i) {
+    for (i=0; i < count; ++i) {
+
+        rule = _scratch.rules[base + i];
 
         //Then do actions.
-        if (rule_is_true[i] && !rule_was_true[i])
-            do_actions(checklist[i]);
+        if (_scratch.is_active[base + i] && !_scratch.was_active[base + i])
+            do_actions(rule);
 
         //Immediately reset the rule if the triggering event is stateless--this
         //prevents repeated events from being ignored.
         if (!event->is_stateless) {
-            checklist[i]->is_active = rule_is_true[i];
+            rule->is_active = _scratch.is_active[base + i];
         }
     }
 
@@ -226,14 +271,12 @@ void handle_events(struct ev_wrapper * event) {
 
         list_for_each_entry(node, &(event->listeners.list), list) {
             condition = node->condition;
-            condition->is_true = false;
+            set_condition_state(condition, false);
         }
     }
 
-    //Free any memory allocated.
-    free(checklist);
-    free(rule_is_true);
-    free(rule_was_true);
+    //Give the frame back.
+    _scratch.used = base;
 }
 
 
@@ -282,7 +325,6 @@ void evaluate_policy(void) {
     struct condition_node * node;
     struct condition * condition;
     struct rule * rule;
-    bool last_state;
 
     //For all stateful events, check all conditions.
     list_for_each_entry(event, &events.list, list) {
@@ -290,10 +332,7 @@ void evaluate_policy(void) {
             list_for_each_entry(node, &(event->listeners.list), list) {
                 condition = node->condition;
 
-                last_state = condition->is_true;
-                condition->is_true = condition->type->check(event, &condition->args);
-
-                if (last_state != condition->is_true) {
+                if (update_condition(condition, event)) {
                     xcpmd_log(LOG_DEBUG, "Condition %s became %s.", condition->type->name, condition->is_true ? "true" : "false");
                 }
                 else {
@@ -303,7 +342,8 @@ void evaluate_policy(void) {
         }
     }
 
-    //Then evaluate all rules.
+    //Then evaluate all rules. Each rule keeps count of its true conditions,
+    //so this is a single compare per rule.
     //Perform all rules' undo actions first.
     list_for_each_entry(rule, &rules.list, list) {
         if (evaluate_rule(rule) == false) {
@@ -326,6 +366,40 @@ void evaluate_policy(void) {
 }
 
 
+//Checks a newly added rule's conditions against the current state of their
+//events, and performs its actions if the rule is active. Unlike
+//evaluate_policy(), only this rule's conditions are checked.
+void activate_rule(struct rule * rule) {
+
+    struct condition * condition;
+    struct ev_wrapper * event;
+
+    list_for_each_entry(condition, &(rule->conditions.list), list) {
+        event = condition->type->event;
+        if (event->is_stateless == FALSE) {
+            update_condition(condition, event);
+        }
+    }
+
+    if (evaluate_rule(rule) == true && !rule->is_active) {
+        do_actions(rule);
+        rule->is_active = true;
+    }
+}
+
+
+//Activates the rules added after the specified rule. If tail is null, all
+//rules are activated.
+void activate_rules_after(struct rule * tail) {
+
+    struct list_head * pos;
+
+    for (pos = (tail ? tail->list.next : rules.list.next); pos != &rules.list; pos = pos->next) {
+        activate_rule(list_entry(pos, struct rule, list));
+    }
+}
+
+
 //Load policy from the DB.
 int load_policy_from_db() {
 
@@ -341,10 +415,12 @@ int load_policy_from_db() {
 //See parser.c for information on policy file format.
 int load_policy_from_file(char * filename) {
 
+    struct rule * tail = get_rule_tail();
+
     if (parse_config_from_file(filename) == -1)
         return -1;
 
-    write_db_rules();
+    write_db_rules_after(tail);
     return 0;
 }
 
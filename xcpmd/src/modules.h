@@ -23,6 +23,7 @@
 
 
 struct ev_wrapper;
+struct rule;
 
 
 int init_modules();
@@ -39,6 +40,8 @@ void handle_events(struct ev_wrapper * event);
 int load_policy_from_db();
 int load_policy_from_file(char * filename);
 void evaluate_policy();
+void activate_rule(struct rule * rule);
+void activate_rules_after(struct rule * tail);
 
 bool policy_exists();
 
@@ -37,6 +37,7 @@
 #include "rules.h"
 #include "db-helper.h"
 #include "parser.h"
+#include "modules.h"
 #include "prototypes.h"
 
 // @@DATA_TYPE_MANAGEMENT@@ - Add new types below, and assign an aribrary index
@@ -1672,6 +1673,7 @@ bool parse_rule(char * name,       //rule name
         if (parse_rule_persistent(&data, name, conditions, actions, undos)) {
             rule = get_rule_tail();
             write_db_rule(rule);
+            activate_rule(rule);
             ret = true;
         }
         else {
@@ -1679,6 +1681,7 @@ bool parse_rule(char * name,       //rule name
                 safe_str_append(error, "%s", extract_parse_error(&data));
                 rule = get_rule_tail();
                 write_db_rule(rule);
+                activate_rule(rule);
                 ret = false;
             }
             else {
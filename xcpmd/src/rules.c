@@ -37,13 +37,21 @@ struct ev_wrapper events;
 struct condition_type condition_types;
 struct action_type action_types;
 struct rule rules;
+unsigned int num_rules = 0;
 struct db_var db_vars;
+struct name_hash db_var_hash;
+
+//Name-keyed indexes over the lists above.
+static struct name_hash condition_type_hash;
+static struct name_hash action_type_hash;
+static struct name_hash rule_hash;
 
 
 //Functions
 static char * long_prototype(char * short_prototype);
 static void dec_variable_refs(struct rule * rule);
 static void inc_variable_refs(struct rule * rule);
+static void name_hash_grow(struct name_hash * table);
 
 
 //Initializes all global lists.
@@ -100,6 +108,7 @@ __attribute__ ((destructor)) void uninit_rules() {
         list_del(posi);
         free(tmp_condition_type);
     }
+    name_hash_clear(&condition_type_hash);
 
     //Clean up all action_types.
     list_for_each_safe(posi, i, &action_types.list) {
@@ -107,9 +116,117 @@ __attribute__ ((destructor)) void uninit_rules() {
         list_del(posi);
         free(tmp_action_type);
     }
+    name_hash_clear(&action_type_hash);
 
     //Clean up the db_var cache.
     delete_cached_vars();
+
+    name_hash_clear(&rule_hash);
+    name_hash_clear(&db_var_hash);
+}
+
+
+//Hashes a name string (32-bit FNV-1a).
+unsigned int hash_name(const char * name) {
+
+    unsigned int hash = 2166136261u;
+
+    while (*name) {
+        hash ^= (unsigned char)*name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+//Allocates memory!
+//Adds a node to a name-keyed hash table, growing the table as needed.
+void name_hash_add(struct name_hash * table, struct hash_node * node, const char * name) {
+
+    unsigned int i;
+
+    if (table->buckets == NULL) {
+        for (i = 0; i < NAME_HASH_INITIAL_SIZE; ++i)
+            INIT_LIST_HEAD(&table->initial[i]);
+        table->buckets = table->initial;
+        table->size = NAME_HASH_INITIAL_SIZE;
+    }
+    else if (table->count >= table->size) {
+        name_hash_grow(table);
+    }
+
+    node->hash = hash_name(name);
+    list_add_tail(&node->list, &table->buckets[node->hash & (table->size - 1)]);
+    ++table->count;
+}
+
+
+//Removes a node from a name-keyed hash table.
+void name_hash_del(struct name_hash * table, struct hash_node * node) {
+
+    if (list_empty(&node->list))
+        return;
+
+    list_del_init(&node->list);
+    --table->count;
+}
+
+
+//Frees a table's buckets. Does not free the nodes hashed into it.
+void name_hash_clear(struct name_hash * table) {
+
+    if (table->buckets != table->initial)
+        free(table->buckets);
+    table->buckets = NULL;
+    table->size = 0;
+    table->count = 0;
+}
+
+
+//Gets the chain that a hash falls into, or null if the table is empty.
+struct list_head * name_hash_bucket(struct name_hash * table, unsigned int hash) {
+
+    if (table->buckets == NULL)
+        return NULL;
+
+    return &table->buckets[hash & (table->size - 1)];
+}
+
+
+//Allocates memory!
+//Doubles the bucket count of a table and moves every node over. On allocation
+//failure the old buckets are kept; every node stays hashed, so lookups stay
+//correct, just slower.
+static void name_hash_grow(struct name_hash * table) {
+
+    struct list_head * buckets;
+    struct list_head *pos, *n;
+    struct hash_node * node;
+    unsigned int i, size;
+
+    size = table->size * 2;
+
+    buckets = (struct list_head *)malloc(size * sizeof(struct list_head));
+    if (buckets == NULL) {
+        xcpmd_log(LOG_ERR, "Failed to allocate memory\n");
+        return;
+    }
+
+    for (i = 0; i < size; ++i)
+        INIT_LIST_HEAD(&buckets[i]);
+
+    for (i = 0; i < table->size; ++i) {
+        list_for_each_safe(pos, n, &table->buckets[i]) {
+            node = list_entry(pos, struct hash_node, list);
+            list_add_tail(&node->list, &buckets[node->hash & (size - 1)]);
+        }
+    }
+
+    if (table->buckets != table->initial)
+        free(table->buckets);
+    table->buckets = buckets;
+    table->size = size;
 }
 
 
@@ -157,6 +274,7 @@ struct condition_type * add_condition_type(char * name, bool (* check)(struct ev
     new_condition_type->on_instantiate = on_instantiate;
 
     list_add_tail(&(new_condition_type->list), &(condition_types.list));
+    name_hash_add(&condition_type_hash, &new_condition_type->hash, name);
 
     return new_condition_type;
 }
@@ -179,6 +297,7 @@ struct action_type * add_action_type(char * name, void (* action_func)(struct ar
     new_action_type->pretty_prototype = pretty_prototype;
 
     list_add_tail(&(new_action_type->list), &(action_types.list));
+    name_hash_add(&action_type_hash, &new_action_type->hash, name);
 
     return new_action_type;
 }
@@ -197,6 +316,9 @@ struct rule * new_rule(char * id) {
 
     new_rule->id = id;
     new_rule->is_active = false;
+    new_rule->num_conditions = 0;
+    new_rule->num_true = 0;
+    new_rule->queued_in = 0;
     new_rule->list.next = NULL;
     new_rule->list.prev = NULL;
 
@@ -227,6 +349,7 @@ struct condition * new_condition(struct condition_type * type) {
     }
 
     new_condition->type = type;
+    new_condition->rule = NULL;
     new_condition->is_true = false;
     new_condition->is_inverted = false;
 
@@ -335,6 +458,10 @@ void add_condition_to_rule(struct rule * rule, struct condition * condition) {
     condition->rule = rule;
     list_add_tail(&(condition->list), &(rule->conditions.list));
 
+    ++rule->num_conditions;
+    if (condition->is_true)
+        ++rule->num_true;
+
     //Perform any initialization tasks that need doing.
     if (condition->type->on_instantiate) {
         condition->type->on_instantiate(condition);
@@ -385,6 +512,8 @@ void add_rule(struct rule * rule) {
 
     rule->is_active = false;
     list_add_tail(&(rule->list), &(rules.list));
+    name_hash_add(&rule_hash, &rule->hash, rule->id);
+    ++num_rules;
     inc_variable_refs(rule);
 }
 
@@ -482,6 +611,8 @@ void delete_rule(struct rule * rule) {
     //If this rule has been added to the rule list, remove it and decrement all variable refcounts.
     if ((rule->list.prev != NULL) && (rule->list.next != NULL)) { //These will be null for a rule not in the list.
         list_del(&(rule->list));
+        name_hash_del(&rule_hash, &rule->hash);
+        --num_rules;
         dec_variable_refs(rule);
     }
 
@@ -786,18 +917,14 @@ bool check_action(struct action * action, char ** err) {
 //May free *err and replace with a malloc'd error string.
 int validate_rule(struct rule * rule, char ** err) {
 
-    struct rule * tmp_rule;
     struct condition * tmp_condition;
     struct action * tmp_action;
 
     if (rule->id == NULL || strlen(rule->id) == 0)
         return NO_NAME;
 
-    list_for_each_entry(tmp_rule, &rules.list, list) {
-        if (!strcmp(rule->id, tmp_rule->id)) {
-            return NAME_COLLISION;
-        }
-    }
+    if (lookup_rule(rule->id) != NULL)
+        return NAME_COLLISION;
 
     if (list_empty(&rule->conditions.list)) {
         return NO_CONDITIONS;
@@ -836,9 +963,14 @@ int validate_rule(struct rule * rule, char ** err) {
 struct condition_type * lookup_condition_type(char * type) {
 
     struct condition_type * tmp_type;
+    unsigned int hash = hash_name(type);
+    struct list_head * bucket = name_hash_bucket(&condition_type_hash, hash);
 
-    list_for_each_entry(tmp_type, &(condition_types.list), list) {
-        if (strcmp(tmp_type->name, type) == 0)
+    if (bucket == NULL)
+        return NULL;
+
+    list_for_each_entry(tmp_type, bucket, hash.list) {
+        if (tmp_type->hash.hash == hash && strcmp(tmp_type->name, type) == 0)
             return tmp_type;
     }
 
@@ -850,9 +982,14 @@ struct condition_type * lookup_condition_type(char * type) {
 struct action_type * lookup_action_type(char * type) {
 
     struct action_type * tmp_type;
+    unsigned int hash = hash_name(type);
+    struct list_head * bucket = name_hash_bucket(&action_type_hash, hash);
 
-    list_for_each_entry(tmp_type, &(action_types.list), list) {
-        if (strcmp(tmp_type->name, type) == 0)
+    if (bucket == NULL)
+        return NULL;
+
+    list_for_each_entry(tmp_type, bucket, hash.list) {
+        if (tmp_type->hash.hash == hash && strcmp(tmp_type->name, type) == 0)
             return tmp_type;
     }
 
@@ -864,9 +1001,14 @@ struct action_type * lookup_action_type(char * type) {
 struct rule * lookup_rule(char * id) {
 
     struct rule * tmp_rule;
+    unsigned int hash = hash_name(id);
+    struct list_head * bucket = name_hash_bucket(&rule_hash, hash);
 
-    list_for_each_entry(tmp_rule, &(rules.list), list) {
-        if (strcmp(tmp_rule->id, id) == 0)
+    if (bucket == NULL)
+        return NULL;
+
+    list_for_each_entry(tmp_rule, bucket, hash.list) {
+        if (tmp_rule->hash.hash == hash && strcmp(tmp_rule->id, id) == 0)
             return tmp_rule;
     }
 
@@ -956,17 +1098,32 @@ int list_length(struct list_head * list_head) {
 }
 
 
-//Returns true if all conditions in a rule are true.
-bool evaluate_rule(struct rule * rule) {
+//Sets whether a condition is true, and updates its rule's count of true
+//conditions to match. All changes to a condition's is_true go through here.
+//Returns true if the condition changed.
+bool set_condition_state(struct condition * condition, bool is_true) {
 
-    struct condition * condition;
-    bool pass = true;
+    if (condition->is_true == is_true)
+        return false;
 
-    list_for_each_entry(condition, &(rule->conditions.list), list) {
-        pass &= condition->is_true;
+    condition->is_true = is_true;
+
+    //A condition that is not part of a rule yet is counted when it is added.
+    if (condition->rule != NULL) {
+        if (is_true)
+            ++condition->rule->num_true;
+        else
+            --condition->rule->num_true;
     }
 
-    return pass;
+    return true;
+}
+
+
+//Returns true if all conditions in a rule are true.
+bool evaluate_rule(struct rule * rule) {
+
+    return rule->num_true == rule->num_conditions;
 }
 
 
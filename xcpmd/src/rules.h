@@ -63,6 +63,10 @@
  * closed, or the current battery percentage of the system.
  *
  * An ev_wrapper may have many conditions depending on it, but each condition may depend on only one ev_wrapper.
+ * Together, the listener lists and each condition's rule pointer make up the rule network: an event leads to the
+ * conditions that check it, and a condition to the one rule it belongs to. Each rule counts its true conditions, so a
+ * condition that flips costs one counter update, and a rule is evaluated by comparing its count to its number of
+ * conditions.
  *
  * A list of all ev_wrappers currently tracked is maintained in the global variable events. A module that registers
  * condition_types should also register the ev_wrappers that those condition_types depend on.
@@ -94,6 +98,31 @@ struct condition;
 struct condition_node;
 
 
+//A node in a name-keyed hash table. Structs that are looked up by name embed
+//one of these alongside their list member; the list keeps registration order,
+//and the hash table makes lookups by name constant-time. The full hash of the
+//name is kept so that chains can be screened without a strcmp(), and so the
+//table can grow without rehashing any strings.
+struct hash_node {
+    struct list_head list;
+    unsigned int hash;
+};
+
+
+//A hash table of hash_nodes, chained per bucket. The table starts out on its
+//built-in buckets, so an insertion never fails, and moves to an allocated
+//array that doubles whenever the table averages more than one entry per
+//bucket; a zeroed name_hash is an empty table.
+#define NAME_HASH_INITIAL_SIZE 16
+
+struct name_hash {
+    struct list_head * buckets;
+    unsigned int size;
+    unsigned int count;
+    struct list_head initial[NAME_HASH_INITIAL_SIZE];
+};
+
+
 //A generic argument.
 union arg_u {
     int i;
@@ -145,6 +174,7 @@ struct ev_wrapper {
 //list of condition_types.
 struct condition_type {
     struct list_head list;
+    struct hash_node hash;
     char * name;
     bool (* check)(struct ev_wrapper *, struct arg_node *);
     char * prototype;
@@ -170,6 +200,7 @@ struct condition {
 //of action_types.
 struct action_type {
     struct list_head list;
+    struct hash_node hash;
     char * name;
     void (* action)(struct arg_node *);
     char * prototype;
@@ -191,19 +222,27 @@ struct action {
 //whether this rule is active or inactive, a set of conditions to evaluate, a
 //set of actions to take if this rule moves from inactive to active, and a set
 //of undo actions to take should this rule go from active to inactive.
+//The rule also counts its conditions, and how many of them are true; the
+//count is kept up to date by set_condition_state(), so that evaluating the
+//rule never has to walk its conditions.
 struct rule {
     struct list_head list;
+    struct hash_node hash;
     char * id;
     struct condition conditions;
     struct action actions;
     struct action undos;
     bool is_active;
+    unsigned int num_conditions;
+    unsigned int num_true;
+    unsigned int queued_in; //handle_events() pass that last queued this rule
 };
 
 
 //A linked list node representing a variable from the DB.
 struct db_var {
     struct list_head list;
+    struct hash_node hash;
     char * name;
     struct arg_node value;
     int ref_count;
@@ -214,8 +253,10 @@ struct db_var {
 extern struct condition_type condition_types;
 extern struct action_type action_types;
 extern struct rule rules;
+extern unsigned int num_rules;
 extern struct ev_wrapper events;
 extern struct db_var db_vars;
+extern struct name_hash db_var_hash;
 
 
 //Function prototypes
@@ -249,10 +290,16 @@ bool check_condition(struct condition * condition, char ** err);
 bool check_action(struct action * action, char ** err);
 int validate_rule(struct rule * rule, char ** err);
 
+bool set_condition_state(struct condition * condition, bool is_true);
 bool evaluate_rule(struct rule * rule);
 void do_actions(struct rule * rule);
 void do_undos(struct rule * rule);
 
+unsigned int hash_name(const char * name);
+void name_hash_add(struct name_hash * table, struct hash_node * node, const char * name);
+void name_hash_del(struct name_hash * table, struct hash_node * node);
+void name_hash_clear(struct name_hash * table);
+struct list_head * name_hash_bucket(struct name_hash * table, unsigned int hash);
 struct ev_wrapper * lookup_event(int id);
 struct condition_type * lookup_condition_type(char * type);
 struct action_type * lookup_action_type(char * type);
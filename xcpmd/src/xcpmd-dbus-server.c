@@ -28,6 +28,7 @@
 #include "parser.h"
 #include "db-helper.h"
 #include "battery.h"
+#include "modules.h"
 
 xcdbus_conn_t *xcdbus_conn = NULL;
 
@@ -76,15 +77,20 @@ gboolean xcpmd_remove_rule(XcpmdObject *this, const char* IN_rule_name, GError**
 //in parser.c for file syntax.
 gboolean xcpmd_load_policy_from_file(XcpmdObject *this, const char* IN_filename, GError** error) {
 
+    struct rule * tail = get_rule_tail();
+
     xcpmd_log(LOG_INFO, "Loading policy from file %s.\n", IN_filename);
 
+    //Only the rules this file added need writing back and activating.
     if (parse_config_from_file((char *)IN_filename) != 0) {
         g_set_error(error, DBUS_GERROR, DBUS_GERROR_FAILED, "Error parsing config file--check dom0 syslog");
-        write_db_rules();
+        write_db_rules_after(tail);
+        activate_rules_after(tail);
         return FALSE;
     }
     else {
-        write_db_rules();
+        write_db_rules_after(tail);
+        activate_rules_after(tail);
         return TRUE;
     }
 }
@@ -98,9 +104,11 @@ gboolean xcpmd_load_policy_from_db(XcpmdObject *this, GError** error) {
 
     if (parse_config_from_db() != 0) {
         g_set_error(error, DBUS_GERROR, DBUS_GERROR_FAILED, "Error parsing DB policy--check dom0 syslog");
+        activate_rules_after(NULL);
         return FALSE;
     }
     else {
+        activate_rules_after(NULL);
         print_rules();
         return TRUE;
     }
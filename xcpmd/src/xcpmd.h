@@ -220,6 +220,12 @@ struct battery_status {
 #define BATTERY_LOW_PERCENT       4
 #define BATTERY_CRITICAL_PERCENT  2
 
+/* battery refresh intervals, in seconds */
+#define BATTERY_POLL_MIN_INTERVAL         4   /* polling: right after a change */
+#define BATTERY_POLL_MAX_INTERVAL         16  /* polling: after a run of no changes */
+#define BATTERY_UEVENT_SETTLE_DELAY       1   /* uevents: from a uevent to the refresh */
+#define BATTERY_UEVENT_BACKSTOP_INTERVAL  60  /* uevents: refresh even without a uevent */
+
 #ifndef RUN_STANDALONE
 # ifdef XCPMD_DEBUG
     #define xcpmd_log(priority, format, p...) syslog(priority, format, ##p)